@@ -0,0 +1,298 @@
+// Microbenchmarks for the per-line string kernels.
+//
+// Each kernel is run over three fixed input sets (short lines, long lines
+// and pathological nesting) and reports ns per line and MB/s of input.
+// Build and run with `make bench`; pass a minimum duration per
+// measurement in milliseconds as the first argument (default: 200).
+//
+// Kernels that mutate or consume their input get a fresh copy per call,
+// the cost of which is reported separately as the `strdup` baseline.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compat.h"
+#include "deconstruct.h"
+#include "sourcemap.h"
+#include "fstring.h"
+#include "define.h"
+#include "const.h"
+#include "r.h"
+
+#define SET_LINES 1024
+
+typedef struct {
+  const char *name;
+  char **lines;
+  int count;
+  size_t bytes;
+} InputSet;
+
+typedef void (*Kernel)(char *line, Define **defs);
+
+typedef struct {
+  const char *name;
+  Kernel fn;
+} Bench;
+
+static void bench_strdup(char *line, Define **defs)
+{
+  (void)defs;
+  free(strdup(line));
+}
+
+static void bench_str_replace(char *line, Define **defs)
+{
+  (void)defs;
+  free(str_replace(line, "x", "replacement"));
+}
+
+static void bench_define_replace(char *line, Define **defs)
+{
+  free(define_replace(defs, line));
+}
+
+static void bench_fstring_replace(char *line, Define **defs)
+{
+  (void)defs;
+  char *copy = strdup(line);
+  char *result = fstring_replace(copy, 0);
+  if(result != copy) free(result);
+  free(copy);
+}
+
+static void bench_extract_macro_args(char *line, Define **defs)
+{
+  (void)defs;
+  int nargs = 0;
+  char **args = extract_macro_args(line, &nargs);
+  for(int i = 0; i < nargs; i++) free(args[i]);
+  free(args);
+}
+
+static void bench_extract_function_body(char *line, Define **defs)
+{
+  (void)defs;
+  free(extract_function_body(line));
+}
+
+static void bench_deconstruct_replace(char *line, Define **defs)
+{
+  (void)defs;
+  char *copy = strdup(line);
+  char *result = deconstruct_replace(copy);
+  if(result != copy) free(result);
+  free(copy);
+}
+
+static void bench_replace_const(char *line, Define **defs)
+{
+  (void)defs;
+  char *copy = strdup(line);
+  char *result = replace_const(copy);
+  if(result != copy) free(result);
+  free(copy);
+}
+
+static void bench_add_sourcemap(char *line, Define **defs)
+{
+  (void)defs;
+  free(add_sourcemap(strdup(line), 42, "srcr/bench.R"));
+}
+
+static const Bench BENCHES[] = {
+  {"strdup", bench_strdup},
+  {"str_replace", bench_str_replace},
+  {"define_replace", bench_define_replace},
+  {"fstring_replace", bench_fstring_replace},
+  {"extract_macro_args", bench_extract_macro_args},
+  {"extract_function_body", bench_extract_function_body},
+  {"deconstruct_replace", bench_deconstruct_replace},
+  {"replace_const", bench_replace_const},
+  {"add_sourcemap", bench_add_sourcemap},
+  {NULL, NULL}
+};
+
+// typical source lines, one of each construct the second pass handles
+static const char *SHORT_LINES[] = {
+  "x <- compute(a, b)",
+  "y <- PI * x",
+  "print(..FMT(\"value {x} of {y}\"))",
+  ".[lo, hi, avg] <- get_stats(x)",
+  "LIMIT -< 42",
+  "DEBUG(x)",
+  "  if (x > THRESHOLD) stop(\"too large\")",
+  "# a plain comment",
+  "z <- list(a = 1, b = \"two\", c = c(3, 4))",
+  "f <- function(x, y) { x + y }",
+  "cat(\"at ..FILE..:..LINE..\\n\")",
+  "",
+  NULL
+};
+
+static char *repeat_join(const char *prefix, const char *item, int n, const char *sep, const char *suffix)
+{
+  size_t len = strlen(prefix) + strlen(suffix) + (size_t)n * (strlen(item) + strlen(sep)) + 1;
+  char *out = malloc(len);
+  strcpy(out, prefix);
+  for(int i = 0; i < n; i++) {
+    if(i > 0) strcat(out, sep);
+    strcat(out, item);
+  }
+  strcat(out, suffix);
+  return out;
+}
+
+static char *nest(const char *open, const char *core, const char *close, int depth)
+{
+  size_t len = strlen(core) + (size_t)depth * (strlen(open) + strlen(close)) + 1;
+  char *out = malloc(len);
+  out[0] = '\0';
+  for(int i = 0; i < depth; i++) strcat(out, open);
+  strcat(out, core);
+  for(int i = 0; i < depth; i++) strcat(out, close);
+  return out;
+}
+
+static char *prefixed(const char *prefix, char *owned)
+{
+  char *out = malloc(strlen(prefix) + strlen(owned) + 1);
+  strcpy(out, prefix);
+  strcat(out, owned);
+  free(owned);
+  return out;
+}
+
+static void fill_set(InputSet *set, const char *name, char **templates, int n)
+{
+  set->name = name;
+  set->count = SET_LINES;
+  set->lines = malloc(sizeof(char*) * SET_LINES);
+  set->bytes = 0;
+
+  for(int i = 0; i < SET_LINES; i++) {
+    set->lines[i] = strdup(templates[i % n]);
+    set->bytes += strlen(set->lines[i]) + 1;
+  }
+}
+
+static void free_set(InputSet *set)
+{
+  for(int i = 0; i < set->count; i++) free(set->lines[i]);
+  free(set->lines);
+}
+
+static void make_short(InputSet *set)
+{
+  int n = 0;
+  while(SHORT_LINES[n] != NULL) n++;
+  fill_set(set, "short", (char **)SHORT_LINES, n);
+}
+
+static void make_long(InputSet *set)
+{
+  char *templates[] = {
+    repeat_join("x <- c(", "value_x", 400, ", ", ")"),
+    repeat_join("y <- ", "PI * THRESHOLD", 200, " + ", ""),
+    repeat_join("print(..FMT(\"", "lorem ipsum dolor sit amet ", 60, "", "{x} and {y}\"))"),
+    repeat_join(".[lo, hi, avg] <- get_stats(", "x", 300, " + ", ")"),
+    repeat_join("LIMIT -< c(", "42", 500, ", ", ")"),
+    repeat_join("DEBUG(list(", "x", 300, ", ", "))"),
+    repeat_join("# ", "a long comment line", 100, " ", ""),
+    repeat_join("f <- function(x, y) { ", "x <- x + y", 200, "; ", " }"),
+  };
+  int n = sizeof(templates) / sizeof(templates[0]);
+  fill_set(set, "long", templates, n);
+  for(int i = 0; i < n; i++) free(templates[i]);
+}
+
+static void make_nested(InputSet *set)
+{
+  char *templates[] = {
+    prefixed("x <- ", nest("f(", "x", ")", 200)),
+    prefixed("y <- ", nest("list(a = PI, b = ", "THRESHOLD", ")", 100)),
+    prefixed("f <- function(x) ", nest("{ ", "x", " }", 200)),
+    prefixed("DEBUG", nest("(", "x", ")", 200)),
+    prefixed("s <- ", repeat_join("\"", "\\\"(", 300, "", "\"")),
+    prefixed("z <- ", nest("c(\"{\", ", "x", ", \"}\")", 100)),
+    prefixed("LIMIT -< ", nest("[", "x", "]", 200)),
+    prefixed("print(..FMT(\"{x}\", ", nest("g(", "y", ")", 100)),
+  };
+  int n = sizeof(templates) / sizeof(templates[0]);
+  fill_set(set, "nested", templates, n);
+  for(int i = 0; i < n; i++) free(templates[i]);
+}
+
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void run(const Bench *bench, InputSet *set, Define **defs, double min_ns)
+{
+  // warm up caches and the allocator
+  for(int i = 0; i < set->count; i++) bench->fn(set->lines[i], defs);
+
+  long rounds = 0;
+  double start = now_ns();
+  double elapsed = 0;
+  do {
+    for(int i = 0; i < set->count; i++) bench->fn(set->lines[i], defs);
+    rounds++;
+    elapsed = now_ns() - start;
+  } while(elapsed < min_ns);
+
+  double lines = (double)rounds * set->count;
+  double bytes = (double)rounds * set->bytes;
+  printf(
+    "%-24s %-8s %12.1f %10.1f\n",
+    bench->name, set->name, elapsed / lines, bytes / (elapsed / 1e9) / (1024 * 1024)
+  );
+}
+
+static Define *bench_defines()
+{
+  Define *defs = create_define();
+  overwrite(&defs, "..FILE..", "srcr/bench.R");
+  overwrite(&defs, "..LINE..", "42");
+  capture_define(&defs, "#> define PI 3.14159", NULL);
+  capture_define(&defs, "#> define THRESHOLD 15", NULL);
+  push_macro(
+    &defs,
+    strdup("#> macro\nDEBUG <- function(var) {\n  cat(..var, \" = \", .var, \"\\n\", sep = \"\")\n}"),
+    NULL
+  );
+  return defs;
+}
+
+int main(int argc, char *argv[])
+{
+  double min_ms = 200;
+  if(argc > 1) {
+    min_ms = atof(argv[1]);
+    if(min_ms <= 0) min_ms = 200;
+  }
+
+  Define *defs = bench_defines();
+
+  InputSet sets[3];
+  make_short(&sets[0]);
+  make_long(&sets[1]);
+  make_nested(&sets[2]);
+
+  printf("%-24s %-8s %12s %10s\n", "kernel", "set", "ns/line", "MB/s");
+  for(int b = 0; BENCHES[b].name != NULL; b++) {
+    for(int s = 0; s < 3; s++) {
+      run(&BENCHES[b], &sets[s], &defs, min_ms * 1e6);
+    }
+  }
+
+  for(int s = 0; s < 3; s++) free_set(&sets[s]);
+  free_array(defs);
+
+  return 0;
+}
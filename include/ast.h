@@ -0,0 +1,52 @@
+#ifndef AST_H
+#define AST_H
+
+#include <stddef.h>
+
+// Syntax tree of R code as far as static analysis needs it: names, calls
+// (operators included, with the operator as head) and function
+// definitions. Everything else is a constant. Nodes live in an arena
+// that is freed at once.
+
+typedef struct ArenaBlock_t {
+  struct ArenaBlock_t *next;
+  size_t used;
+  size_t size;
+  char data[];
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock *blocks;
+} Arena;
+
+typedef enum {
+  NODE_CONSTANT,
+  NODE_SYMBOL,
+  NODE_CALL,
+  NODE_FUNCTION
+} NodeKind;
+
+typedef struct Node_t {
+  NodeKind kind;
+  const char *name;       // symbol, or the text of a string constant
+  int line;               // symbol and string: line in the parsed code, 0 if unknown
+  size_t start, end;      // top-level expression: its bytes in the code,
+                          // through the newline or ; ending it; end is 0 if unknown
+  struct Node_t *head;    // call: the function called
+  struct Node_t *args;    // call: arguments, function: parameters
+  struct Node_t *body;    // function
+  struct Node_t *value;   // parameter: its default, NULL if none
+  struct Node_t *next;    // next argument, parameter or expression
+} Node;
+
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+void arena_free(Arena *arena);
+
+Node *ast_node(Arena *arena, NodeKind kind);
+
+// Parses code into a list of top-level expressions linked by `next`.
+// Returns 0 on a syntax error or on syntax the parser does not know.
+int ast_parse(const char *code, Arena *arena, Node **exprs);
+
+#endif
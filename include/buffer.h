@@ -0,0 +1,19 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} Buffer;
+
+void buffer_init(Buffer *buf, size_t cap);
+void buffer_append(Buffer *buf, const char *str);
+void buffer_append_len(Buffer *buf, const char *str, size_t len);
+void buffer_append_char(Buffer *buf, char c);
+char *buffer_release(Buffer *buf);
+void buffer_free(Buffer *buf);
+
+#endif
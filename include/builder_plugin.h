@@ -0,0 +1,38 @@
+#ifndef BUILDER_PLUGIN_H
+#define BUILDER_PLUGIN_H
+
+/*
+ * Native plugin interface. A native plugin is a shared object loaded with
+ * -plugin native:./libplugin.so that exports any of the functions below;
+ * a missing function is a hook the plugin does not use.
+ *
+ * Transforms receive the text as (str, len), str is NULL for an empty
+ * output. They return 0 to leave the text as is, 1 after pointing *out
+ * at a malloc()ed replacement of *out_len bytes (builder frees it), or -1
+ * on error. preprocess and postprocess are called from worker threads,
+ * several files at a time, so they must be reentrant.
+ */
+
+#include <stddef.h>
+
+#define BUILDER_PLUGIN_ABI 1
+
+typedef int (*builder_abi_fn)(void);
+typedef int (*builder_setup_fn)(const char *input, const char *output);
+typedef int (*builder_transform_fn)(const char *str, size_t len, const char *file, char **out, size_t *out_len);
+typedef int (*builder_include_fn)(const char *type, const char *path, const char *object, const char *file, char **out, size_t *out_len);
+typedef void (*builder_end_fn)(void);
+typedef int (*builder_pure_fn)(void);
+
+/*
+ * int builder_plugin_abi(void);    must return BUILDER_PLUGIN_ABI
+ * int builder_setup(const char *input, const char *output);    0 on success
+ * int builder_preprocess(const char *str, size_t len, const char *file, char **out, size_t *out_len);
+ * int builder_postprocess(const char *str, size_t len, const char *file, char **out, size_t *out_len);
+ * int builder_include(const char *type, const char *path, const char *object, const char *file, char **out, size_t *out_len);
+ * void builder_end(void);
+ * int builder_pure(void);    nonzero when transforms only depend on their
+ *                            arguments, so builder may reuse their results
+ */
+
+#endif
@@ -51,9 +51,38 @@ static inline int builder_is_dir(const char *path) {
   return S_ISDIR(st.st_mode);
 }
 
+/* no d_type or openat: classify and open entries by path */
+#include <dirent.h>
+static inline int builder_entry_is_dir(DIR *dir, struct dirent *entry, const char *path) {
+  (void)dir;
+  (void)entry;
+  return builder_is_dir(path);
+}
+
+static inline DIR *builder_opendir_at(DIR *parent, const char *name, const char *path) {
+  (void)parent;
+  (void)name;
+  return opendir(path);
+}
+
+/* shared objects: native plugins are not supported on Windows */
+static inline void *builder_dlopen(const char *path) { (void)path; return NULL; }
+static inline void *builder_dlsym(void *handle, const char *name) { (void)handle; (void)name; return NULL; }
+static inline void builder_dlclose(void *handle) { (void)handle; }
+static inline const char *builder_dlerror(void) { return "native plugins are not supported on Windows"; }
+
+static inline int builder_cpu_count(void) {
+  const char *n = getenv("NUMBER_OF_PROCESSORS");
+  int count = n != NULL ? atoi(n) : 1;
+  return count > 0 ? count : 1;
+}
+
 /* uname: not available on Windows */
 #define BUILDER_NO_UTSNAME 1
 
+/* fork: plugin workers run in-process on Windows */
+#define BUILDER_NO_FORK 1
+
 #else /* POSIX */
 
 #include <unistd.h>
@@ -70,6 +99,45 @@ static inline int builder_is_dir(const char *path) {
   return S_ISDIR(st.st_mode);
 }
 
+#include <dirent.h>
+#include <fcntl.h>
+
+/* d_type from readdir() when the filesystem fills it in, otherwise one
+   fstatat() relative to the open directory; symlinks are followed */
+static inline int builder_entry_is_dir(DIR *dir, struct dirent *entry, const char *path) {
+  (void)path;
+#ifdef DT_UNKNOWN
+  if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) {
+    return entry->d_type == DT_DIR;
+  }
+#endif
+  struct stat st;
+  if (fstatat(dirfd(dir), entry->d_name, &st, 0) != 0) return 0;
+  return S_ISDIR(st.st_mode);
+}
+
+/* opens a subdirectory relative to its parent instead of resolving the
+   whole path again */
+static inline DIR *builder_opendir_at(DIR *parent, const char *name, const char *path) {
+  (void)path;
+  int fd = openat(dirfd(parent), name, O_RDONLY | O_DIRECTORY);
+  if (fd < 0) return NULL;
+  DIR *dir = fdopendir(fd);
+  if (dir == NULL) close(fd);
+  return dir;
+}
+
+#include <dlfcn.h>
+static inline void *builder_dlopen(const char *path) { return dlopen(path, RTLD_NOW | RTLD_LOCAL); }
+static inline void *builder_dlsym(void *handle, const char *name) { return dlsym(handle, name); }
+static inline void builder_dlclose(void *handle) { dlclose(handle); }
+static inline const char *builder_dlerror(void) { return dlerror(); }
+
+static inline int builder_cpu_count(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+}
+
 #endif /* _WIN32 */
 
 #endif /* COMPAT_H */
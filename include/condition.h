@@ -0,0 +1,12 @@
+#ifndef CONDITION_H
+#define CONDITION_H
+
+#include "define.h"
+
+// Returns 1 and sets `result` if `expr` could be evaluated without R
+int evaluate_condition(Define **defs, char *expr, int *result);
+
+// Replaces defined(NAME) by TRUE or FALSE, for conditions R evaluates
+char *replace_defined(Define **defs, char *expr);
+
+#endif
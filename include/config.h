@@ -12,15 +12,22 @@ typedef struct {
   Value *imports;
   Value *plugins_str;
   Value *depends;
+  Value *keep;
   char *prepend;
   char *append;
+  char *symbols;
   Plugins *plugins;
   Registry *registry;
   int argc;
+  int cache;
+  long compress;
   int deadcode;
+  int treeshake;
   int must_clean;
   int sourcemap;
+  int stream;
   int watch;
+  int workers;
 } BuildContext;
 
 int has_config();
@@ -2,7 +2,8 @@
 #define DEADCODE_H
 
 #include <Rinternals.h>
-#include "file.h"
+#include "hash.h"
+#include "parser.h"
 
 typedef struct Binding {
     char *name;
@@ -15,6 +16,7 @@ typedef struct Binding {
 
 typedef struct Environment {
     Binding *bindings;
+    HashMap *index;
     struct Environment *parent;
     int is_global;
 } Environment;
@@ -25,6 +27,16 @@ void env_define(Environment *env, const char *name, int is_func, int line, const
 void env_mark_used(Environment *env, const char *name);
 int is_excluded_name(const char *name);
 
-int analyse_deadcode(RFile *files);
+// writes the code left of an output after tree shaking
+typedef int (*DeadcodeWriter)(char *file, char *code, void *data);
+
+void set_deadcode_cache(int enabled);
+void set_deadcode_symbols(const char *path);
+void set_deadcode_keep(Value *names);
+
+void deadcode_begin(DeadcodeWriter shake, void *data);
+void deadcode_add(const char *code, const char *file);
+int deadcode_report();
+void deadcode_abort();
 
 #endif
@@ -27,12 +27,16 @@ void overwrite(Define **arr, char *name, char *value);
 void push_builtins(Define *arr);
 void free_array(Define *arr);
 void capture_define(Define **defines, char *line, char *ns);
+int parse_define(char *line, char **name, char **value);
+void define_variable(Define **defines, char *name, char *value, char *ns);
 char *define_replace(Define **defines, char *line);
 char *get_define_value(Define **defines, char *name);
 void print_defines(Define *defines);
 void *define_macro_init(char **macro);
 char* str_replace(const char *orig, const char *find, const char *replace);
 void push_macro(Define **defs, char *macro, char *ns);
+int parse_macro(char *macro, char **name, char **body, int *local);
+void define_macro(Define **defs, char *name, char *body, int local, char *ns);
 void increment_counter(Define **arr, char *line);
 int enter_macro(char *line);
 
@@ -0,0 +1,12 @@
+#ifndef DEPARSE_H
+#define DEPARSE_H
+
+#include <Rinternals.h>
+#include "buffer.h"
+
+char *format_real(double x);
+int is_syntactic(const char *name);
+void deparse_string(Buffer *buf, const char *str);
+int deparse_object(Buffer *buf, SEXP x);
+
+#endif
@@ -11,6 +11,7 @@ struct RFile_t {
   char *dst;
   char *content;
   char *ns;
+  int pinned;
   struct RFile_t *next;
 };
 
@@ -20,6 +21,7 @@ typedef int(*Callback)(char *src, char *dst, Define **defs, Plugins *plugins);
 
 struct Arguments_t {
   int deadcode;
+  int treeshake;
   int sourcemap;
   char *src;
   char *dst;
@@ -42,6 +44,8 @@ char *remove_leading_spaces(char *line);
 int collect_files(RFile **files, char *src_dir, char *dst_dir);
 int resolve_imports(RFile **files, Value *cli_imports);
 int two_pass(Arguments *args);
+void set_stream_build(int enabled);
 void free_rfile(RFile *files);
+void clear_import_cache();
 
 #endif
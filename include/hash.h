@@ -0,0 +1,32 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+
+#define HASH_SEED 14695981039346656037ULL
+
+struct HashEntry_t {
+  char *key;
+  void *value;
+  struct HashEntry_t *next;
+};
+
+typedef struct HashEntry_t HashEntry;
+
+typedef struct {
+  HashEntry **buckets;
+  int capacity;
+  int size;
+} HashMap;
+
+typedef void(*HashFree)(void *value);
+
+unsigned long hash_string(const char *str);
+unsigned long long hash_bytes(const void *data, size_t len, unsigned long long seed);
+HashMap *hashmap_create(int capacity);
+void *hashmap_get(HashMap *map, const char *key);
+int hashmap_has(HashMap *map, const char *key);
+void hashmap_set(HashMap *map, const char *key, void *value);
+void hashmap_free(HashMap *map, HashFree free_value);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef IGNORE_H
+#define IGNORE_H
+
+#include <stddef.h>
+
+#define IGNORE_FILE ".builderignore"
+
+struct Ignore_t {
+  char *pattern;
+  int negate;
+  int dir_only;
+  int anchored;
+  struct Ignore_t *next;
+};
+
+typedef struct Ignore_t Ignore;
+
+Ignore *load_ignore(const char *path);
+size_t ignore_prefix(const char *dir);
+int is_ignored(Ignore *rules, const char *path, int is_dir);
+void free_ignore(Ignore *rules);
+
+#endif
@@ -8,6 +8,9 @@ typedef struct {
   char *type;
   char *path;
   char *object;
+  char *mode;
+  char *select;
+  char *where;
 } Include;
 
 struct Registry_t {
@@ -22,5 +25,11 @@ char *include_replace(char *line, Plugins *plugins, char *file, Registry **regis
 Registry *initialize_registry();
 void push_registry(Registry **registry, char *type, char *call);
 void free_registry(Registry *registry);
+void set_include_cache(int enabled);
+void set_include_compress(long threshold);
+void set_include_workers(int workers);
+void prefetch_includes(char *content, Registry **registry);
+void read_includes();
+void clear_include_memo();
 
 #endif
@@ -0,0 +1,11 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+int library_paths(char ***paths);
+char *package_dir(const char *name);
+char *package_version(const char *name);
+int compare_versions(const char *a, const char *b);
+void clear_package_cache();
+void set_package_cache(int enabled);
+
+#endif
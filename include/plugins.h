@@ -1,12 +1,29 @@
 #ifndef PLUGINS_H
 #define PLUGINS_H
 
+#include "builder_plugin.h"
 #include "parser.h"
 #include "r.h"
 
+typedef struct {
+  void *handle;
+  builder_setup_fn setup;
+  builder_transform_fn preprocess;
+  builder_transform_fn postprocess;
+  builder_include_fn include;
+  builder_end_fn end;
+} NativePlugin;
+
+// lifecycle methods other than setup, looked up once by plugins_init()
+#define PLUGIN_HOOKS 6
+
 struct Plugins_t {
   char *name;
   SEXP obj;
+  SEXP hooks[PLUGIN_HOOKS];
+  NativePlugin *native;
+  int pure;
+  char *version;
   struct Plugins_t *next;
   int setup;
 };
@@ -16,7 +33,11 @@ typedef struct Plugins_t Plugins;
 Plugins *plugins_init(Value *plugins, char *input, char *output);
 int plugins_failed(Plugins *head);
 char *plugins_call(Plugins *head, char *fn, char *str, char *file);
+int plugins_batched(Plugins *head, char *fn);
+void plugins_call_all(Plugins *head, char *fn, char **contents, char **files, int n);
 char *plugins_call_include(Plugins *head, char *type, char *path, char *object, char *file);
+void set_plugin_cache(int enabled);
+void set_plugin_workers(int workers);
 void free_plugins(Plugins *head);
 
 #endif
@@ -0,0 +1,35 @@
+#ifndef PRECOMPILE_H
+#define PRECOMPILE_H
+
+#include "define.h"
+
+#define HEADER_EXT ".rhc"
+
+typedef enum {
+  HEADER_DEFINE,
+  HEADER_MACRO,
+  HEADER_PREFLIGHT,
+  HEADER_IMPORT
+} HeaderKind;
+
+// name is the define or macro name, text the define's value, the macro's
+// definition, the preflight code or the import spec
+struct HeaderRecord_t {
+  HeaderKind kind;
+  int line;
+  int local;
+  char *name;
+  char *text;
+  struct HeaderRecord_t *next;
+};
+
+typedef struct HeaderRecord_t HeaderRecord;
+
+HeaderRecord *scan_header(const char *content);
+int apply_header(HeaderRecord *records, Define **defs, char *ns);
+int load_precompiled(const char *src, const char *content, HeaderRecord **records);
+void save_precompiled(const char *src, const char *content, HeaderRecord *records);
+int precompile_header(const char *path);
+void free_header(HeaderRecord *records);
+
+#endif
@@ -8,7 +8,11 @@
 const char *eval_string(char *expr);
 SEXP evaluate(char *expr);
 int evaluate_if(char *expr);
+int evaluate_if_cached(char *expr, int is_volatile);
+void clear_if_cache();
 void set_R_home();
+void start_R();
+void end_R();
 char** extract_macro_args(const char *args_text, int *nargs);
 char* extract_function_body(const char *func_text);
 
@@ -0,0 +1,8 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stddef.h>
+
+char *read_native(const char *call, const char *select, const char *content, size_t size);
+
+#endif
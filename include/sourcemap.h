@@ -1,6 +1,12 @@
 #ifndef SOURCEMAP_H
 #define SOURCEMAP_H
 
+// -sourcemap appends a comment to each line, -sourcemap lines writes
+// #line directives where the mapping to the source breaks
+#define SOURCEMAP_COMMENTS 1
+#define SOURCEMAP_LINES 2
+
 char *add_sourcemap(char *line, int line_number, char *filename);
+char *line_directive(int line_number, char *filename);
 
 #endif
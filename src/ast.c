@@ -0,0 +1,921 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "ast.h"
+
+// A recursive descent parser for R. It follows R's grammar closely enough
+// that names, assignments, calls and function definitions come out as R's
+// own parser would produce them; anything it is unsure about fails the
+// parse, so the caller can fall back to R_ParseVector().
+
+#define ARENA_BLOCK 65536
+#define MAX_AST_DEPTH 512
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+  size = (size + 7) & ~(size_t)7;
+
+  ArenaBlock *block = arena->blocks;
+  if(block == NULL || block->used + size > block->size) {
+    size_t capacity = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+    block = malloc(sizeof(ArenaBlock) + capacity);
+    block->next = arena->blocks;
+    block->used = 0;
+    block->size = capacity;
+    arena->blocks = block;
+  }
+
+  void *ptr = block->data + block->used;
+  block->used += size;
+  return ptr;
+}
+
+char *arena_strndup(Arena *arena, const char *str, size_t len)
+{
+  char *copy = arena_alloc(arena, len + 1);
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+void arena_free(Arena *arena)
+{
+  ArenaBlock *block = arena->blocks;
+  while(block != NULL) {
+    ArenaBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->blocks = NULL;
+}
+
+Node *ast_node(Arena *arena, NodeKind kind)
+{
+  Node *node = arena_alloc(arena, sizeof(Node));
+  memset(node, 0, sizeof(Node));
+  node->kind = kind;
+  return node;
+}
+
+typedef enum {
+  TOKEN_END,
+  TOKEN_ERROR,
+  TOKEN_NEWLINE,
+  TOKEN_SEMICOLON,
+  TOKEN_COMMA,
+  TOKEN_NUMBER,
+  TOKEN_STRING,
+  TOKEN_CONSTANT,
+  TOKEN_NAME,
+  TOKEN_OP,
+  TOKEN_LPAREN,
+  TOKEN_RPAREN,
+  TOKEN_LBRACE,
+  TOKEN_RBRACE,
+  TOKEN_LBRACKET,
+  TOKEN_LBB,
+  TOKEN_RBRACKET,
+  TOKEN_FUNCTION,
+  TOKEN_LAMBDA,
+  TOKEN_IF,
+  TOKEN_ELSE,
+  TOKEN_FOR,
+  TOKEN_IN,
+  TOKEN_WHILE,
+  TOKEN_REPEAT,
+  TOKEN_BREAK,
+  TOKEN_NEXT
+} TokenType;
+
+typedef struct {
+  TokenType type;
+  const char *start;
+  size_t len;
+  int line;
+  const char *begin;      // first byte of the token, quotes included
+} Token;
+
+typedef struct {
+  const char *pos;
+  Token token;
+  Arena *arena;
+  int line;
+  int skip_newlines;
+  int braces;
+  int depth;
+  int failed;
+} Parser;
+
+// lowest to highest
+enum {
+  PREC_HELP = 1,
+  PREC_EQ,
+  PREC_LEFT,
+  PREC_RIGHT,
+  PREC_TILDE,
+  PREC_OR,
+  PREC_AND,
+  PREC_NOT,
+  PREC_COMPARE,
+  PREC_SUM,
+  PREC_PROD,
+  PREC_SPECIAL,
+  PREC_RANGE,
+  PREC_UNARY,
+  PREC_POWER
+};
+
+static const struct {
+  const char *word;
+  TokenType type;
+} KEYWORDS[] = {
+  {"function", TOKEN_FUNCTION}, {"if", TOKEN_IF}, {"else", TOKEN_ELSE},
+  {"for", TOKEN_FOR}, {"in", TOKEN_IN}, {"while", TOKEN_WHILE},
+  {"repeat", TOKEN_REPEAT}, {"break", TOKEN_BREAK}, {"next", TOKEN_NEXT},
+  {"TRUE", TOKEN_CONSTANT}, {"FALSE", TOKEN_CONSTANT}, {"NULL", TOKEN_CONSTANT},
+  {"NA", TOKEN_CONSTANT}, {"NA_integer_", TOKEN_CONSTANT}, {"NA_real_", TOKEN_CONSTANT},
+  {"NA_character_", TOKEN_CONSTANT}, {"NA_complex_", TOKEN_CONSTANT},
+  {"Inf", TOKEN_CONSTANT}, {"NaN", TOKEN_CONSTANT},
+  {NULL, TOKEN_END}
+};
+
+// longest first
+static const char *OPERATORS[] = {
+  "<<-", "->>", ":::", "|>", "||", "&&", "==", "!=", "<=", ">=", "<-", "->",
+  "::", ":=", "**", "+", "-", "*", "/", "^", "<", ">", "!", "&", "|", "~",
+  "?", ":", "=", "$", "@", NULL
+};
+
+static int is_ident_start(const char *s)
+{
+  unsigned char c = (unsigned char)*s;
+  if(c == '.') return !isdigit((unsigned char)s[1]);
+  return isalpha(c) || c >= 0x80;
+}
+
+static int is_ident_char(char c)
+{
+  return isalnum((unsigned char)c) || c == '.' || c == '_' || (unsigned char)c >= 0x80;
+}
+
+static void set_token(Parser *p, TokenType type, const char *start, size_t len)
+{
+  p->token.type = type;
+  p->token.start = start;
+  p->token.len = len;
+}
+
+// strings may span lines
+static void count_lines(Parser *p, const char *start, const char *end)
+{
+  for(; start < end; start++) {
+    if(*start == '\n') p->line++;
+  }
+}
+
+// "...", '...' and `...`; the token is the text between the quotes
+static void lex_quoted(Parser *p, TokenType type)
+{
+  char quote = *p->pos++;
+  const char *start = p->pos;
+
+  while(*p->pos && *p->pos != quote) {
+    if(*p->pos == '\\' && p->pos[1] != '\0') p->pos++;
+    p->pos++;
+  }
+
+  if(*p->pos != quote) {
+    set_token(p, TOKEN_ERROR, start, 0);
+    return;
+  }
+
+  set_token(p, type, start, p->pos - start);
+  count_lines(p, start, p->pos);
+  p->pos++;
+}
+
+// r"(...)", r"[...]", r"{...}" with optional dashes, pos is on the quote
+static void lex_raw_string(Parser *p)
+{
+  char quote = *p->pos++;
+  const char *dashes = p->pos;
+  while(*p->pos == '-') p->pos++;
+  size_t ndash = p->pos - dashes;
+
+  char open = *p->pos;
+  char close = open == '(' ? ')' : open == '[' ? ']' : open == '{' ? '}' : '\0';
+  if(close == '\0') {
+    set_token(p, TOKEN_ERROR, p->pos, 0);
+    return;
+  }
+  p->pos++;
+
+  const char *start = p->pos;
+  for(; *p->pos; p->pos++) {
+    if(*p->pos != close) continue;
+    if(strncmp(p->pos + 1, dashes, ndash) != 0) continue;
+    if(p->pos[1 + ndash] != quote) continue;
+
+    set_token(p, TOKEN_STRING, start, p->pos - start);
+    count_lines(p, start, p->pos);
+    p->pos += ndash + 2;
+    return;
+  }
+
+  set_token(p, TOKEN_ERROR, start, 0);
+}
+
+static void lex_number(Parser *p)
+{
+  const char *start = p->pos;
+
+  if(p->pos[0] == '0' && (p->pos[1] == 'x' || p->pos[1] == 'X')) {
+    p->pos += 2;
+    while(isxdigit((unsigned char)*p->pos) || *p->pos == '.') p->pos++;
+    if(*p->pos == 'p' || *p->pos == 'P') {
+      p->pos++;
+      if(*p->pos == '+' || *p->pos == '-') p->pos++;
+      while(isdigit((unsigned char)*p->pos)) p->pos++;
+    }
+  } else {
+    while(isdigit((unsigned char)*p->pos) || *p->pos == '.') p->pos++;
+    if(*p->pos == 'e' || *p->pos == 'E') {
+      p->pos++;
+      if(*p->pos == '+' || *p->pos == '-') p->pos++;
+      while(isdigit((unsigned char)*p->pos)) p->pos++;
+    }
+  }
+
+  if(*p->pos == 'L' || *p->pos == 'i') p->pos++;
+
+  // 1a is not a number R knows
+  if(is_ident_char(*p->pos)) {
+    set_token(p, TOKEN_ERROR, start, 0);
+    return;
+  }
+
+  set_token(p, TOKEN_NUMBER, start, p->pos - start);
+}
+
+static void lex_ident(Parser *p)
+{
+  const char *start = p->pos;
+  while(is_ident_char(*p->pos)) p->pos++;
+  size_t len = p->pos - start;
+
+  for(int i = 0; KEYWORDS[i].word != NULL; i++) {
+    if(strlen(KEYWORDS[i].word) == len && strncmp(KEYWORDS[i].word, start, len) == 0) {
+      set_token(p, KEYWORDS[i].type, start, len);
+      return;
+    }
+  }
+
+  set_token(p, TOKEN_NAME, start, len);
+}
+
+static void lex(Parser *p)
+{
+  for(;;) {
+    while(*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\r' || *p->pos == '\f') p->pos++;
+
+    if(*p->pos == '#') {
+      while(*p->pos && *p->pos != '\n') p->pos++;
+    }
+
+    const char *start = p->pos;
+    char c = *p->pos;
+    p->token.line = p->line;
+    p->token.begin = start;
+
+    if(c == '\0') {
+      set_token(p, TOKEN_END, start, 0);
+      return;
+    }
+
+    if(c == '\n') {
+      p->pos++;
+      p->line++;
+      if(p->skip_newlines > 0) continue;
+      set_token(p, TOKEN_NEWLINE, start, 1);
+      return;
+    }
+
+    if((c == 'r' || c == 'R') && (p->pos[1] == '"' || p->pos[1] == '\'')) {
+      p->pos++;
+      lex_raw_string(p);
+      return;
+    }
+
+    if(isdigit((unsigned char)c) || (c == '.' && isdigit((unsigned char)p->pos[1]))) {
+      lex_number(p);
+      return;
+    }
+
+    if(is_ident_start(p->pos)) {
+      lex_ident(p);
+      return;
+    }
+
+    if(c == '_' && !is_ident_char(p->pos[1])) {
+      p->pos++;
+      set_token(p, TOKEN_NAME, start, 1);
+      return;
+    }
+
+    switch(c) {
+      case '"':
+      case '\'':
+        lex_quoted(p, TOKEN_STRING);
+        return;
+      case '`':
+        lex_quoted(p, TOKEN_NAME);
+        return;
+      case ';': p->pos++; set_token(p, TOKEN_SEMICOLON, start, 1); return;
+      case ',': p->pos++; set_token(p, TOKEN_COMMA, start, 1); return;
+      case '(': p->pos++; set_token(p, TOKEN_LPAREN, start, 1); return;
+      case ')': p->pos++; set_token(p, TOKEN_RPAREN, start, 1); return;
+      case '{': p->pos++; set_token(p, TOKEN_LBRACE, start, 1); return;
+      case '}': p->pos++; set_token(p, TOKEN_RBRACE, start, 1); return;
+      case ']': p->pos++; set_token(p, TOKEN_RBRACKET, start, 1); return;
+      case '\\': p->pos++; set_token(p, TOKEN_LAMBDA, start, 1); return;
+      case '[':
+        if(p->pos[1] == '[') {
+          p->pos += 2;
+          set_token(p, TOKEN_LBB, start, 2);
+        } else {
+          p->pos++;
+          set_token(p, TOKEN_LBRACKET, start, 1);
+        }
+        return;
+      case '%': {
+        const char *end = p->pos + 1;
+        while(*end && *end != '%' && *end != '\n') end++;
+        if(*end != '%') {
+          set_token(p, TOKEN_ERROR, start, 0);
+          return;
+        }
+        p->pos = end + 1;
+        set_token(p, TOKEN_OP, start, p->pos - start);
+        return;
+      }
+    }
+
+    for(int i = 0; OPERATORS[i] != NULL; i++) {
+      size_t len = strlen(OPERATORS[i]);
+      if(strncmp(p->pos, OPERATORS[i], len) == 0) {
+        p->pos += len;
+        set_token(p, TOKEN_OP, start, len);
+        return;
+      }
+    }
+
+    set_token(p, TOKEN_ERROR, start, 0);
+    return;
+  }
+}
+
+static void advance(Parser *p)
+{
+  lex(p);
+  if(p->token.type == TOKEN_ERROR) {
+    p->failed = 1;
+  }
+}
+
+static void skip_newlines(Parser *p)
+{
+  while(p->token.type == TOKEN_NEWLINE) advance(p);
+}
+
+static int is_op(Parser *p, const char *op)
+{
+  return p->token.type == TOKEN_OP && p->token.len == strlen(op) && strncmp(p->token.start, op, p->token.len) == 0;
+}
+
+static int expect(Parser *p, TokenType type)
+{
+  if(p->token.type != type) {
+    p->failed = 1;
+    return 0;
+  }
+  return 1;
+}
+
+// whether the token after the current one is `=`, used to tell named
+// arguments from expressions
+static int followed_by_equals(Parser *p)
+{
+  const char *pos = p->pos;
+  Token token = p->token;
+  int line = p->line;
+
+  lex(p);
+  int equals = is_op(p, "=");
+
+  p->pos = pos;
+  p->token = token;
+  p->line = line;
+  return equals;
+}
+
+static Node *symbol(Parser *p, const char *name, size_t len, int line)
+{
+  Node *node = ast_node(p->arena, NODE_SYMBOL);
+  node->name = arena_strndup(p->arena, name, len);
+  node->line = line;
+  return node;
+}
+
+static Node *constant(Parser *p)
+{
+  return ast_node(p->arena, NODE_CONSTANT);
+}
+
+static Node *call(Parser *p, Node *head, Node *args)
+{
+  Node *node = ast_node(p->arena, NODE_CALL);
+  node->head = head;
+  node->args = args;
+  return node;
+}
+
+// op(a) or op(a, b), line is the operator's
+static Node *op_call(Parser *p, const char *op, int line, Node *a, Node *b)
+{
+  a->next = b;
+  return call(p, symbol(p, op, strlen(op), line), a);
+}
+
+static Node *parse_expr(Parser *p, int min_prec);
+
+static int binary_prec(Parser *p, int *right)
+{
+  *right = 0;
+  if(p->token.type != TOKEN_OP) return 0;
+
+  if(p->token.start[0] == '%' || is_op(p, "|>")) return PREC_SPECIAL;
+  if(is_op(p, "?")) return PREC_HELP;
+  if(is_op(p, "=")) { *right = 1; return PREC_EQ; }
+  if(is_op(p, "<-") || is_op(p, "<<-") || is_op(p, ":=")) { *right = 1; return PREC_LEFT; }
+  if(is_op(p, "->") || is_op(p, "->>")) return PREC_RIGHT;
+  if(is_op(p, "~")) return PREC_TILDE;
+  if(is_op(p, "||") || is_op(p, "|")) return PREC_OR;
+  if(is_op(p, "&&") || is_op(p, "&")) return PREC_AND;
+  if(is_op(p, "==") || is_op(p, "!=") || is_op(p, "<") || is_op(p, ">") || is_op(p, "<=") || is_op(p, ">=")) return PREC_COMPARE;
+  if(is_op(p, "+") || is_op(p, "-")) return PREC_SUM;
+  if(is_op(p, "*") || is_op(p, "/")) return PREC_PROD;
+  if(is_op(p, ":")) return PREC_RANGE;
+  if(is_op(p, "^") || is_op(p, "**")) { *right = 1; return PREC_POWER; }
+  return 0;
+}
+
+// arguments up to `close`, the current token is the first one after the
+// opening bracket; names are dropped, empty arguments are constants
+static Node *parse_args(Parser *p, TokenType close)
+{
+  Node *args = NULL;
+  Node **tail = &args;
+
+  if(p->token.type == close) {
+    return NULL;
+  }
+
+  while(!p->failed) {
+    Node *value = NULL;
+    TokenType type = p->token.type;
+
+    if((type == TOKEN_NAME || type == TOKEN_STRING || type == TOKEN_CONSTANT) && followed_by_equals(p)) {
+      advance(p);
+      advance(p);
+    }
+
+    if(p->token.type == TOKEN_COMMA || p->token.type == close) {
+      value = constant(p);
+    } else {
+      value = parse_expr(p, PREC_HELP);
+    }
+
+    if(value == NULL) {
+      return NULL;
+    }
+
+    *tail = value;
+    tail = &value->next;
+
+    if(p->token.type == TOKEN_COMMA) {
+      advance(p);
+      continue;
+    }
+
+    expect(p, close);
+    break;
+  }
+
+  return args;
+}
+
+static Node *parse_function(Parser *p)
+{
+  advance(p);
+  if(!expect(p, TOKEN_LPAREN)) return NULL;
+
+  p->skip_newlines++;
+  advance(p);
+
+  Node *node = ast_node(p->arena, NODE_FUNCTION);
+  Node **tail = &node->args;
+
+  while(!p->failed && p->token.type != TOKEN_RPAREN) {
+    if(!expect(p, TOKEN_NAME)) return NULL;
+    Node *param = symbol(p, p->token.start, p->token.len, p->token.line);
+    *tail = param;
+    tail = &param->next;
+    advance(p);
+
+    if(is_op(p, "=")) {
+      advance(p);
+      param->value = parse_expr(p, PREC_HELP);
+      if(param->value == NULL) return NULL;
+    }
+
+    if(p->token.type == TOKEN_COMMA) {
+      advance(p);
+    } else if(!expect(p, TOKEN_RPAREN)) {
+      return NULL;
+    }
+  }
+
+  p->skip_newlines--;
+  advance(p);
+  skip_newlines(p);
+
+  node->body = parse_expr(p, PREC_HELP);
+  return node->body != NULL ? node : NULL;
+}
+
+// `(` cond `)` of if and while
+static Node *parse_condition(Parser *p)
+{
+  advance(p);
+  if(!expect(p, TOKEN_LPAREN)) return NULL;
+
+  p->skip_newlines++;
+  advance(p);
+  Node *cond = parse_expr(p, PREC_HELP);
+  if(cond == NULL || !expect(p, TOKEN_RPAREN)) return NULL;
+
+  p->skip_newlines--;
+  advance(p);
+  skip_newlines(p);
+  return cond;
+}
+
+static Node *parse_if(Parser *p)
+{
+  int line = p->token.line;
+  Node *cond = parse_condition(p);
+  if(cond == NULL) return NULL;
+
+  Node *then = parse_expr(p, PREC_HELP);
+  if(then == NULL) return NULL;
+  cond->next = then;
+
+  // inside braces an else may start the next line
+  if(p->token.type == TOKEN_NEWLINE && p->braces > 0) {
+    const char *pos = p->pos;
+    Token token = p->token;
+    int line = p->line;
+    skip_newlines(p);
+    if(p->token.type != TOKEN_ELSE) {
+      p->pos = pos;
+      p->token = token;
+      p->line = line;
+    }
+  }
+
+  if(p->token.type == TOKEN_ELSE) {
+    advance(p);
+    skip_newlines(p);
+    then->next = parse_expr(p, PREC_HELP);
+    if(then->next == NULL) return NULL;
+  }
+
+  return call(p, symbol(p, "if", 2, line), cond);
+}
+
+static Node *parse_for(Parser *p)
+{
+  int line = p->token.line;
+  advance(p);
+  if(!expect(p, TOKEN_LPAREN)) return NULL;
+
+  p->skip_newlines++;
+  advance(p);
+  if(!expect(p, TOKEN_NAME)) return NULL;
+  Node *var = symbol(p, p->token.start, p->token.len, p->token.line);
+
+  advance(p);
+  if(!expect(p, TOKEN_IN)) return NULL;
+  advance(p);
+
+  Node *seq = parse_expr(p, PREC_HELP);
+  if(seq == NULL || !expect(p, TOKEN_RPAREN)) return NULL;
+
+  p->skip_newlines--;
+  advance(p);
+  skip_newlines(p);
+
+  Node *body = parse_expr(p, PREC_HELP);
+  if(body == NULL) return NULL;
+
+  var->next = seq;
+  seq->next = body;
+  return call(p, symbol(p, "for", 3, line), var);
+}
+
+static Node *parse_braces(Parser *p)
+{
+  int line = p->token.line;
+  int saved = p->skip_newlines;
+  p->skip_newlines = 0;
+  p->braces++;
+  advance(p);
+
+  Node *exprs = NULL;
+  Node **tail = &exprs;
+
+  while(!p->failed) {
+    while(p->token.type == TOKEN_NEWLINE || p->token.type == TOKEN_SEMICOLON) advance(p);
+    if(p->token.type == TOKEN_RBRACE) break;
+
+    Node *expr = parse_expr(p, PREC_HELP);
+    if(expr == NULL) return NULL;
+    *tail = expr;
+    tail = &expr->next;
+
+    TokenType type = p->token.type;
+    if(type != TOKEN_NEWLINE && type != TOKEN_SEMICOLON && type != TOKEN_RBRACE) {
+      p->failed = 1;
+    }
+  }
+
+  if(p->failed) return NULL;
+
+  p->skip_newlines = saved;
+  p->braces--;
+  advance(p);
+  return call(p, symbol(p, "{", 1, line), exprs);
+}
+
+static Node *parse_primary(Parser *p)
+{
+  Token token = p->token;
+
+  switch(token.type) {
+    case TOKEN_NUMBER:
+    case TOKEN_CONSTANT:
+      advance(p);
+      return constant(p);
+
+    case TOKEN_STRING: {
+      // a string called as a function is a name
+      Node *node = constant(p);
+      node->name = arena_strndup(p->arena, token.start, token.len);
+      node->line = token.line;
+      advance(p);
+      return node;
+    }
+
+    case TOKEN_NAME: {
+      Node *node = symbol(p, token.start, token.len, token.line);
+      advance(p);
+
+      if(is_op(p, "::") || is_op(p, ":::")) {
+        char *op = arena_strndup(p->arena, p->token.start, p->token.len);
+        advance(p);
+        if(p->token.type != TOKEN_NAME && p->token.type != TOKEN_STRING) {
+          p->failed = 1;
+          return NULL;
+        }
+        Node *name = symbol(p, p->token.start, p->token.len, p->token.line);
+        advance(p);
+        return op_call(p, op, node->line, node, name);
+      }
+
+      return node;
+    }
+
+    case TOKEN_LPAREN: {
+      p->skip_newlines++;
+      advance(p);
+      Node *inner = parse_expr(p, PREC_HELP);
+      if(inner == NULL || !expect(p, TOKEN_RPAREN)) return NULL;
+      p->skip_newlines--;
+      advance(p);
+      return call(p, symbol(p, "(", 1, token.line), inner);
+    }
+
+    case TOKEN_LBRACE:
+      return parse_braces(p);
+
+    case TOKEN_FUNCTION:
+    case TOKEN_LAMBDA:
+      return parse_function(p);
+
+    case TOKEN_IF:
+      return parse_if(p);
+
+    case TOKEN_FOR:
+      return parse_for(p);
+
+    case TOKEN_WHILE: {
+      Node *cond = parse_condition(p);
+      if(cond == NULL) return NULL;
+      cond->next = parse_expr(p, PREC_HELP);
+      if(cond->next == NULL) return NULL;
+      return call(p, symbol(p, "while", 5, token.line), cond);
+    }
+
+    case TOKEN_REPEAT: {
+      advance(p);
+      skip_newlines(p);
+      Node *body = parse_expr(p, PREC_HELP);
+      if(body == NULL) return NULL;
+      return call(p, symbol(p, "repeat", 6, token.line), body);
+    }
+
+    case TOKEN_BREAK:
+    case TOKEN_NEXT: {
+      Node *node = symbol(p, token.start, token.len, token.line);
+      advance(p);
+      return node;
+    }
+
+    default:
+      p->failed = 1;
+      return NULL;
+  }
+}
+
+static Node *parse_postfix(Parser *p)
+{
+  Node *node = parse_primary(p);
+
+  while(node != NULL && !p->failed) {
+    TokenType type = p->token.type;
+
+    if(type == TOKEN_LPAREN) {
+      if(node->kind == NODE_CONSTANT && node->name != NULL) {
+        node->kind = NODE_SYMBOL;
+      }
+      p->skip_newlines++;
+      advance(p);
+      Node *args = parse_args(p, TOKEN_RPAREN);
+      if(p->failed) return NULL;
+      p->skip_newlines--;
+      advance(p);
+      node = call(p, node, args);
+      continue;
+    }
+
+    if(type == TOKEN_LBRACKET || type == TOKEN_LBB) {
+      int line = p->token.line;
+      p->skip_newlines++;
+      advance(p);
+      Node *args = parse_args(p, TOKEN_RBRACKET);
+      if(p->failed) return NULL;
+      if(type == TOKEN_LBB) {
+        advance(p);
+        if(!expect(p, TOKEN_RBRACKET)) return NULL;
+      }
+      p->skip_newlines--;
+      advance(p);
+
+      node->next = args;
+      node = call(p, symbol(p, type == TOKEN_LBB ? "[[" : "[", type == TOKEN_LBB ? 2 : 1, line), node);
+      continue;
+    }
+
+    if(is_op(p, "$") || is_op(p, "@")) {
+      char *op = arena_strndup(p->arena, p->token.start, 1);
+      int line = p->token.line;
+      advance(p);
+
+      Node *name = NULL;
+      if(p->token.type == TOKEN_NAME) {
+        name = symbol(p, p->token.start, p->token.len, p->token.line);
+      } else if(p->token.type == TOKEN_STRING) {
+        name = constant(p);
+      } else {
+        p->failed = 1;
+        return NULL;
+      }
+      advance(p);
+
+      node = op_call(p, op, line, node, name);
+      continue;
+    }
+
+    break;
+  }
+
+  return node;
+}
+
+static Node *parse_unary(Parser *p)
+{
+  int prec = 0;
+  if(is_op(p, "-") || is_op(p, "+")) prec = PREC_UNARY;
+  else if(is_op(p, "!")) prec = PREC_NOT;
+  else if(is_op(p, "~")) prec = PREC_TILDE + 1;
+  else if(is_op(p, "?")) prec = PREC_HELP + 1;
+
+  if(prec == 0) {
+    return parse_postfix(p);
+  }
+
+  char *op = arena_strndup(p->arena, p->token.start, p->token.len);
+  int line = p->token.line;
+  advance(p);
+  skip_newlines(p);
+
+  Node *operand = parse_expr(p, prec);
+  if(operand == NULL) return NULL;
+  return op_call(p, op, line, operand, NULL);
+}
+
+static Node *parse_expr(Parser *p, int min_prec)
+{
+  if(++p->depth > MAX_AST_DEPTH) {
+    p->failed = 1;
+    return NULL;
+  }
+
+  Node *left = parse_unary(p);
+
+  while(left != NULL && !p->failed) {
+    int right = 0;
+    int prec = binary_prec(p, &right);
+    if(prec == 0 || prec < min_prec) break;
+
+    char *op = arena_strndup(p->arena, p->token.start, p->token.len);
+    int line = p->token.line;
+    advance(p);
+    skip_newlines(p);
+
+    Node *rhs = parse_expr(p, right ? prec : prec + 1);
+    if(rhs == NULL) {
+      left = NULL;
+      break;
+    }
+
+    // a -> b is b <- a
+    if(strcmp(op, "->") == 0) {
+      left = op_call(p, "<-", line, rhs, left);
+    } else if(strcmp(op, "->>") == 0) {
+      left = op_call(p, "<<-", line, rhs, left);
+    } else {
+      left = op_call(p, strcmp(op, "**") == 0 ? "^" : op, line, left, rhs);
+    }
+  }
+
+  p->depth--;
+  return p->failed ? NULL : left;
+}
+
+int ast_parse(const char *code, Arena *arena, Node **exprs)
+{
+  Parser p = {code, {TOKEN_END, code, 0, 1, code}, arena, 1, 0, 0, 0, 0};
+  advance(&p);
+
+  *exprs = NULL;
+  Node **tail = exprs;
+
+  while(!p.failed) {
+    while(p.token.type == TOKEN_NEWLINE || p.token.type == TOKEN_SEMICOLON) advance(&p);
+    if(p.token.type == TOKEN_END) break;
+
+    size_t start = p.token.begin - code;
+    Node *expr = parse_expr(&p, PREC_HELP);
+    if(expr == NULL) break;
+    *tail = expr;
+    tail = &expr->next;
+
+    TokenType type = p.token.type;
+    if(type != TOKEN_NEWLINE && type != TOKEN_SEMICOLON && type != TOKEN_END) {
+      p.failed = 1;
+    }
+
+    expr->start = start;
+    expr->end = p.token.start - code + (type != TOKEN_END);
+  }
+
+  if(p.failed) {
+    *exprs = NULL;
+    return 0;
+  }
+
+  return 1;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+
+void buffer_init(Buffer *buf, size_t cap)
+{
+  if(cap < 64) cap = 64;
+
+  buf->data = malloc(cap);
+  buf->len = 0;
+  buf->cap = buf->data ? cap : 0;
+  if(buf->data != NULL) buf->data[0] = '\0';
+}
+
+static int reserve(Buffer *buf, size_t extra)
+{
+  if(buf->len + extra + 1 <= buf->cap) {
+    return 1;
+  }
+
+  size_t cap = buf->cap ? buf->cap : 64;
+  while(buf->len + extra + 1 > cap) {
+    cap *= 2;
+  }
+
+  char *data = realloc(buf->data, cap);
+  if(data == NULL) {
+    return 0;
+  }
+
+  buf->data = data;
+  buf->cap = cap;
+  return 1;
+}
+
+void buffer_append_len(Buffer *buf, const char *str, size_t len)
+{
+  if(!reserve(buf, len)) {
+    return;
+  }
+
+  memcpy(buf->data + buf->len, str, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+}
+
+void buffer_append(Buffer *buf, const char *str)
+{
+  buffer_append_len(buf, str, strlen(str));
+}
+
+void buffer_append_char(Buffer *buf, char c)
+{
+  buffer_append_len(buf, &c, 1);
+}
+
+// hands the string over to the caller, the buffer is left empty
+char *buffer_release(Buffer *buf)
+{
+  char *data = buf->data;
+  buf->data = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+  return data;
+}
+
+void buffer_free(Buffer *buf)
+{
+  free(buf->data);
+  buf->data = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+}
@@ -0,0 +1,439 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "condition.h"
+#include "deparse.h"
+#include "define.h"
+#include "parser.h"
+
+// Evaluates the subset of R used by most `#> if` guards without R:
+// TRUE/FALSE, numbers, strings, define references, defined(NAME),
+// comparisons and ! && ||. Anything else flags the scanner as failed
+// so the caller can fall back to the embedded R.
+
+static const int MAX_CONDITION_DEPTH = 32;
+
+typedef enum {
+  OPERAND_LOGICAL,
+  OPERAND_NUMBER,
+  OPERAND_STRING
+} OperandType;
+
+typedef struct {
+  OperandType type;
+  int logical;
+  double number;
+  char *string;
+} Operand;
+
+typedef struct {
+  const char *pos;
+  Define **defs;
+  int depth;
+  int failed;
+  int skip;    // inside an operand && or || does not evaluate
+} Scanner;
+
+static Operand parse_or(Scanner *s);
+static Operand parse_primary(Scanner *s);
+
+static Operand make_logical(int value)
+{
+  Operand op = {OPERAND_LOGICAL, value, 0, NULL};
+  return op;
+}
+
+static void free_operand(Operand *op)
+{
+  free(op->string);
+  op->string = NULL;
+}
+
+static void skip_spaces(Scanner *s)
+{
+  while(*s->pos == ' ' || *s->pos == '\t') s->pos++;
+}
+
+static int at_end(Scanner *s)
+{
+  skip_spaces(s);
+  return *s->pos == '\0' || *s->pos == '\n' || *s->pos == '\r' || *s->pos == '#';
+}
+
+static int accept(Scanner *s, const char *token)
+{
+  skip_spaces(s);
+  size_t len = strlen(token);
+  if(strncmp(s->pos, token, len) != 0) return 0;
+  s->pos += len;
+  return 1;
+}
+
+static int is_ident_start(char c)
+{
+  return isalpha((unsigned char)c) || c == '.';
+}
+
+static int is_ident_char(char c)
+{
+  return isalnum((unsigned char)c) || c == '.' || c == '_';
+}
+
+static char *read_ident(Scanner *s)
+{
+  skip_spaces(s);
+  if(!is_ident_start(*s->pos)) return NULL;
+
+  const char *start = s->pos;
+  while(is_ident_char(*s->pos)) s->pos++;
+
+  size_t len = s->pos - start;
+  char *name = malloc(len + 1);
+  strncpy(name, start, len);
+  name[len] = '\0';
+  return name;
+}
+
+static Operand parse_string(Scanner *s)
+{
+  char quote = *s->pos++;
+  const char *start = s->pos;
+  char *out = malloc(strlen(start) + 1);
+  size_t n = 0;
+
+  while(*s->pos && *s->pos != quote) {
+    if(*s->pos != '\\') {
+      out[n++] = *s->pos++;
+      continue;
+    }
+
+    s->pos++;
+    switch(*s->pos) {
+      case '"': case '\'': case '\\': out[n++] = *s->pos; break;
+      case 'n': out[n++] = '\n'; break;
+      case 't': out[n++] = '\t'; break;
+      default:
+        // \x, \u, ... are left to R
+        s->failed = 1;
+        free(out);
+        return make_logical(0);
+    }
+    s->pos++;
+  }
+
+  if(*s->pos != quote) {
+    s->failed = 1;
+    free(out);
+    return make_logical(0);
+  }
+
+  s->pos++;
+  out[n] = '\0';
+
+  Operand op = {OPERAND_STRING, 0, 0, out};
+  return op;
+}
+
+static Operand parse_number(Scanner *s, int negate)
+{
+  char *end = NULL;
+  double value = strtod(s->pos, &end);
+  if(end == s->pos) {
+    s->failed = 1;
+    return make_logical(0);
+  }
+
+  s->pos = end;
+  if(*s->pos == 'L') s->pos++;
+
+  if(is_ident_char(*s->pos)) {
+    s->failed = 1;
+    return make_logical(0);
+  }
+
+  Operand op = {OPERAND_NUMBER, 0, negate ? -value : value, NULL};
+  return op;
+}
+
+// Define values are substituted textually by the R fallback, so only a
+// value that is itself a single operand can be evaluated as one here.
+static Operand resolve_define(Scanner *s, char *name)
+{
+  // R never looks at it, so it may well be undefined
+  if(s->skip) {
+    return make_logical(0);
+  }
+
+  char *value = get_define_value(s->defs, name);
+
+  if(value == NULL || strcmp(value, NO_DEFINITION) == 0 || strcmp(value, DYNAMIC_DEFINITION) == 0) {
+    s->failed = 1;
+    return make_logical(0);
+  }
+
+  if(s->depth >= MAX_CONDITION_DEPTH) {
+    s->failed = 1;
+    return make_logical(0);
+  }
+
+  Scanner sub = {value, s->defs, s->depth + 1, 0, 0};
+  Operand op = parse_primary(&sub);
+  if(sub.failed || !at_end(&sub)) {
+    free_operand(&op);
+    s->failed = 1;
+    return make_logical(0);
+  }
+
+  return op;
+}
+
+static Operand parse_primary(Scanner *s)
+{
+  skip_spaces(s);
+
+  if(*s->pos == '(') {
+    s->pos++;
+    Operand op = parse_or(s);
+    if(!accept(s, ")")) s->failed = 1;
+    return op;
+  }
+
+  if(*s->pos == '"' || *s->pos == '\'') {
+    return parse_string(s);
+  }
+
+  if(*s->pos == '-' && (isdigit((unsigned char)s->pos[1]) || s->pos[1] == '.')) {
+    s->pos++;
+    return parse_number(s, 1);
+  }
+
+  if(isdigit((unsigned char)*s->pos) || (*s->pos == '.' && isdigit((unsigned char)s->pos[1]))) {
+    return parse_number(s, 0);
+  }
+
+  char *name = read_ident(s);
+  if(name == NULL) {
+    s->failed = 1;
+    return make_logical(0);
+  }
+
+  if(strcmp(name, "TRUE") == 0 || strcmp(name, "FALSE") == 0) {
+    int value = name[0] == 'T';
+    free(name);
+    return make_logical(value);
+  }
+
+  if(strcmp(name, "defined") == 0 && accept(s, "(")) {
+    free(name);
+    char *arg = read_ident(s);
+    if(arg == NULL || !accept(s, ")")) {
+      free(arg);
+      s->failed = 1;
+      return make_logical(0);
+    }
+    int value = get_define_value(s->defs, arg) != NULL;
+    free(arg);
+    return make_logical(value);
+  }
+
+  Operand op = resolve_define(s, name);
+  free(name);
+  return op;
+}
+
+// as.character() of an operand
+static char *operand_string(Operand *op)
+{
+  if(op->type == OPERAND_STRING) return strdup(op->string);
+  if(op->type == OPERAND_LOGICAL) return strdup(op->logical ? "TRUE" : "FALSE");
+  return format_real(op->number);
+}
+
+static double operand_number(Operand *op)
+{
+  if(op->type == OPERAND_LOGICAL) return op->logical;
+  return op->number;
+}
+
+static int compare(Scanner *s, Operand *lhs, Operand *rhs, const char *op)
+{
+  int cmp = 0;
+
+  if(lhs->type == OPERAND_STRING || rhs->type == OPERAND_STRING) {
+    // ordering of strings follows the locale's collation in R
+    if(strcmp(op, "==") != 0 && strcmp(op, "!=") != 0) {
+      s->failed = !s->skip;
+      return 0;
+    }
+    char *a = operand_string(lhs);
+    char *b = operand_string(rhs);
+    cmp = strcmp(a, b);
+    free(a);
+    free(b);
+  } else {
+    double a = operand_number(lhs);
+    double b = operand_number(rhs);
+    cmp = (a > b) - (a < b);
+  }
+
+  if(strcmp(op, "==") == 0) return cmp == 0;
+  if(strcmp(op, "!=") == 0) return cmp != 0;
+  if(strcmp(op, "<=") == 0) return cmp <= 0;
+  if(strcmp(op, ">=") == 0) return cmp >= 0;
+  if(strcmp(op, "<") == 0) return cmp < 0;
+  return cmp > 0;
+}
+
+static Operand parse_comparison(Scanner *s)
+{
+  static const char *OPERATORS[] = {"==", "!=", "<=", ">=", "<", ">", NULL};
+
+  Operand lhs = parse_primary(s);
+  if(s->failed) return lhs;
+
+  skip_spaces(s);
+  // `<-` is an assignment, not a comparison
+  if(strncmp(s->pos, "<-", 2) == 0) {
+    s->failed = 1;
+    return lhs;
+  }
+
+  for(int i = 0; OPERATORS[i] != NULL; i++) {
+    if(!accept(s, OPERATORS[i])) continue;
+
+    Operand rhs = parse_primary(s);
+    int result = s->failed ? 0 : compare(s, &lhs, &rhs, OPERATORS[i]);
+    free_operand(&lhs);
+    free_operand(&rhs);
+    return make_logical(result);
+  }
+
+  return lhs;
+}
+
+static int as_logical(Scanner *s, Operand *op)
+{
+  if(op->type == OPERAND_LOGICAL) return op->logical;
+  if(op->type == OPERAND_NUMBER) return op->number != 0;
+  s->failed = !s->skip;
+  return 0;
+}
+
+static Operand parse_not(Scanner *s)
+{
+  skip_spaces(s);
+  if(s->pos[0] == '!' && s->pos[1] != '=') {
+    s->pos++;
+    Operand op = parse_not(s);
+    int value = as_logical(s, &op);
+    free_operand(&op);
+    return make_logical(!value);
+  }
+  return parse_comparison(s);
+}
+
+static Operand parse_and(Scanner *s)
+{
+  Operand lhs = parse_not(s);
+
+  while(!s->failed && accept(s, "&&")) {
+    int value = as_logical(s, &lhs);
+    free_operand(&lhs);
+
+    // the right side is parsed but, as in R, not evaluated after FALSE
+    if(!value) s->skip++;
+    Operand rhs = parse_not(s);
+    if(!value) s->skip--;
+    else value = as_logical(s, &rhs);
+
+    free_operand(&rhs);
+    lhs = make_logical(value);
+  }
+
+  return lhs;
+}
+
+static Operand parse_or(Scanner *s)
+{
+  Operand lhs = parse_and(s);
+
+  while(!s->failed && accept(s, "||")) {
+    int value = as_logical(s, &lhs);
+    free_operand(&lhs);
+
+    if(value) s->skip++;
+    Operand rhs = parse_and(s);
+    if(value) s->skip--;
+    else value = as_logical(s, &rhs);
+
+    free_operand(&rhs);
+    lhs = make_logical(value);
+  }
+
+  return lhs;
+}
+
+int evaluate_condition(Define **defs, char *expr, int *result)
+{
+  Scanner s = {expr, defs, 0, 0, 0};
+
+  Operand op = parse_or(&s);
+
+  if(s.failed || !at_end(&s) || op.type != OPERAND_LOGICAL) {
+    free_operand(&op);
+    return 0;
+  }
+
+  *result = op.logical;
+  return 1;
+}
+
+// R has no defined(), so a condition left to R gets TRUE or FALSE in its
+// place first
+char *replace_defined(Define **defs, char *expr)
+{
+  size_t len = strlen(expr);
+  char *out = malloc(len + 1);
+  size_t n = 0;
+  const char *pos = expr;
+
+  while(*pos) {
+    // strings and backquoted names are copied as they are
+    if(*pos == '"' || *pos == '\'' || *pos == '`') {
+      char quote = *pos;
+      out[n++] = *pos++;
+      while(*pos && *pos != quote) {
+        if(*pos == '\\' && pos[1] != '\0') out[n++] = *pos++;
+        out[n++] = *pos++;
+      }
+      if(*pos) out[n++] = *pos++;
+      continue;
+    }
+
+    int starts_word = pos == expr || !is_ident_char(pos[-1]);
+    if(!starts_word || strncmp(pos, "defined", 7) != 0) {
+      out[n++] = *pos++;
+      continue;
+    }
+
+    Scanner s = {pos + 7, defs, 0, 0, 0};
+    char *name = accept(&s, "(") ? read_ident(&s) : NULL;
+    if(name == NULL || !accept(&s, ")")) {
+      free(name);
+      out[n++] = *pos++;
+      continue;
+    }
+
+    // TRUE and FALSE are never longer than defined(X)
+    const char *value = get_define_value(defs, name) != NULL ? "TRUE" : "FALSE";
+    memcpy(out + n, value, strlen(value));
+    n += strlen(value);
+    pos = s.pos;
+    free(name);
+  }
+
+  out[n] = '\0';
+  return out;
+}
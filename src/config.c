@@ -6,6 +6,7 @@
 #include "parser.h"
 #include "file.h"
 #include "log.h"
+#include "sourcemap.h"
 
 #define MAX_LINE 1024
 
@@ -105,14 +106,21 @@ BuildContext *get_config(Registry **registry)
   ctx->imports = NULL;
   ctx->prepend = NULL;
   ctx->append = NULL;
+  ctx->symbols = NULL;
   ctx->plugins_str = NULL;
   ctx->plugins = NULL;
   ctx->registry = NULL;
   ctx->depends = NULL;
+  ctx->keep = NULL;
+  ctx->cache = 1;
+  ctx->compress = -1;
   ctx->deadcode = 0;
+  ctx->treeshake = 0;
   ctx->sourcemap = 0;
+  ctx->stream = 0;
   ctx->must_clean = 1;
   ctx->watch = 0;
+  ctx->workers = 0;
 
   char line[MAX_LINE];
   while (fgets(line, MAX_LINE, fp) != NULL) {
@@ -139,13 +147,69 @@ BuildContext *get_config(Registry **registry)
       continue;
     }
 
+    if (strstr(line, "symbols:") != NULL) {
+      ctx->symbols = get_value(line);
+      continue;
+    }
+
     if (strstr(line, "deadcode:") != NULL) {
       ctx->deadcode = get_bool(line);
       continue;
     }
 
+    if (strstr(line, "treeshake:") != NULL) {
+      ctx->treeshake = get_bool(line);
+      continue;
+    }
+
+    if (strstr(line, "keep:") != NULL) {
+      Value *keep = parse_values(line);
+      if (ctx->keep == NULL) {
+        ctx->keep = keep;
+      } else {
+        Value *current = ctx->keep;
+        while (current->next != NULL) current = current->next;
+        current->next = keep;
+      }
+      continue;
+    }
+
+    if (strstr(line, "cache:") != NULL) {
+      ctx->cache = get_bool(line);
+      continue;
+    }
+
+    if (strstr(line, "compress:") != NULL) {
+      char *value = get_value(line);
+      if (value != NULL) {
+        ctx->compress = atol(value);
+        free(value);
+      }
+      continue;
+    }
+
+    if (strstr(line, "workers:") != NULL) {
+      char *value = get_value(line);
+      if (value != NULL) {
+        ctx->workers = atoi(value);
+        free(value);
+      }
+      continue;
+    }
+
     if (strstr(line, "sourcemap:") != NULL) {
-      ctx->sourcemap = get_bool(line);
+      char *value = get_value(line);
+      if (value != NULL && strcmp(value, "lines") == 0) {
+        ctx->sourcemap = SOURCEMAP_LINES;
+      } else {
+        ctx->sourcemap = value != NULL && strcmp(value, "true") == 0 ? SOURCEMAP_COMMENTS : 0;
+      }
+      free(value);
+      continue;
+    }
+
+    if (strstr(line, "stream:") != NULL) {
+      ctx->stream = get_bool(line);
       continue;
     }
 
@@ -212,7 +276,9 @@ void free_config(BuildContext *ctx)
   free(ctx->output);
   free(ctx->prepend);
   free(ctx->append);
+  free(ctx->symbols);
   free_value(ctx->depends);
+  free_value(ctx->keep);
   free_value(ctx->imports);
   free_value(ctx->plugins_str);
   free(ctx);
@@ -36,7 +36,7 @@ char *replace_const(char *line)
     }
   }
 
-  char *nl = (char *)malloc(strlen(";lockBinding(\"") + strlen(lhs) + strlen("\", environment());") + 1);
+  char *nl = (char *)malloc(strlen(line) + strlen(";lockBinding(\"") + strlen(lhs) + strlen("\", environment());") + 1);
   strcpy(nl, line);
   strcat(nl, ";lockBinding(\"");
   strcat(nl, lhs);
@@ -1,11 +1,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <regex.h>
+#include <pthread.h>
 #include <Rinternals.h>
 #include <R_ext/Parse.h>
 
+#include "ast.h"
+#include "buffer.h"
+#include "compat.h"
 #include "deadcode.h"
+#include "hash.h"
 #include "log.h"
+#include "r.h"
+
+#define MAX_DEADCODE_THREADS 32
+#define SYMBOLS_DIR ".builder/symbols"
+#define SYMBOLS_VERSION 4
 
 static const char *EXCLUDED_NAMES[] = {
   ".onLoad", ".onUnload", ".onAttach", ".onDetach", ".Last.lib",
@@ -19,6 +31,7 @@ Environment* env_create(Environment *parent)
   if (env == NULL) return NULL;
 
   env->bindings = NULL;
+  env->index = hashmap_create(parent == NULL ? 1024 : 16);
   env->parent = parent;
   env->is_global = (parent == NULL) ? 1 : 0;
   return env;
@@ -36,6 +49,7 @@ void env_free(Environment *env)
     free(b);
     b = next;
   }
+  hashmap_free(env->index, NULL);
   free(env);
 }
 
@@ -48,11 +62,8 @@ void env_free_recursive(Environment *env)
 static Binding* find_binding(Environment *env, const char *name)
 {
   while (env != NULL) {
-    Binding *b = env->bindings;
-    while (b != NULL) {
-      if (strcmp(b->name, name) == 0) return b;
-      b = b->next;
-    }
+    Binding *b = hashmap_get(env->index, name);
+    if (b != NULL) return b;
     env = env->parent;
   }
   return NULL;
@@ -61,12 +72,7 @@ static Binding* find_binding(Environment *env, const char *name)
 static Binding* find_binding_local(Environment *env, const char *name)
 {
   if (env == NULL) return NULL;
-  Binding *b = env->bindings;
-  while (b != NULL) {
-    if (strcmp(b->name, name) == 0) return b;
-    b = b->next;
-  }
-  return NULL;
+  return hashmap_get(env->index, name);
 }
 
 void env_define(Environment *env, const char *name, int is_func, int line, const char *file)
@@ -90,6 +96,7 @@ void env_define(Environment *env, const char *name, int is_func, int line, const
   b->file = file ? strdup(file) : NULL;
   b->next = env->bindings;
   env->bindings = b;
+  hashmap_set(env->index, name, b);
 }
 
 void env_mark_used(Environment *env, const char *name)
@@ -111,153 +118,471 @@ int is_excluded_name(const char *name)
   return 0;
 }
 
-static int is_assignment_symbol(SEXP sym)
+static int is_assignment(Node *head)
 {
-  if (TYPEOF(sym) != SYMSXP) return 0;
-  const char *name = CHAR(PRINTNAME(sym));
-  return (strcmp(name, "<-") == 0 || 
-          strcmp(name, "=") == 0 || 
+  if (head == NULL || head->kind != NODE_SYMBOL) return 0;
+  const char *name = head->name;
+  return (strcmp(name, "<-") == 0 ||
+          strcmp(name, "=") == 0 ||
           strcmp(name, "<<-") == 0 ||
           strcmp(name, "assign") == 0);
 }
 
-static int is_function_call(SEXP sym)
+// Each output is analysed on its own, on a worker thread, into a symbol
+// index: its top-level definitions, its references to names that are not
+// bound locally and the strings that could name a function, with the
+// top-level definition they appear in, and the warnings about function
+// scopes. The indexes are merged into the global
+// environment in file order, so the report reads the same whatever the
+// number of threads.
+//
+// An index is text, one record per line, after a header with a hash of
+// the code it describes:
+//
+//   #> symbols 4 <hash>
+//   D <is function> <expression> <line> <start> <end> <name>
+//   R <line> <enclosing definition> <name>
+//   S <line> <enclosing definition> <string>
+//   W <length>
+//   <warnings>
+//
+// fields are separated by tabs, with \, tabs and newlines in names escaped.
+// start and end are the bytes of a definition that is a top-level
+// expression of its own, 0 for others.
+typedef struct {
+  char *file;
+  char *code;
+  unsigned long long hash;
+  Arena arena;
+  Node *exprs;
+  int parsed;
+  int cached;
+  Environment *scope;
+  Node *top;
+  const char *enclosing;
+  Buffer index;
+  Buffer warnings;
+} FileAnalysis;
+
+static void append_name(Buffer *buf, const char *name)
 {
-  if (TYPEOF(sym) != SYMSXP) return 0;
-  const char *name = CHAR(PRINTNAME(sym));
-  return strcmp(name, "function") == 0;
+  for (; *name; name++) {
+    if (*name == '\\') buffer_append(buf, "\\\\");
+    else if (*name == '\t') buffer_append(buf, "\\t");
+    else if (*name == '\n') buffer_append(buf, "\\n");
+    else buffer_append_char(buf, *name);
+  }
 }
 
-static void walk_expr(SEXP expr, Environment *env, int pass, int line, const char *file);
+static void append_int(Buffer *buf, int value)
+{
+  char num[16];
+  snprintf(num, sizeof(num), "%d", value);
+  buffer_append(buf, num);
+}
 
-static void walk_function_def(SEXP expr, Environment *env, int pass, int line, const char *file)
+static void append_reference(FileAnalysis *fa, char type, Node *node)
 {
-  Environment *func_env = env_create(env);
-  if (func_env == NULL) return;
+  buffer_append_char(&fa->index, type);
+  buffer_append_char(&fa->index, '\t');
+  append_int(&fa->index, node->line);
+  buffer_append_char(&fa->index, '\t');
+  append_name(&fa->index, fa->enclosing != NULL ? fa->enclosing : "");
+  buffer_append_char(&fa->index, '\t');
+  append_name(&fa->index, node->name);
+  buffer_append_char(&fa->index, '\n');
+}
+
+// get("f"), do.call("f", ...) and match.fun("f") reach a function by name
+static int could_name(const char *str)
+{
+  size_t len = strlen(str);
+  if (len == 0 || len > 256) return 0;
+  if (str[0] != '.' && !isalpha((unsigned char)str[0])) return 0;
+
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)str[i];
+    if (!isalnum(c) && c != '.' && c != '_') return 0;
+  }
+  return 1;
+}
+
+static void mark_used(Environment *env, Node *sym, FileAnalysis *fa)
+{
+  for (; env != NULL; env = env->parent) {
+    if (env->is_global) {
+      append_reference(fa, 'R', sym);
+      return;
+    }
 
-  SEXP formals = CADR(expr);
-  while (formals != R_NilValue && TYPEOF(formals) == LISTSXP) {
-    SEXP tag = TAG(formals);
-    if (tag != R_NilValue && TYPEOF(tag) == SYMSXP) {
-      const char *param_name = CHAR(PRINTNAME(tag));
-      env_define(func_env, param_name, 0, line, file);
+    Binding *b = hashmap_get(env->index, sym->name);
+    if (b != NULL) {
+      b->is_used = 1;
+      return;
     }
-    formals = CDR(formals);
   }
+}
+
+static void walk_expr(Node *expr, Environment *env, int pass, int line, FileAnalysis *fa);
+
+// f(x) <- value calls `f<-`, and names(x)[i] <- value calls `[<-` and
+// `names<-`
+static void mark_replacements(Node *lhs, Environment *env, FileAnalysis *fa)
+{
+  for (; lhs != NULL && lhs->kind == NODE_CALL; lhs = lhs->args) {
+    if (lhs->head == NULL || lhs->head->kind != NODE_SYMBOL) return;
+
+    char *name = NULL;
+    asprintf(&name, "%s<-", lhs->head->name);
+    Node ref = *lhs->head;
+    ref.name = name;
+    mark_used(env, &ref, fa);
+    free(name);
+  }
+}
+
+static void walk_function_def(Node *expr, Environment *env, int pass, int line, FileAnalysis *fa)
+{
+  // a body is analysed on its own once the enclosing scope is complete,
+  // anything pass 1 could mark is marked again then
+  if (pass == 1) return;
+
+  Environment *func_env = env_create(env);
+  if (func_env == NULL) return;
 
-  SEXP body = CADDR(expr);
+  for (Node *param = expr->args; param != NULL; param = param->next) {
+    env_define(func_env, param->name, 0, line, fa->file);
+  }
 
   // For local scopes, do both passes in one traversal since func_env
-  // doesn't persist between the global passes
-  walk_expr(body, func_env, 1, line, file);
-  walk_expr(body, func_env, 2, line, file);
-
-  if (pass == 2) {
-    Binding *b = func_env->bindings;
-    while (b != NULL) {
-      if (!b->is_used && !is_excluded_name(b->name)) {
-        printf(
-          "%s Unused %s '%s' in function %s:%d\n", 
-          LOG_WARNING,
-          b->is_function ? "function" : "variable",
-          b->name,
-          b->file ? b->file : "",
-          b->line
-        );
-      }
-      b = b->next;
+  // doesn't persist between the global passes. Defaults are evaluated in
+  // the function's scope, so they see the parameters.
+  for (int local_pass = 1; local_pass <= 2; local_pass++) {
+    for (Node *param = expr->args; param != NULL; param = param->next) {
+      walk_expr(param->value, func_env, local_pass, line, fa);
     }
+    walk_expr(expr->body, func_env, local_pass, line, fa);
+  }
+
+  Binding *b = func_env->bindings;
+  while (b != NULL) {
+    if (!b->is_used && !is_excluded_name(b->name)) {
+      char *warning = NULL;
+      asprintf(
+        &warning,
+        "%s Unused %s '%s' in function %s:%d\n", 
+        LOG_WARNING,
+        b->is_function ? "function" : "variable",
+        b->name,
+        b->file ? b->file : "",
+        b->line
+      );
+      buffer_append(&fa->warnings, warning);
+      free(warning);
+    }
+    b = b->next;
   }
 
   env_free(func_env);
 }
 
-static void walk_expr(SEXP expr, Environment *env, int pass, int line, const char *file)
+static void walk_expr(Node *expr, Environment *env, int pass, int line, FileAnalysis *fa)
 {
-  if (expr == R_NilValue) return;
-
-  int expr_type = TYPEOF(expr);
+  if (expr == NULL) return;
 
-  switch (expr_type) {
-    case SYMSXP: {
+  switch (expr->kind) {
+    case NODE_SYMBOL: {
       if (pass == 2) {
-        const char *name = CHAR(PRINTNAME(expr));
-        env_mark_used(env, name);
+        mark_used(env, expr, fa);
       }
       break;
     }
 
-    case LANGSXP: {
-      SEXP head = CAR(expr);
-
-      if (is_assignment_symbol(head)) {
-        SEXP lhs = CADR(expr);
-        SEXP rhs = CADDR(expr);
+    case NODE_FUNCTION: {
+      walk_function_def(expr, env, pass, line, fa);
+      break;
+    }
 
-        if (TYPEOF(lhs) == SYMSXP) {
-          const char *var_name = CHAR(PRINTNAME(lhs));
+    case NODE_CALL: {
+      if (is_assignment(expr->head)) {
+        Node *lhs = expr->args;
+        Node *rhs = lhs != NULL ? lhs->next : NULL;
 
-          int is_func = 0;
-          if (TYPEOF(rhs) == LANGSXP) {
-            SEXP rhs_head = CAR(rhs);
-            if (is_function_call(rhs_head)) {
-              is_func = 1;
-            }
-          }
+        if (lhs != NULL && lhs->kind == NODE_SYMBOL) {
+          int is_func = rhs != NULL && rhs->kind == NODE_FUNCTION;
 
           if (pass == 1) {
-            env_define(env, var_name, is_func, line, file);
+            env_define(env, lhs->name, is_func, line, fa->file);
           }
 
-          if (is_func) {
-            walk_function_def(rhs, env, pass, line, file);
-          } else {
-            walk_expr(rhs, env, pass, line, file);
+          if (pass == 1 && env->is_global) {
+            int top = expr == fa->top && expr->end > 0;
+            buffer_append(&fa->index, is_func ? "D\t1\t" : "D\t0\t");
+            append_int(&fa->index, line);
+            buffer_append_char(&fa->index, '\t');
+            append_int(&fa->index, lhs->line);
+            buffer_append_char(&fa->index, '\t');
+            append_int(&fa->index, top ? (int)expr->start : 0);
+            buffer_append_char(&fa->index, '\t');
+            append_int(&fa->index, top ? (int)expr->end : 0);
+            buffer_append_char(&fa->index, '\t');
+            append_name(&fa->index, lhs->name);
+            buffer_append_char(&fa->index, '\n');
           }
+
+          // references in a top-level definition belong to it
+          const char *enclosing = fa->enclosing;
+          if (env->is_global) fa->enclosing = lhs->name;
+          walk_expr(rhs, env, pass, line, fa);
+          fa->enclosing = enclosing;
         } else {
-          walk_expr(lhs, env, pass, line, file);
-          walk_expr(rhs, env, pass, line, file);
+          if (pass == 2) mark_replacements(lhs, env, fa);
+          walk_expr(lhs, env, pass, line, fa);
+          walk_expr(rhs, env, pass, line, fa);
         }
-      } else if (is_function_call(head)) {
-        walk_function_def(expr, env, pass, line, file);
       } else {
-        walk_expr(head, env, pass, line, file);
-        SEXP args = CDR(expr);
-        while (args != R_NilValue) {
-          walk_expr(CAR(args), env, pass, line, file);
-          args = CDR(args);
+        walk_expr(expr->head, env, pass, line, fa);
+        for (Node *arg = expr->args; arg != NULL; arg = arg->next) {
+          walk_expr(arg, env, pass, line, fa);
         }
       }
       break;
     }
 
-    case EXPRSXP: {
-      R_xlen_t n = XLENGTH(expr);
-      for (R_xlen_t i = 0; i < n; i++) {
-        walk_expr(VECTOR_ELT(expr, i), env, pass, line, file);
+    case NODE_CONSTANT: {
+      if (pass == 2 && expr->name != NULL && could_name(expr->name)) {
+        append_reference(fa, 'S', expr);
       }
       break;
     }
 
+    default:
+      break;
+  }
+}
+
+static void analyse_file(FileAnalysis *fa)
+{
+  fa->scope = env_create(NULL);
+
+  for (int pass = 1; pass <= 2; pass++) {
+    int line = 1;
+    for (Node *expr = fa->exprs; expr != NULL; expr = expr->next) {
+      fa->top = expr;
+      walk_expr(expr, fa->scope, pass, line++, fa);
+    }
+  }
+
+  if (fa->warnings.data != NULL) {
+    buffer_append(&fa->index, "W\t");
+    append_int(&fa->index, (int)fa->warnings.len);
+    buffer_append_char(&fa->index, '\n');
+    buffer_append_len(&fa->index, fa->warnings.data, fa->warnings.len);
+  }
+
+  env_free(fa->scope);
+  fa->scope = NULL;
+  arena_free(&fa->arena);
+  fa->exprs = NULL;
+}
+
+// Indexes persist in .builder/symbols, one per output file, so a rebuild
+// only parses the outputs whose code changed.
+static int deadcode_cache = 1;
+
+void set_deadcode_cache(int enabled)
+{
+  deadcode_cache = enabled;
+}
+
+static char *index_path(const char *file)
+{
+  char *path = NULL;
+  asprintf(&path, "%s/%016llx", SYMBOLS_DIR, hash_bytes(file, strlen(file), HASH_SEED));
+  return path;
+}
+
+static void index_header(char *header, size_t size, unsigned long long hash)
+{
+  snprintf(header, size, "#> symbols %d %016llx\n", SYMBOLS_VERSION, hash);
+}
+
+static int load_index(FileAnalysis *fa)
+{
+  char *path = index_path(fa->file);
+  FILE *file = fopen(path, "rb");
+  free(path);
+  if (file == NULL) return 0;
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char header[64];
+  index_header(header, sizeof(header), fa->hash);
+  size_t header_len = strlen(header);
+
+  char *data = malloc(size + 1);
+  int ok = size >= (long)header_len && fread(data, 1, size, file) == (size_t)size;
+  fclose(file);
+
+  if (!ok || strncmp(data, header, header_len) != 0) {
+    free(data);
+    return 0;
+  }
+
+  buffer_append_len(&fa->index, data + header_len, size - header_len);
+  free(data);
+  return 1;
+}
+
+static void store_index(FileAnalysis *fa)
+{
+  char *path = index_path(fa->file);
+  char *tmp = NULL;
+  asprintf(&tmp, "%s.tmp", path);
+
+  FILE *file = fopen(tmp, "wb");
+  if (file != NULL) {
+    char header[64];
+    index_header(header, sizeof(header), fa->hash);
+    fputs(header, file);
+    if (fa->index.data != NULL) {
+      fwrite(fa->index.data, 1, fa->index.len, file);
+    }
+
+    if (fclose(file) != 0 || rename(tmp, path) != 0) {
+      remove(tmp);
+    }
+  }
+
+  free(tmp);
+  free(path);
+}
+
+// set by deadcode_begin() when tree shaking
+static DeadcodeWriter shake_writer = NULL;
+static void *shake_data = NULL;
+
+typedef struct {
+  FileAnalysis *files;
+  int count;
+  int start;
+  int step;
+} DeadcodeWork;
+
+static void *analyse_files(void *data)
+{
+  DeadcodeWork *work = data;
+  for (int i = work->start; i < work->count; i += work->step) {
+    FileAnalysis *fa = &work->files[i];
+
+    // tree shaking cuts definitions out of the code
+    int keep_code = shake_writer != NULL;
+
+    if (deadcode_cache && load_index(fa)) {
+      fa->parsed = 1;
+      fa->cached = 1;
+      if (!keep_code) {
+        free(fa->code);
+        fa->code = NULL;
+      }
+      continue;
+    }
+
+    fa->parsed = ast_parse(fa->code, &fa->arena, &fa->exprs);
+    if (!fa->parsed) {
+      arena_free(&fa->arena);
+      continue;
+    }
+
+    if (!keep_code) {
+      free(fa->code);
+      fa->code = NULL;
+    }
+
+    analyse_file(fa);
+    if (deadcode_cache) store_index(fa);
+  }
+  return NULL;
+}
+
+// R's parser, for code the native one does not understand
+static SEXP sym_function;
+
+static Node *from_sexp(SEXP expr, Arena *arena)
+{
+  Node *node = NULL;
+  Node **tail = NULL;
+
+  switch (TYPEOF(expr)) {
+    case SYMSXP: {
+      const char *name = CHAR(PRINTNAME(expr));
+      node = ast_node(arena, NODE_SYMBOL);
+      node->name = arena_strndup(arena, name, strlen(name));
+      return node;
+    }
+
+    case LANGSXP: {
+      if (CAR(expr) == sym_function) {
+        node = ast_node(arena, NODE_FUNCTION);
+        tail = &node->args;
+        for (SEXP formals = CADR(expr); formals != R_NilValue && TYPEOF(formals) == LISTSXP; formals = CDR(formals)) {
+          SEXP tag = TAG(formals);
+          if (tag == R_NilValue || TYPEOF(tag) != SYMSXP) continue;
+          Node *param = from_sexp(tag, arena);
+          if (CAR(formals) != R_MissingArg) param->value = from_sexp(CAR(formals), arena);
+          *tail = param;
+          tail = &param->next;
+        }
+        node->body = from_sexp(CADDR(expr), arena);
+        return node;
+      }
+
+      node = ast_node(arena, NODE_CALL);
+      node->head = from_sexp(CAR(expr), arena);
+      tail = &node->args;
+      for (SEXP args = CDR(expr); args != R_NilValue; args = CDR(args)) {
+        *tail = from_sexp(CAR(args), arena);
+        tail = &(*tail)->next;
+      }
+      return node;
+    }
+
+    case EXPRSXP:
     case VECSXP: {
+      node = ast_node(arena, NODE_CALL);
+      tail = &node->args;
       R_xlen_t n = XLENGTH(expr);
       for (R_xlen_t i = 0; i < n; i++) {
-        walk_expr(VECTOR_ELT(expr, i), env, pass, line, file);
+        *tail = from_sexp(VECTOR_ELT(expr, i), arena);
+        tail = &(*tail)->next;
       }
-      break;
+      return node;
     }
 
     case LISTSXP:
     case DOTSXP: {
-      while (expr != R_NilValue) {
-        walk_expr(CAR(expr), env, pass, line, file);
-        expr = CDR(expr);
+      node = ast_node(arena, NODE_CALL);
+      tail = &node->args;
+      for (; expr != R_NilValue; expr = CDR(expr)) {
+        *tail = from_sexp(CAR(expr), arena);
+        tail = &(*tail)->next;
       }
-      break;
+      return node;
+    }
+
+    case STRSXP: {
+      node = ast_node(arena, NODE_CONSTANT);
+      if (XLENGTH(expr) == 1 && STRING_ELT(expr, 0) != NA_STRING) {
+        const char *str = CHAR(STRING_ELT(expr, 0));
+        node->name = arena_strndup(arena, str, strlen(str));
+      }
+      return node;
     }
 
     default:
-      break;
+      return ast_node(arena, NODE_CONSTANT);
   }
 }
 
@@ -278,96 +603,714 @@ static SEXP parse_code(const char *code)
   return parsed;
 }
 
-static char* read_file(const char *path)
+static int parse_with_R(FileAnalysis *fa)
 {
-  FILE *f = fopen(path, "r");
-  if (f == NULL) return NULL;
+  start_R();
+  sym_function = install("function");
+
+  SEXP parsed = parse_code(fa->code);
+  if (parsed == R_NilValue) {
+    return 0;
+  }
+
+  PROTECT(parsed);
+  Node **tail = &fa->exprs;
+  R_xlen_t n = XLENGTH(parsed);
+  for (R_xlen_t i = 0; i < n; i++) {
+    *tail = from_sexp(VECTOR_ELT(parsed, i), &fa->arena);
+    tail = &(*tail)->next;
+  }
+  UNPROTECT(1);
+
+  return 1;
+}
+
+// Outputs are handed over as the second pass produces them and analysed
+// together once every file has been seen.
+static Environment *global_env = NULL;
+static FileAnalysis *analyses = NULL;
+static int analysis_count = 0;
+static int analysis_capacity = 0;
+static char *symbols_output = NULL;
+static HashMap *keep_names = NULL;
 
-  fseek(f, 0, SEEK_END);
-  long size = ftell(f);
-  fseek(f, 0, SEEK_SET);
+void set_deadcode_symbols(const char *path)
+{
+  free(symbols_output);
+  symbols_output = path != NULL ? strdup(path) : NULL;
+}
+
+// names -treeshake keeps whether or not they are reachable
+void set_deadcode_keep(Value *names)
+{
+  if (keep_names != NULL) hashmap_free(keep_names, NULL);
+  keep_names = hashmap_create(16);
+  for (Value *current = names; current != NULL; current = current->next) {
+    hashmap_set(keep_names, current->name, NULL);
+  }
+}
+
+// with a writer, unreachable functions are dropped from the outputs and
+// the writer is called with the new code of each output that changed
+void deadcode_begin(DeadcodeWriter shake, void *data)
+{
+  global_env = env_create(NULL);
+  analysis_count = 0;
+  shake_writer = shake;
+  shake_data = data;
+}
+
+void deadcode_add(const char *code, const char *file)
+{
+  if (global_env == NULL || code == NULL) return;
+
+  if (analysis_count == analysis_capacity) {
+    analysis_capacity = analysis_capacity ? analysis_capacity * 2 : 64;
+    analyses = realloc(analyses, analysis_capacity * sizeof(FileAnalysis));
+  }
+
+  FileAnalysis *fa = &analyses[analysis_count++];
+  memset(fa, 0, sizeof(FileAnalysis));
+  fa->file = strdup(file);
+  fa->code = strdup(code);
+  fa->hash = hash_bytes(code, strlen(code), HASH_SEED);
+}
+
+typedef struct {
+  char type;
+  int is_function;
+  int expr;
+  int line;
+  size_t start;
+  size_t end;
+  char *enclosing;
+  char *name;
+  const char *warnings;
+  size_t warnings_len;
+} IndexRecord;
+
+// reads the field at *pos up to a tab or the end of the line, unescaped
+static char *next_field(const char **pos)
+{
+  Buffer field = {NULL, 0, 0};
+  const char *p = *pos;
+
+  for (; *p && *p != '\t' && *p != '\n'; p++) {
+    if (*p == '\\' && p[1] != '\0') {
+      p++;
+      buffer_append_char(&field, *p == 't' ? '\t' : *p == 'n' ? '\n' : *p);
+    } else {
+      buffer_append_char(&field, *p);
+    }
+  }
+
+  if (*p == '\t') p++;
+  *pos = p;
+  return field.data != NULL ? buffer_release(&field) : strdup("");
+}
+
+static int next_int(const char **pos)
+{
+  char *field = next_field(pos);
+  int value = atoi(field);
+  free(field);
+  return value;
+}
+
+// reads the record at *pos into record, returns 0 at the end of the index
+static int next_record(const char **pos, IndexRecord *record)
+{
+  const char *p = *pos;
+  memset(record, 0, sizeof(IndexRecord));
+
+  while (*p) {
+    record->type = *p;
+    p += p[1] == '\t' ? 2 : 1;
+
+    if (record->type == 'D') {
+      record->is_function = next_int(&p);
+      record->expr = next_int(&p);
+      record->line = next_int(&p);
+      record->start = next_int(&p);
+      record->end = next_int(&p);
+      record->name = next_field(&p);
+    } else if (record->type == 'R' || record->type == 'S') {
+      record->line = next_int(&p);
+      record->enclosing = next_field(&p);
+      record->name = next_field(&p);
+    } else if (record->type == 'W') {
+      record->warnings_len = next_int(&p);
+      if (*p == '\n') p++;
+      size_t available = strlen(p);
+      if (record->warnings_len > available) record->warnings_len = available;
+      record->warnings = p;
+      *pos = p + record->warnings_len;
+      return 1;
+    }
+
+    while (*p && *p != '\n') p++;
+    if (*p == '\n') p++;
+
+    if (record->name != NULL) {
+      *pos = p;
+      return 1;
+    }
+  }
+
+  *pos = p;
+  return 0;
+}
+
+static void free_record(IndexRecord *record)
+{
+  free(record->enclosing);
+  free(record->name);
+}
+
+// definitions and warnings of a file, in the order they were found
+static void merge_definitions(FileAnalysis *fa)
+{
+  const char *pos = fa->index.data != NULL ? fa->index.data : "";
+  IndexRecord record;
+
+  while (next_record(&pos, &record)) {
+    if (record.type == 'D') {
+      env_define(global_env, record.name, record.is_function, record.expr, fa->file);
+    } else if (record.type == 'W') {
+      fwrite(record.warnings, 1, record.warnings_len, stdout);
+    }
+    free_record(&record);
+  }
+}
 
-  char *content = malloc(size + 1);
-  if (content == NULL) {
-    fclose(f);
+static void merge_references(FileAnalysis *fa)
+{
+  const char *pos = fa->index.data != NULL ? fa->index.data : "";
+  IndexRecord record;
+
+  while (next_record(&pos, &record)) {
+    if (record.type == 'R') {
+      env_mark_used(global_env, record.name);
+    }
+    free_record(&record);
+  }
+}
+
+static void write_json_string(FILE *out, const char *str)
+{
+  fputc('"', out);
+  for (; *str; str++) {
+    unsigned char c = (unsigned char)*str;
+    if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+    else if (c == '\n') fputs("\\n", out);
+    else if (c == '\t') fputs("\\t", out);
+    else if (c < 0x20) fprintf(out, "\\u%04x", c);
+    else fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+// the merged indexes as JSON, for editors: per file, its definitions and
+// its references to package-level names
+static void write_symbols(const char *path)
+{
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    printf("%s Failed to write symbols to %s\n", LOG_ERROR, path);
+    return;
+  }
+
+  fputs("{\n  \"version\": 1,\n  \"files\": [", out);
+
+  int first_file = 1;
+  for (int i = 0; i < analysis_count; i++) {
+    FileAnalysis *fa = &analyses[i];
+    if (!fa->parsed) continue;
+
+    fputs(first_file ? "\n    {\"file\": " : ",\n    {\"file\": ", out);
+    write_json_string(out, fa->file);
+    first_file = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+      char type = pass == 0 ? 'D' : 'R';
+      fputs(pass == 0 ? ",\n     \"definitions\": [" : ",\n     \"references\": [", out);
+
+      const char *pos = fa->index.data != NULL ? fa->index.data : "";
+      IndexRecord record;
+      int first = 1;
+
+      while (next_record(&pos, &record)) {
+        if (record.type == type) {
+          fputs(first ? "\n      {\"name\": " : ",\n      {\"name\": ", out);
+          write_json_string(out, record.name);
+          first = 0;
+
+          if (type == 'D') {
+            Binding *b = hashmap_get(global_env->index, record.name);
+            fprintf(
+              out, ", \"type\": \"%s\", \"line\": %d, \"used\": %s}",
+              record.is_function ? "function" : "variable", record.line,
+              b != NULL && b->is_used ? "true" : "false"
+            );
+          } else {
+            fprintf(out, ", \"line\": %d, \"definition\": ", record.line);
+            if (record.enclosing[0] != '\0') {
+              write_json_string(out, record.enclosing);
+            } else {
+              fputs("null", out);
+            }
+            fputc('}', out);
+          }
+        }
+        free_record(&record);
+      }
+
+      fputs(first ? "]" : "\n     ]", out);
+    }
+
+    fputc('}', out);
+  }
+
+  fputs(first_file ? "]\n}\n" : "\n  ]\n}\n", out);
+
+  if (fclose(out) != 0) {
+    printf("%s Failed to write symbols to %s\n", LOG_ERROR, path);
+  }
+}
+
+// Tree shaking keeps the functions reachable from the roots: NAMESPACE
+// exports and S3 methods, names starting with a dot such as .onLoad,
+// names kept with -keep, top-level variables and the code run at the top
+// level, which covers setMethod() and other registrations. A top-level
+// definition reaches the names and the strings it mentions, a generic
+// reaches the functions named like its methods. Only function
+// definitions that are a top-level expression of their own are dropped,
+// with the roxygen block above them.
+
+typedef struct {
+  char **names;
+  int count;
+  int capacity;
+} NameList;
+
+static void push_name(NameList *list, const char *name)
+{
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 8;
+    list->names = realloc(list->names, list->capacity * sizeof(char*));
+  }
+  list->names[list->count++] = strdup(name);
+}
+
+static void free_names(void *data)
+{
+  NameList *list = data;
+  for (int i = 0; i < list->count; i++) free(list->names[i]);
+  free(list->names);
+  free(list);
+}
+
+static void reach(HashMap *reachable, NameList *queue, const char *name)
+{
+  if (hashmap_has(reachable, name)) return;
+  hashmap_set(reachable, name, NULL);
+  push_name(queue, name);
+}
+
+static void add_callee(HashMap *callees, const char *caller, const char *name)
+{
+  NameList *list = hashmap_get(callees, caller);
+  if (list == NULL) {
+    list = calloc(1, sizeof(NameList));
+    hashmap_set(callees, caller, list);
+  }
+  push_name(list, name);
+}
+
+static char *read_text(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *data = malloc(size + 1);
+  if (size < 0 || fread(data, 1, size, file) != (size_t)size) {
+    free(data);
+    fclose(file);
     return NULL;
   }
 
-  size_t read = fread(content, 1, size, f);
-  content[read] = '\0';
-  fclose(f);
-  return content;
+  data[size] = '\0';
+  fclose(file);
+  return data;
 }
 
-int analyse_deadcode(RFile *files)
+// the parser keeps strings as written, patterns need their escapes resolved
+static char *unescape(const char *str)
 {
-  printf("%s Running dead code analysis...\n", LOG_INFO);
+  Buffer buf = {NULL, 0, 0};
+  for (; *str; str++) {
+    if (*str == '\\' && str[1] != '\0') {
+      str++;
+      buffer_append_char(&buf, *str == 'n' ? '\n' : *str == 't' ? '\t' : *str);
+    } else {
+      buffer_append_char(&buf, *str);
+    }
+  }
+  return buf.data != NULL ? buffer_release(&buf) : strdup("");
+}
 
-  Environment *global_env = env_create(NULL);
-  if (global_env == NULL) return 1;
+static void reach_pattern(HashMap *reachable, NameList *queue, const char *pattern)
+{
+  char *unescaped = unescape(pattern);
+  regex_t regex;
 
-  RFile *current = files;
-  while (current != NULL) {
-    if (current->dst == NULL) {
-      current = current->next;
-      continue;
+  if (regcomp(&regex, unescaped, REG_EXTENDED | REG_NOSUB) != 0) {
+    // a pattern we cannot check could export anything
+    printf("%s Cannot read exportPattern(\"%s\"), keeping every function\n", LOG_WARNING, pattern);
+    for (Binding *b = global_env->bindings; b != NULL; b = b->next) {
+      reach(reachable, queue, b->name);
     }
-    char *content = read_file(current->dst);
-    if (content == NULL) {
-      printf("%s Failed to read %s for dead code analysis\n", LOG_WARNING, current->dst);
-      current = current->next;
-      continue;
+    free(unescaped);
+    return;
+  }
+
+  for (Binding *b = global_env->bindings; b != NULL; b = b->next) {
+    if (regexec(&regex, b->name, 0, NULL, 0) == 0) {
+      reach(reachable, queue, b->name);
     }
+  }
 
-    SEXP parsed = parse_code(content);
-    if (parsed == R_NilValue) {
-      printf("%s Failed to parse %s for dead code analysis\n", LOG_WARNING, current->dst);
-      free(content);
-      current = current->next;
-      continue;
+  regfree(&regex);
+  free(unescaped);
+}
+
+static int is_namespace_op(Node *head)
+{
+  return head != NULL && head->kind == NODE_SYMBOL &&
+         (strcmp(head->name, "::") == 0 || strcmp(head->name, ":::") == 0);
+}
+
+static void namespace_roots(Node *expr, HashMap *reachable, NameList *queue)
+{
+  if (expr == NULL || expr->kind != NODE_CALL) return;
+  if (expr->head == NULL || expr->head->kind != NODE_SYMBOL) return;
+
+  const char *directive = expr->head->name;
+
+  if (strcmp(directive, "if") == 0 || strcmp(directive, "{") == 0) {
+    for (Node *arg = expr->args; arg != NULL; arg = arg->next) {
+      namespace_roots(arg, reachable, queue);
+    }
+    return;
+  }
+
+  if (strcmp(directive, "export") == 0) {
+    for (Node *arg = expr->args; arg != NULL; arg = arg->next) {
+      if (arg->name != NULL) reach(reachable, queue, arg->name);
     }
+    return;
+  }
+
+  if (strcmp(directive, "exportPattern") == 0) {
+    for (Node *arg = expr->args; arg != NULL; arg = arg->next) {
+      if (arg->name != NULL) reach_pattern(reachable, queue, arg->name);
+    }
+    return;
+  }
 
-    PROTECT(parsed);
+  if (strcmp(directive, "S3method") == 0) {
+    Node *generic = expr->args;
+    Node *class = generic != NULL ? generic->next : NULL;
+    Node *method = class != NULL ? class->next : NULL;
+    if (generic == NULL || class == NULL || class->name == NULL) return;
 
-    R_xlen_t n = XLENGTH(parsed);
-    for (R_xlen_t i = 0; i < n; i++) {
-      walk_expr(VECTOR_ELT(parsed, i), global_env, 1, (int)i + 1, current->dst);
+    // S3method(pkg::generic, class) registers a method for another
+    // package's generic, which this package does not define
+    const char *generic_name = generic->name;
+    if (generic->kind == NODE_CALL && is_namespace_op(generic->head) &&
+        generic->args != NULL && generic->args->next != NULL) {
+      generic_name = generic->args->next->name;
+    } else if (generic_name != NULL) {
+      reach(reachable, queue, generic_name);
     }
 
-    UNPROTECT(1);
-    free(content);
-    current = current->next;
+    if (method != NULL && method->name != NULL) {
+      reach(reachable, queue, method->name);
+    } else if (generic_name != NULL) {
+      char *name = NULL;
+      asprintf(&name, "%s.%s", generic_name, class->name);
+      reach(reachable, queue, name);
+      free(name);
+    }
   }
+}
 
-  current = files;
-  while (current != NULL) {
-    if (current->dst == NULL) {
-      current = current->next;
-      continue;
+static int read_namespace(HashMap *reachable, NameList *queue)
+{
+  char *code = read_text("NAMESPACE");
+  if (code == NULL) {
+    printf("%s Tree shaking needs a NAMESPACE to know the exports, nothing dropped\n", LOG_WARNING);
+    return 0;
+  }
+
+  Arena arena = {NULL};
+  Node *exprs = NULL;
+  int parsed = ast_parse(code, &arena, &exprs);
+  if (!parsed) {
+    printf("%s Failed to parse NAMESPACE, nothing dropped\n", LOG_WARNING);
+  }
+
+  for (Node *expr = exprs; expr != NULL; expr = expr->next) {
+    namespace_roots(expr, reachable, queue);
+  }
+
+  arena_free(&arena);
+  free(code);
+  return parsed;
+}
+
+// a definition starting its line takes the roxygen lines right above it
+static size_t doc_start(const char *code, size_t start)
+{
+  if (start > 0 && code[start - 1] != '\n') return start;
+
+  while (start > 0) {
+    size_t line = start - 1;
+    while (line > 0 && code[line - 1] != '\n') line--;
+
+    const char *p = code + line;
+    while (*p == ' ' || *p == '\t') p++;
+    if (strncmp(p, "#'", 2) != 0) break;
+    start = line;
+  }
+
+  return start;
+}
+
+// With -sourcemap lines, the code after a dropped function needs a #line
+// directive of its own, or it would map to the lines of the function.
+// Returns the directive for the line at pos, NULL when no earlier
+// directive maps it.
+static char *directive_at(const char *code, size_t pos)
+{
+  if (code[pos] == '\0' || strncmp(code + pos, "#line ", 6) == 0) return NULL;
+  if (pos > 0 && code[pos - 1] != '\n') return NULL;
+
+  int lines = 0;
+  size_t end = pos;
+  while (end > 0) {
+    size_t begin = end - 1;
+    while (begin > 0 && code[begin - 1] != '\n') begin--;
+
+    if (strncmp(code + begin, "#line ", 6) == 0) {
+      char *rest = NULL;
+      int line = (int)strtol(code + begin + 6, &rest, 10);
+      size_t rest_len = strcspn(rest, "\n");
+
+      char *directive = NULL;
+      asprintf(&directive, "#line %d%.*s\n", line + lines, (int)rest_len, rest);
+      return directive;
     }
-    char *content = read_file(current->dst);
-    if (content == NULL) {
-      current = current->next;
-      continue;
+
+    lines++;
+    end = begin;
+  }
+
+  return NULL;
+}
+
+static int shake_file(FileAnalysis *fa, HashMap *reachable, int *dropped)
+{
+  const char *pos = fa->index.data != NULL ? fa->index.data : "";
+  size_t code_len = strlen(fa->code);
+  size_t copied = 0;
+  int count = 0;
+  Buffer out = {NULL, 0, 0};
+  IndexRecord record;
+
+  while (next_record(&pos, &record)) {
+    int drop = record.type == 'D' && record.is_function && record.end > 0 &&
+      record.end <= code_len && record.start >= copied &&
+      !hashmap_has(reachable, record.name);
+
+    if (drop) {
+      size_t start = doc_start(fa->code, record.start);
+      if (start < copied) start = copied;
+
+      buffer_append_len(&out, fa->code + copied, start - copied);
+      copied = record.end;
+      if (fa->code[copied - 1] == ';') {
+        while (fa->code[copied] == ' ' || fa->code[copied] == '\t') copied++;
+      }
+      count++;
+
+      char *directive = directive_at(fa->code, copied);
+      if (directive != NULL) {
+        buffer_append(&out, directive);
+        free(directive);
+      }
+
+      printf("%s Dropped unreachable function '%s' - %s:%d\n", LOG_INFO, record.name, fa->file, record.line);
     }
+    free_record(&record);
+  }
 
-    SEXP parsed = parse_code(content);
-    if (parsed == R_NilValue) {
-      free(content);
-      current = current->next;
-      continue;
+  if (count == 0) return 1;
+
+  buffer_append_len(&out, fa->code + copied, code_len - copied);
+  *dropped += count;
+
+  int ok = shake_writer(fa->file, out.data, shake_data);
+  if (!ok) {
+    printf("%s Failed to write %s after tree shaking\n", LOG_ERROR, fa->file);
+  }
+
+  buffer_free(&out);
+  return ok;
+}
+
+static int treeshake()
+{
+  HashMap *reachable = hashmap_create(1024);
+  NameList queue = {NULL, 0, 0};
+
+  if (!read_namespace(reachable, &queue)) {
+    hashmap_free(reachable, NULL);
+    free(queue.names);
+    return 0;
+  }
+
+  if (keep_names != NULL) {
+    for (int i = 0; i < keep_names->capacity; i++) {
+      for (HashEntry *entry = keep_names->buckets[i]; entry != NULL; entry = entry->next) {
+        reach(reachable, &queue, entry->key);
+      }
     }
+  }
 
-    PROTECT(parsed);
+  HashMap *callees = hashmap_create(1024);
 
-    R_xlen_t n = XLENGTH(parsed);
-    for (R_xlen_t i = 0; i < n; i++) {
-      walk_expr(VECTOR_ELT(parsed, i), global_env, 2, (int)i + 1, current->dst);
+  for (int i = 0; i < analysis_count; i++) {
+    FileAnalysis *fa = &analyses[i];
+    if (!fa->parsed) continue;
+
+    const char *pos = fa->index.data != NULL ? fa->index.data : "";
+    IndexRecord record;
+
+    while (next_record(&pos, &record)) {
+      if (record.type == 'D') {
+        if (!record.is_function || is_excluded_name(record.name)) {
+          reach(reachable, &queue, record.name);
+        }
+
+        // print.foo is a method that print() may dispatch to
+        for (const char *dot = strchr(record.name + 1, '.'); dot != NULL; dot = strchr(dot + 1, '.')) {
+          char *generic = NULL;
+          asprintf(&generic, "%.*s", (int)(dot - record.name), record.name);
+          add_callee(callees, generic, record.name);
+          free(generic);
+        }
+      } else if (record.type == 'R' || record.type == 'S') {
+        if (record.enclosing[0] == '\0') {
+          reach(reachable, &queue, record.name);
+        } else {
+          add_callee(callees, record.enclosing, record.name);
+        }
+      }
+      free_record(&record);
+    }
+  }
+
+  for (int i = 0; i < queue.count; i++) {
+    NameList *list = hashmap_get(callees, queue.names[i]);
+    if (list == NULL) continue;
+    for (int j = 0; j < list->count; j++) {
+      reach(reachable, &queue, list->names[j]);
+    }
+  }
+
+  int ok = 1;
+  int dropped = 0;
+  for (int i = 0; i < analysis_count; i++) {
+    FileAnalysis *fa = &analyses[i];
+    if (fa->parsed && fa->code != NULL) {
+      ok = shake_file(fa, reachable, &dropped) && ok;
     }
+  }
+
+  if (dropped > 0) {
+    printf("%s Tree shaking dropped %d unreachable function(s)\n", LOG_INFO, dropped);
+  } else {
+    printf("%s Tree shaking found no unreachable function\n", LOG_INFO);
+  }
 
-    UNPROTECT(1);
-    free(content);
-    current = current->next;
+  hashmap_free(callees, free_names);
+  hashmap_free(reachable, NULL);
+  for (int i = 0; i < queue.count; i++) free(queue.names[i]);
+  free(queue.names);
+  return ok;
+}
+
+int deadcode_report()
+{
+  if (global_env == NULL) return 1;
+
+  printf("%s Running dead code analysis...\n", LOG_INFO);
+
+  if (deadcode_cache) {
+    builder_mkdir(".builder", 0755);
+    builder_mkdir(SYMBOLS_DIR, 0755);
+  }
+
+  int nthreads = builder_cpu_count();
+  if (nthreads > analysis_count) nthreads = analysis_count;
+  if (nthreads > MAX_DEADCODE_THREADS) nthreads = MAX_DEADCODE_THREADS;
+
+  pthread_t threads[MAX_DEADCODE_THREADS];
+  int started[MAX_DEADCODE_THREADS];
+  DeadcodeWork work[MAX_DEADCODE_THREADS];
+
+  for (int t = 0; t < nthreads; t++) {
+    work[t] = (DeadcodeWork){analyses, analysis_count, t, nthreads};
+    started[t] = nthreads > 1 && pthread_create(&threads[t], NULL, analyse_files, &work[t]) == 0;
+    if (!started[t]) {
+      analyse_files(&work[t]);
+    }
+  }
+
+  for (int t = 0; t < nthreads; t++) {
+    if (started[t]) pthread_join(threads[t], NULL);
+  }
+
+  int cached = 0;
+  for (int i = 0; i < analysis_count; i++) {
+    FileAnalysis *fa = &analyses[i];
+    cached += fa->cached;
+    if (fa->parsed) continue;
+
+    fa->parsed = parse_with_R(fa);
+    if (!fa->parsed) {
+      printf("%s Failed to parse %s for dead code analysis\n", LOG_WARNING, fa->file);
+      continue;
+    }
+    analyse_file(fa);
+    if (deadcode_cache) store_index(fa);
+  }
+
+  if (cached > 0) {
+    printf("%s Reused the symbol index of %d of %d file(s)\n", LOG_INFO, cached, analysis_count);
+  }
+
+  for (int i = 0; i < analysis_count; i++) {
+    if (analyses[i].parsed) merge_definitions(&analyses[i]);
+  }
+
+  for (int i = 0; i < analysis_count; i++) {
+    if (analyses[i].parsed) merge_references(&analyses[i]);
   }
 
   int unused_count = 0;
@@ -393,6 +1336,38 @@ int analyse_deadcode(RFile *files)
     printf("%s Found %d unused variable(s)/function(s)\n", LOG_WARNING, unused_count);
   }
 
+  if (symbols_output != NULL) {
+    write_symbols(symbols_output);
+  }
+
+  int result = 0;
+  if (shake_writer != NULL && !treeshake()) {
+    result = 1;
+  }
+
+  deadcode_abort();
+  return result;
+}
+
+// drops the collected outputs and bindings without reporting
+void deadcode_abort()
+{
+  for (int i = 0; i < analysis_count; i++) {
+    FileAnalysis *fa = &analyses[i];
+    free(fa->file);
+    free(fa->code);
+    arena_free(&fa->arena);
+    env_free(fa->scope);
+    buffer_free(&fa->index);
+    buffer_free(&fa->warnings);
+  }
+  free(analyses);
+  analyses = NULL;
+  analysis_count = 0;
+  analysis_capacity = 0;
+
   env_free(global_env);
-  return 0;
+  global_env = NULL;
+  shake_writer = NULL;
+  shake_data = NULL;
 }
@@ -86,13 +86,9 @@ char *deconstruct_replace(char *line)
       buffer[buffer_len] = '\0';
       buffer_len = 0;
       push_var(&vars, buffer);
+      if(line[i] == ']') break;
       continue;
     }
-
-    if(deconstruct && line[i] == ']') {
-      deconstruct = 0;
-      break;
-    }
   }
 
   if(vars == NULL) {
@@ -100,10 +96,19 @@ char *deconstruct_replace(char *line)
   }
 
   char *subbed = strstr(line, " <-");
+  if(subbed == NULL) {
+    free_var(vars);
+    return line;
+  }
   if(subbed[strlen(subbed) - 1] == '\n') { 
     subbed[strlen(subbed) - 1] = '\0';
   }
-  char new[1024];
+
+  size_t new_len = strlen(".destructure_tmp_") + strlen(subbed) + 1;
+  for(Var *v = vars; v != NULL; v = v->next) {
+    new_len += strlen(v->value) + strlen("\n <- .destructure_tmp_[[]]") + 32;
+  }
+  char *new = malloc(new_len);
   char str[32];
 
   // First: assign RHS to temp variable (evaluated once)
@@ -124,7 +129,6 @@ char *deconstruct_replace(char *line)
     i++;
   }
 
-  char *result = strdup(new);
   free_var(vars);
-  return result;
+  return new;
 }
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdlib.h> 
 #include <time.h>
+#include <ctype.h>
 
 #include "compat.h"
 
@@ -197,30 +198,30 @@ void *define_macro_init(char **macro)
   return *macro;
 }
 
-void push_macro(Define **defs, char *macro, char *ns)
+// Name, definition and scope of a "#> macro" block, the definition being
+// everything after the directive line. 0 when the block defines nothing.
+int parse_macro(char *macro, char **name, char **body, int *local)
 {
-  int local = 0;
+  *local = 0;
   char *p_orig = strdup(macro);
   char *p = strstr(p_orig, "#> macro ");
   if(p != NULL) {
     p += 9;
     strtok(p, "\n");
-    local = strcmp(p, "local") == 0;
+    *local = strcmp(p, "local") == 0;
   }
 
   free(p_orig);
 
-  char *original_macro = macro;
   macro = strchr(macro, '\n');
   if(macro == NULL) {
-    return;
+    return 0;
   }
   macro++;
 
   char *arrow = strstr(macro, "<-");
   if(arrow == NULL) {
-    free(original_macro);
-    return;
+    return 0;
   }
 
   int temp_nargs;
@@ -230,8 +231,7 @@ void push_macro(Define **defs, char *macro, char *ns)
       printf("%s Macro argument '%s' cannot start with '.'\n", LOG_ERROR, temp_args[i]);
       for(int j = 0; j < temp_nargs; j++) free(temp_args[j]);
       free(temp_args);
-      free(original_macro);
-      return;
+      return 0;
     }
   }
 
@@ -242,47 +242,100 @@ void push_macro(Define **defs, char *macro, char *ns)
   while(len > 0 && (macro[len - 1] == ' ' || macro[len - 1] == '\t')) {
     len--;
   }
-  char* name = malloc(len + 1);
-  strncpy(name, macro, len);
-  name[len] = '\0';
+  *name = malloc(len + 1);
+  memcpy(*name, macro, len);
+  (*name)[len] = '\0';
+  *body = strdup(macro);
+  return 1;
+}
 
+void define_macro(Define **defs, char *name, char *body, int local, char *ns)
+{
+  char *full = NULL;
   if(ns != NULL) {
-    char *prefixed = malloc(strlen(ns) + 2 + strlen(name) + 1);
-    sprintf(prefixed, "%s::%s", ns, name);
+    asprintf(&full, "%s::%s", ns, name);
+  } else {
+    full = strdup(name);
+  }
+
+  push((*defs), full, strdup(body), DEF_FUNCTION, !local);
+}
+
+void push_macro(Define **defs, char *macro, char *ns)
+{
+  char *name = NULL;
+  char *body = NULL;
+  int local = 0;
+
+  if(parse_macro(macro, &name, &body, &local)) {
+    define_macro(defs, name, body, local, ns);
     free(name);
-    name = prefixed;
+    free(body);
   }
 
-  push((*defs), strdup(name), strdup(macro), DEF_FUNCTION, !local);
-  free(name);
-  free(original_macro);
+  free(macro);
 }
 
-void capture_define(Define **defines, char *line, char *ns)
+// Name and value of a "#> define NAME value" line, 0 when either is
+// missing
+int parse_define(char *line, char **name, char **value)
 {
   if(strncmp(line, "#> define", 9) != 0) {
-    return;
+    return 0;
   }
 
-  char name[256];
-  char value[256];
-  if(sscanf(line, "#> define %s %[^\n]", name, value) == 2) {
-    if(ns != NULL) {
-      char *prefixed = malloc(strlen(ns) + 2 + strlen(name) + 1);
-      sprintf(prefixed, "%s::%s", ns, name);
-      strcpy(name, prefixed);  // copy back to stack buffer
-      free(prefixed);
-    }
+  char *p = line + 9;
+  while(isspace((unsigned char)*p)) p++;
+  size_t len = 0;
+  while(p[len] != '\0' && !isspace((unsigned char)p[len])) len++;
+  if(len == 0) {
+    return 0;
+  }
 
-    if(get_define_value(defines, name) != NULL) {
-      printf("%s %s is already defined\n", LOG_WARNING, name);
-      return;
-    }
+  char *rest = p + len;
+  while(isspace((unsigned char)*rest)) rest++;
+  size_t value_len = strcspn(rest, "\n");
+  if(value_len == 0) {
+    return 0;
+  }
+
+  *name = malloc(len + 1);
+  memcpy(*name, p, len);
+  (*name)[len] = '\0';
 
-    push(*defines, strdup(name), strdup(value), DEF_VARIABLE, 0);
+  *value = malloc(value_len + 1);
+  memcpy(*value, rest, value_len);
+  (*value)[value_len] = '\0';
+  return 1;
+}
+
+void define_variable(Define **defines, char *name, char *value, char *ns)
+{
+  char *full = NULL;
+  if(ns != NULL) {
+    asprintf(&full, "%s::%s", ns, name);
+  } else {
+    full = strdup(name);
   }
 
-  return;
+  if(get_define_value(defines, full) != NULL) {
+    printf("%s %s is already defined\n", LOG_WARNING, full);
+    free(full);
+    return;
+  }
+
+  push(*defines, full, strdup(value), DEF_VARIABLE, 0);
+}
+
+void capture_define(Define **defines, char *line, char *ns)
+{
+  char *name = NULL;
+  char *value = NULL;
+  if(parse_define(line, &name, &value)) {
+    define_variable(defines, name, value, ns);
+    free(name);
+    free(value);
+  }
 }
 
 char* str_replace(const char *orig, const char *find, const char *replace) 
@@ -483,9 +536,16 @@ static char *define_replace_once(Define **defines, char *line)
   return current;
 }
 
+// conditionals resolve define names themselves, see should_write_line()
+static int is_conditional(char *line)
+{
+  while(*line == ' ' || *line == '\t') line++;
+  return strncmp(line, "#> if", 5) == 0 || strncmp(line, "#> elif", 7) == 0;
+}
+
 char *define_replace(Define **defines, char *line)
 {
-  if (*defines == NULL) {
+  if (*defines == NULL || is_conditional(line)) {
     return strdup(line);
   }
 
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <Rinternals.h>
+
+#include "deparse.h"
+#include "buffer.h"
+
+// Writes R objects as the literal dput() would produce, straight into a
+// buffer. Only data-like objects are handled (atomic vectors, lists and
+// their attributes, which covers data frames and factors); anything else
+// makes deparse_object() return 0 so the caller can fall back to dput().
+
+static const char *RESERVED[] = {
+  "if", "else", "repeat", "while", "function", "for", "next", "break",
+  "in", "TRUE", "FALSE", "NULL", "Inf", "NaN", "NA", "NA_integer_",
+  "NA_real_", "NA_character_", "NA_complex_",
+  NULL
+};
+
+// R's formatting of a finite double with 15 significant digits: the
+// fewest digits that represent the value, then whichever of fixed or
+// scientific notation is narrower
+char *format_real(double x)
+{
+  char buf[64];
+
+  if(x == 0) {
+    return strdup("0");
+  }
+
+  char ref[64];
+  snprintf(ref, sizeof(ref), "%.14e", x);
+  double target = strtod(ref, NULL);
+
+  int nsig = 1;
+  for(; nsig < 15; nsig++) {
+    snprintf(buf, sizeof(buf), "%.*e", nsig - 1, x);
+    if(strtod(buf, NULL) == target) break;
+  }
+
+  snprintf(buf, sizeof(buf), "%.*e", nsig - 1, x);
+  int kpower = atoi(strchr(buf, 'e') + 1);
+  int neg = x < 0;
+
+  int sci_width = neg + (nsig > 1 ? nsig + 1 : 1) + (abs(kpower) >= 100 ? 5 : 4);
+  int rgt = nsig - kpower - 1;
+  if(rgt < 0) rgt = 0;
+  int left = kpower + 1 > 1 ? kpower + 1 : 1;
+  int fixed_width = neg + left + (rgt > 0 ? rgt + 1 : 0);
+
+  if(fixed_width <= sci_width) {
+    snprintf(buf, sizeof(buf), "%.*f", rgt, x);
+  }
+
+  return strdup(buf);
+}
+
+int is_syntactic(const char *name)
+{
+  if(name[0] == '\0') return 0;
+  if(!isalpha((unsigned char)name[0]) && name[0] != '.') return 0;
+  if(name[0] == '.' && isdigit((unsigned char)name[1])) return 0;
+
+  for(const char *p = name; *p; p++) {
+    if(!isalnum((unsigned char)*p) && *p != '.' && *p != '_') return 0;
+  }
+
+  for(int i = 0; RESERVED[i] != NULL; i++) {
+    if(strcmp(name, RESERVED[i]) == 0) return 0;
+  }
+
+  return 1;
+}
+
+static void append_escaped(Buffer *buf, const char *str, char quote)
+{
+  buffer_append_char(buf, quote);
+  for(const unsigned char *p = (const unsigned char *)str; *p; p++) {
+    switch(*p) {
+      case '\a': buffer_append(buf, "\\a"); break;
+      case '\b': buffer_append(buf, "\\b"); break;
+      case '\f': buffer_append(buf, "\\f"); break;
+      case '\n': buffer_append(buf, "\\n"); break;
+      case '\r': buffer_append(buf, "\\r"); break;
+      case '\t': buffer_append(buf, "\\t"); break;
+      case '\v': buffer_append(buf, "\\v"); break;
+      case '\\': buffer_append(buf, "\\\\"); break;
+      default:
+        if(*p == (unsigned char)quote) {
+          buffer_append_char(buf, '\\');
+          buffer_append_char(buf, quote);
+        } else if(*p < 0x20 || *p == 0x7f) {
+          char octal[8];
+          snprintf(octal, sizeof(octal), "\\%03o", *p);
+          buffer_append(buf, octal);
+        } else {
+          buffer_append_char(buf, (char)*p);
+        }
+    }
+  }
+  buffer_append_char(buf, quote);
+}
+
+void deparse_string(Buffer *buf, const char *str)
+{
+  append_escaped(buf, str, '"');
+}
+
+static void append_name(Buffer *buf, const char *name)
+{
+  if(is_syntactic(name)) {
+    buffer_append(buf, name);
+    return;
+  }
+  append_escaped(buf, name, '`');
+}
+
+static int all_na(SEXP x)
+{
+  R_xlen_t n = XLENGTH(x);
+  for(R_xlen_t i = 0; i < n; i++) {
+    switch(TYPEOF(x)) {
+      case LGLSXP: if(LOGICAL(x)[i] != NA_LOGICAL) return 0; break;
+      case INTSXP: if(INTEGER(x)[i] != NA_INTEGER) return 0; break;
+      case REALSXP: if(!R_IsNA(REAL(x)[i])) return 0; break;
+      case STRSXP: if(STRING_ELT(x, i) != NA_STRING) return 0; break;
+    }
+  }
+  return 1;
+}
+
+static int is_int_sequence(SEXP x)
+{
+  R_xlen_t n = XLENGTH(x);
+  if(n < 2) return 0;
+
+  int *v = INTEGER(x);
+  if(v[0] == NA_INTEGER) return 0;
+  for(R_xlen_t i = 1; i < n; i++) {
+    if(v[i] == NA_INTEGER || v[i] != v[i - 1] + 1) return 0;
+  }
+  return 1;
+}
+
+static void append_element(Buffer *buf, SEXP x, R_xlen_t i, int na_typed)
+{
+  char tmp[32];
+
+  switch(TYPEOF(x)) {
+    case LGLSXP: {
+      int v = LOGICAL(x)[i];
+      buffer_append(buf, v == NA_LOGICAL ? "NA" : (v ? "TRUE" : "FALSE"));
+      break;
+    }
+    case INTSXP: {
+      int v = INTEGER(x)[i];
+      if(v == NA_INTEGER) {
+        buffer_append(buf, na_typed ? "NA_integer_" : "NA");
+        break;
+      }
+      snprintf(tmp, sizeof(tmp), "%dL", v);
+      buffer_append(buf, tmp);
+      break;
+    }
+    case REALSXP: {
+      double v = REAL(x)[i];
+      if(R_IsNA(v)) {
+        buffer_append(buf, na_typed ? "NA_real_" : "NA");
+      } else if(ISNAN(v)) {
+        buffer_append(buf, "NaN");
+      } else if(!R_FINITE(v)) {
+        buffer_append(buf, v > 0 ? "Inf" : "-Inf");
+      } else {
+        char *num = format_real(v);
+        buffer_append(buf, num);
+        free(num);
+      }
+      break;
+    }
+    case STRSXP: {
+      SEXP s = STRING_ELT(x, i);
+      if(s == NA_STRING) {
+        buffer_append(buf, na_typed ? "NA_character_" : "NA");
+        break;
+      }
+      append_escaped(buf, translateCharUTF8(s), '"');
+      break;
+    }
+  }
+}
+
+static int deparse_value(Buffer *buf, SEXP x);
+
+static int deparse_atomic(Buffer *buf, SEXP x, SEXP names)
+{
+  static const char *EMPTY[] = {
+    [LGLSXP] = "logical(0)", [INTSXP] = "integer(0)",
+    [REALSXP] = "numeric(0)", [STRSXP] = "character(0)"
+  };
+
+  R_xlen_t n = XLENGTH(x);
+
+  if(n == 0) {
+    buffer_append(buf, EMPTY[TYPEOF(x)]);
+    return 1;
+  }
+
+  int na_typed = TYPEOF(x) != LGLSXP && all_na(x);
+
+  if(names == R_NilValue && TYPEOF(x) == INTSXP && is_int_sequence(x)) {
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), "%d:%d", INTEGER(x)[0], INTEGER(x)[n - 1]);
+    buffer_append(buf, tmp);
+    return 1;
+  }
+
+  if(n == 1 && names == R_NilValue) {
+    append_element(buf, x, 0, na_typed);
+    return 1;
+  }
+
+  buffer_append(buf, "c(");
+  for(R_xlen_t i = 0; i < n; i++) {
+    if(i > 0) buffer_append(buf, ", ");
+    if(names != R_NilValue && STRING_ELT(names, i) != NA_STRING && CHAR(STRING_ELT(names, i))[0] != '\0') {
+      append_name(buf, translateCharUTF8(STRING_ELT(names, i)));
+      buffer_append(buf, " = ");
+    }
+    append_element(buf, x, i, na_typed);
+  }
+  buffer_append_char(buf, ')');
+
+  return 1;
+}
+
+static int deparse_list(Buffer *buf, SEXP x, SEXP names)
+{
+  R_xlen_t n = XLENGTH(x);
+
+  buffer_append(buf, "list(");
+  for(R_xlen_t i = 0; i < n; i++) {
+    if(i > 0) buffer_append(buf, ", ");
+    if(names != R_NilValue && STRING_ELT(names, i) != NA_STRING && CHAR(STRING_ELT(names, i))[0] != '\0') {
+      append_name(buf, translateCharUTF8(STRING_ELT(names, i)));
+      buffer_append(buf, " = ");
+    }
+    if(!deparse_value(buf, VECTOR_ELT(x, i))) return 0;
+  }
+  buffer_append_char(buf, ')');
+
+  return 1;
+}
+
+// attributes other than names, in the order R stores them
+static int has_other_attributes(SEXP x)
+{
+  for(SEXP a = ATTRIB(x); a != R_NilValue; a = CDR(a)) {
+    if(TAG(a) != R_NamesSymbol) return 1;
+  }
+  return 0;
+}
+
+static int deparse_value(Buffer *buf, SEXP x)
+{
+  int type = TYPEOF(x);
+
+  if(type == NILSXP) {
+    buffer_append(buf, "NULL");
+    return 1;
+  }
+
+  if(type != LGLSXP && type != INTSXP && type != REALSXP && type != STRSXP && type != VECSXP) {
+    return 0;
+  }
+
+  SEXP names = R_NilValue;
+  for(SEXP a = ATTRIB(x); a != R_NilValue; a = CDR(a)) {
+    if(TAG(a) == R_NamesSymbol) names = CAR(a);
+  }
+  if(names != R_NilValue && (TYPEOF(names) != STRSXP || XLENGTH(names) != XLENGTH(x))) {
+    return 0;
+  }
+
+  int structured = has_other_attributes(x);
+  if(structured) buffer_append(buf, "structure(");
+
+  int ok = type == VECSXP ? deparse_list(buf, x, names) : deparse_atomic(buf, x, names);
+  if(!ok) return 0;
+
+  if(!structured) {
+    return 1;
+  }
+
+  for(SEXP a = ATTRIB(x); a != R_NilValue; a = CDR(a)) {
+    if(TAG(a) == R_NamesSymbol) continue;
+    buffer_append(buf, ", ");
+    append_name(buf, CHAR(PRINTNAME(TAG(a))));
+    buffer_append(buf, " = ");
+    if(!deparse_value(buf, CAR(a))) return 0;
+  }
+  buffer_append_char(buf, ')');
+
+  return 1;
+}
+
+int deparse_object(Buffer *buf, SEXP x)
+{
+  size_t start = buf->len;
+
+  if(deparse_value(buf, x)) {
+    return 1;
+  }
+
+  // roll back whatever was written before we hit an unsupported value
+  buf->len = start;
+  if(buf->data != NULL) buf->data[start] = '\0';
+  return 0;
+}
@@ -1,31 +1,143 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
-#include "r.h"
+#include "library.h"
 #include "log.h"
 #include "parser.h"
 
-static int is_installed(char *package)
+// Dependencies are checked against the DESCRIPTION of the installed
+// package, so nothing is loaded into the embedded R. A dependency is a
+// package name with an optional version constraint, either compact
+// (dplyr>=1.1.0) or as written in a DESCRIPTION (dplyr (>= 1.1.0)).
+
+#define MAX_DEPENDS_THREADS 8
+
+typedef struct {
+  char *name;
+  char *op;
+  char *version;
+  char *installed;
+} Dependency;
+
+typedef struct {
+  Dependency *deps;
+  int count;
+  int start;
+  int step;
+} DependsWork;
+
+static const char *OPERATORS[] = {">=", "<=", "==", "!=", ">", "<", NULL};
+
+static void parse_dependency(Dependency *dep, const char *spec)
 {
-  char *call = (char*)malloc(strlen(package) + 37);
-  snprintf(call, strlen(package) + 37, "requireNamespace('%s', quietly = TRUE)", package);
-  int result = evaluate_if(call);
-  free(call);
-  return result;
+  size_t len = strcspn(spec, " (<>=!");
+  dep->name = malloc(len + 1);
+  memcpy(dep->name, spec, len);
+  dep->name[len] = '\0';
+  dep->op = NULL;
+  dep->version = NULL;
+  dep->installed = NULL;
+
+  const char *pos = spec + len;
+  while(*pos == ' ' || *pos == '(') pos++;
+
+  for(int i = 0; OPERATORS[i] != NULL; i++) {
+    size_t n = strlen(OPERATORS[i]);
+    if(strncmp(pos, OPERATORS[i], n) != 0) continue;
+
+    dep->op = strdup(OPERATORS[i]);
+    pos += n;
+    while(*pos == ' ') pos++;
+
+    size_t vlen = strcspn(pos, " )");
+    dep->version = malloc(vlen + 1);
+    memcpy(dep->version, pos, vlen);
+    dep->version[vlen] = '\0';
+    break;
+  }
+}
+
+static int satisfies(Dependency *dep)
+{
+  if(dep->op == NULL) return 1;
+
+  int cmp = compare_versions(dep->installed, dep->version);
+  if(strcmp(dep->op, ">=") == 0) return cmp >= 0;
+  if(strcmp(dep->op, "<=") == 0) return cmp <= 0;
+  if(strcmp(dep->op, "==") == 0) return cmp == 0;
+  if(strcmp(dep->op, "!=") == 0) return cmp != 0;
+  if(strcmp(dep->op, ">") == 0) return cmp > 0;
+  return cmp < 0;
+}
+
+static void *check_depends(void *data)
+{
+  DependsWork *work = data;
+  for(int i = work->start; i < work->count; i += work->step) {
+    work->deps[i].installed = package_version(work->deps[i].name);
+  }
+  return NULL;
 }
 
 int process_depends(Value *depends)
 {
+  int count = 0;
+  for(Value *current = depends; current != NULL; current = current->next) {
+    count++;
+  }
+
+  if(count == 0) {
+    return 0;
+  }
+
+  Dependency *deps = malloc(count * sizeof(Dependency));
+  int i = 0;
+  for(Value *current = depends; current != NULL; current = current->next) {
+    parse_dependency(&deps[i++], current->name);
+  }
+
+  // R, if it is needed for .libPaths() at all, is used before any
+  // thread starts
+  char **paths = NULL;
+  library_paths(&paths);
+
+  int nthreads = count < MAX_DEPENDS_THREADS ? count : MAX_DEPENDS_THREADS;
+  pthread_t threads[MAX_DEPENDS_THREADS];
+  int started[MAX_DEPENDS_THREADS];
+  DependsWork work[MAX_DEPENDS_THREADS];
+
+  for(int t = 0; t < nthreads; t++) {
+    work[t] = (DependsWork){deps, count, t, nthreads};
+    started[t] = pthread_create(&threads[t], NULL, check_depends, &work[t]) == 0;
+    if(!started[t]) {
+      check_depends(&work[t]);
+    }
+  }
+
+  for(int t = 0; t < nthreads; t++) {
+    if(started[t]) pthread_join(threads[t], NULL);
+  }
+
   int result = 0;
-  Value *current = depends;
-  while (current != NULL) {
-    int installed = is_installed(current->name);
-    if (!installed) {
-      printf("%s Package '%s' is not installed\n", LOG_ERROR, current->name);
+  for(i = 0; i < count; i++) {
+    Dependency *dep = &deps[i];
+
+    if(dep->installed == NULL) {
+      printf("%s Package '%s' is not installed\n", LOG_ERROR, dep->name);
+      result = 1;
+    } else if(!satisfies(dep)) {
+      printf("%s Package '%s' %s does not satisfy %s %s\n", LOG_ERROR, dep->name, dep->installed, dep->op, dep->version);
       result = 1;
     }
-    current = current->next;
+
+    free(dep->name);
+    free(dep->op);
+    free(dep->version);
+    free(dep->installed);
   }
+
+  free(deps);
   return result;
 }
@@ -4,8 +4,12 @@
 #include <string.h>
 #include <limits.h>
 #include <regex.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "compat.h"
+#include "buffer.h"
+#include "condition.h"
 #include "deconstruct.h"
 #include "preflight.h"
 #include "sourcemap.h"
@@ -21,6 +25,22 @@
 #include "for.h"
 #include "r.h"
 #include "deadcode.h"
+#include "ignore.h"
+#include "library.h"
+#include "precompile.h"
+#include "hash.h"
+
+#define MAX_SCAN_THREADS 16
+
+// Streaming builds keep the content of output sources only while a pass
+// works on the file, so memory is bounded by the largest file rather than
+// the tree.
+static int stream_build = 0;
+
+void set_stream_build(int enabled)
+{
+  stream_build = enabled;
+}
 
 int exists(char *path)
 {
@@ -190,7 +210,17 @@ static int should_write_line(int state, int *branch_taken, char line[1024], Defi
   }
 
   if(strncmp(trimmed, "#> if", 5) == 0) {
-    int result = evaluate_if(trimmed + 6);
+    char *cond = trimmed + 6;
+    int is_volatile = strncmp(cond, "volatile ", 9) == 0;
+    if(is_volatile) cond += 9;
+    int result = 0;
+    if(!evaluate_condition(defs, cond, &result)) {
+      char *resolved = replace_defined(defs, cond);
+      char *expanded = define_replace(defs, resolved);
+      free(resolved);
+      result = evaluate_if_cached(expanded, is_volatile);
+      free(expanded);
+    }
     *branch_taken = result;
     return result;
   }
@@ -263,17 +293,10 @@ static char *append_buffer(char *buffer, char *line)
   return new_buffer;
 }
 
-int walk(char *src_dir, char *dst_dir, Callback func, Define **defs, Plugins *plugins)
+static void walk_dir(DIR *source, char *src_dir, char *dst_dir, Callback func, Define **defs, Plugins *plugins)
 {
-  DIR *source;
   struct dirent *entry;
   char path[PATH_MAX];
-  
-  source = opendir(src_dir);
-  if (source == NULL) {
-    printf("%s Failed to open source directory: %s\n", LOG_ERROR, src_dir);
-    return 1;
-  }
 
   while((entry = readdir(source)) != NULL) {
     if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
@@ -283,15 +306,32 @@ int walk(char *src_dir, char *dst_dir, Callback func, Define **defs, Plugins *pl
     snprintf(path, PATH_MAX, "%s/%s", src_dir, entry->d_name);
 
     // it's a directory, recurse
-    if (builder_is_dir(path)) {
-      walk(path, dst_dir, func, defs, plugins);
+    if (builder_entry_is_dir(source, entry, path)) {
+      DIR *sub = builder_opendir_at(source, entry->d_name, path);
+      if (sub == NULL) {
+        printf("%s Failed to open source directory: %s\n", LOG_ERROR, path);
+        continue;
+      }
+      walk_dir(sub, path, dst_dir, func, defs, plugins);
+      closedir(sub);
     } else {
       char *ext = strrchr(path, '.');
-      if(strcmp(ext, ".R") != 0 && strcmp(ext, ".r") != 0) continue;
+      if(ext == NULL || (strcmp(ext, ".R") != 0 && strcmp(ext, ".r") != 0)) continue;
       func(path, dst_dir, defs, plugins);
     }
   }
-  
+}
+
+int walk(char *src_dir, char *dst_dir, Callback func, Define **defs, Plugins *plugins)
+{
+  DIR *source = opendir(src_dir);
+  if (source == NULL) {
+    printf("%s Failed to open source directory: %s\n", LOG_ERROR, src_dir);
+    return 1;
+  }
+
+  walk_dir(source, src_dir, dst_dir, func, defs, plugins);
+
   closedir(source);
   return 0;
 }
@@ -308,6 +348,7 @@ static RFile *create_rfile(char *src, char *dst, char *content, char *ns)
   file->dst = dst ? strdup(dst) : NULL;
   file->content = content ? strdup(content) : NULL;
   file->ns = ns ? strdup(ns) : NULL;
+  file->pinned = 0;
   file->next = NULL;
 
   return file;
@@ -338,6 +379,79 @@ void free_rfile(RFile *files)
   }
 }
 
+static char *read_source(char *path)
+{
+  FILE *file = fopen(path, "r");
+  if(file == NULL) {
+    printf("%s Failed to open %s\n", LOG_ERROR, path);
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *content = malloc(size + 1);
+  if(content == NULL) {
+    printf("%s Failed to allocate memory\n", LOG_ERROR);
+    fclose(file);
+    return NULL;
+  }
+
+  size_t read = fread(content, 1, size, file);
+  content[read] = '\0';
+  fclose(file);
+
+  return content;
+}
+
+static int load_content(RFile *file)
+{
+  if(file->content != NULL) {
+    return 1;
+  }
+  file->content = read_source(file->src);
+  return file->content != NULL;
+}
+
+// sources the preprocess hook rewrote cannot be read again from disk
+static void release_content(RFile *file)
+{
+  if(!stream_build || file->dst == NULL || file->pinned) {
+    return;
+  }
+  free(file->content);
+  file->content = NULL;
+}
+
+// Imports are resolved once per session: package lookups are remembered
+// by spec and a header is only read again when its mtime changes, so
+// watch rebuilds do not go back to R or the disk for unchanged headers.
+typedef struct {
+  char *content;
+  long long mtime;
+} ImportFile;
+
+static HashMap *import_paths = NULL;
+static HashMap *import_files = NULL;
+
+static void free_import_file(void *value)
+{
+  ImportFile *file = value;
+  free(file->content);
+  free(file);
+}
+
+void clear_import_cache()
+{
+  hashmap_free(import_paths, free);
+  hashmap_free(import_files, free_import_file);
+  import_paths = NULL;
+  import_files = NULL;
+  clear_package_cache();
+}
+
+// "" when the package or the file is missing, as system.file() does
 static char *get_path_from_package(char *input)
 {
   char *delimiter = "::";
@@ -348,31 +462,78 @@ static char *get_path_from_package(char *input)
   strncpy(name, input, name_len);
   name[name_len] = '\0';
 
-  char *path = strdup(split_point + strlen(delimiter));
-
-  SEXP system_file = PROTECT(install("system.file"));
-  SEXP filename = PROTECT(mkString(path));
-  SEXP pkg_name = PROTECT(mkString(name));
-
+  char *dir = package_dir(name);
   free(name);
-  free(path);
 
-  SEXP call = PROTECT(lang3(system_file, filename, pkg_name));
-  SET_TAG(CDDR(call), install("package"));
+  if(dir == NULL) {
+    return strdup("");
+  }
+
+  char *filepath = NULL;
+  asprintf(&filepath, "%s/%s", dir, split_point + strlen(delimiter));
+  free(dir);
 
-  SEXP result = PROTECT(eval(call, R_GlobalEnv));
-  UNPROTECT(5);
+  if(!exists(filepath)) {
+    free(filepath);
+    return strdup("");
+  }
 
-  const char *filepath = CHAR(asChar(result));
-  return strdup(filepath);
+  return filepath;
 }
 
 static char *get_import_path(char *path)
 {
-  if(strstr(path, "::") != NULL) {
-    return get_path_from_package(path);
+  if(strstr(path, "::") == NULL) {
+    return strdup(path);
+  }
+
+  if(import_paths == NULL) {
+    import_paths = hashmap_create(64);
   }
-  return strdup(path);
+
+  char *cached = hashmap_get(import_paths, path);
+  if(cached != NULL) {
+    return strdup(cached);
+  }
+
+  char *resolved = get_path_from_package(path);
+  if(resolved[0] != '\0') {
+    hashmap_set(import_paths, path, strdup(resolved));
+  }
+  return resolved;
+}
+
+static const char *read_import(char *path)
+{
+  struct stat st;
+  if(stat(path, &st) != 0) {
+    return NULL;
+  }
+
+  if(import_files == NULL) {
+    import_files = hashmap_create(64);
+  }
+
+  ImportFile *cached = hashmap_get(import_files, path);
+  if(cached != NULL && cached->mtime == (long long)st.st_mtime) {
+    return cached->content;
+  }
+
+  char *content = read_source(path);
+  if(content == NULL) {
+    return NULL;
+  }
+
+  if(cached == NULL) {
+    cached = malloc(sizeof(ImportFile));
+    hashmap_set(import_files, path, cached);
+  } else {
+    free(cached->content);
+  }
+
+  cached->content = content;
+  cached->mtime = (long long)st.st_mtime;
+  return content;
 }
 
 static char *get_import_namespace(char *path)
@@ -387,29 +548,6 @@ static char *get_import_namespace(char *path)
   return ns;
 }
 
-static int is_path_seen(char **seen, int seen_count, char *path)
-{
-  for(int i = 0; i < seen_count; i++) {
-    if(strcmp(seen[i], path) == 0) return 1;
-  }
-  return 0;
-}
-
-static void add_seen_path(char ***seen, int *seen_count, char *path)
-{
-  *seen = realloc(*seen, (*seen_count + 1) * sizeof(char*));
-  (*seen)[*seen_count] = strdup(path);
-  (*seen_count)++;
-}
-
-static void free_seen(char **seen, int seen_count)
-{
-  for(int i = 0; i < seen_count; i++) {
-    free(seen[i]);
-  }
-  free(seen);
-}
-
 static Value *scan_for_imports(char *content)
 {
   Value *imports = NULL;
@@ -441,7 +579,22 @@ static Value *scan_for_imports(char *content)
   return imports;
 }
 
-static int prepend_import(RFile **files, char *import_spec, char ***seen, int *seen_count)
+// the import records of a precompiled header, in scan_for_imports() order
+static Value *header_imports(HeaderRecord *records)
+{
+  Value *imports = NULL;
+  for(HeaderRecord *record = records; record != NULL; record = record->next) {
+    if(record->kind != HEADER_IMPORT) continue;
+
+    Value *v = malloc(sizeof(Value));
+    v->name = strdup(record->text);
+    v->next = imports;
+    imports = v;
+  }
+  return imports;
+}
+
+static int prepend_import(RFile **files, char *import_spec, HashMap *seen)
 {
   char *resolved_path = get_import_path(import_spec);
   if(resolved_path == NULL || strlen(resolved_path) == 0) {
@@ -450,36 +603,36 @@ static int prepend_import(RFile **files, char *import_spec, char ***seen, int *s
     return 0;
   }
 
-  if(is_path_seen(*seen, *seen_count, resolved_path)) {
+  if(hashmap_has(seen, resolved_path)) {
     free(resolved_path);
     return 1;
   }
 
-  add_seen_path(seen, seen_count, resolved_path);
+  hashmap_set(seen, resolved_path, NULL);
 
-  FILE *file = fopen(resolved_path, "r");
-  if(file == NULL) {
-    printf("%s Failed to open import: %s\n", LOG_ERROR, resolved_path);
-    free(resolved_path);
-    return 0;
+  // a current .rhc lists the header's imports, the header itself is then
+  // not read at all
+  const char *content = NULL;
+  Value *nested = NULL;
+  HeaderRecord *records = NULL;
+  if(load_precompiled(resolved_path, NULL, &records)) {
+    nested = header_imports(records);
+    free_header(records);
+  } else {
+    content = read_import(resolved_path);
+    if(content == NULL) {
+      printf("%s Failed to open import: %s\n", LOG_ERROR, resolved_path);
+      free(resolved_path);
+      return 0;
+    }
+    nested = scan_for_imports((char *)content);
   }
 
-  fseek(file, 0, SEEK_END);
-  long size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-
-  char *content = malloc(size + 1);
-  fread(content, 1, size, file);
-  content[size] = '\0';
-  fclose(file);
-
   char *ns = get_import_namespace(import_spec);
 
-  Value *nested = scan_for_imports(content);
   Value *current = nested;
   while(current != NULL) {
-    if(!prepend_import(files, current->name, seen, seen_count)) {
-      free(content);
+    if(!prepend_import(files, current->name, seen)) {
       free(resolved_path);
       free(ns);
       free_value(nested);
@@ -489,10 +642,9 @@ static int prepend_import(RFile **files, char *import_spec, char ***seen, int *s
   }
   free_value(nested);
 
-  push_rfile(files, resolved_path, NULL, content, ns);
+  push_rfile(files, resolved_path, NULL, (char *)content, ns);
   printf("%s Import: %s\n", LOG_INFO, resolved_path);
 
-  free(content);
   free(resolved_path);
   free(ns);
   return 1;
@@ -500,60 +652,170 @@ static int prepend_import(RFile **files, char *import_spec, char ***seen, int *s
 
 int resolve_imports(RFile **files, Value *cli_imports)
 {
-  char **seen = NULL;
-  int seen_count = 0;
+  HashMap *seen = hashmap_create(64);
+  int ok = 1;
 
   RFile *current = *files;
   while(current != NULL) {
-    add_seen_path(&seen, &seen_count, current->src);
+    hashmap_set(seen, current->src, NULL);
     current = current->next;
   }
 
-  Value *cli = cli_imports;
-  while(cli != NULL) {
-    if(!prepend_import(files, cli->name, &seen, &seen_count)) {
-      free_seen(seen, seen_count);
-      return 0;
-    }
-    cli = cli->next;
+  for(Value *cli = cli_imports; ok && cli != NULL; cli = cli->next) {
+    ok = prepend_import(files, cli->name, seen);
   }
 
-  current = *files;
-  while(current != NULL) {
+  for(current = *files; ok && current != NULL; current = current->next) {
     if(current->dst == NULL) {
-      current = current->next;
       continue;
     }
+    if(!load_content(current)) {
+      ok = 0;
+      break;
+    }
     Value *imports = scan_for_imports(current->content);
-    Value *imp = imports;
-    while(imp != NULL) {
-      if(!prepend_import(files, imp->name, &seen, &seen_count)) {
-        free_value(imports);
-        free_seen(seen, seen_count);
-        return 0;
-      }
-      imp = imp->next;
+    release_content(current);
+    for(Value *imp = imports; ok && imp != NULL; imp = imp->next) {
+      ok = prepend_import(files, imp->name, seen);
     }
     free_value(imports);
-    current = current->next;
   }
 
-  free_seen(seen, seen_count);
-  return 1;
+  hashmap_free(seen, NULL);
+  return ok;
 }
 
-int collect_files(RFile **files, char *src_dir, char *dst_dir)
+typedef struct {
+  char *dst_dir;
+  Ignore *ignore;
+  size_t root;
+} Scan;
+
+static int collect_dir(RFile **files, DIR *source, char *src_dir, Scan *scan)
 {
-  DIR *source;
   struct dirent *entry;
   char path[PATH_MAX];
-  
-  source = opendir(src_dir);
+
+  while((entry = readdir(source)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+
+    snprintf(path, PATH_MAX, "%s/%s", src_dir, entry->d_name);
+
+    int is_dir = builder_entry_is_dir(source, entry, path);
+    if (is_ignored(scan->ignore, path + scan->root, is_dir)) {
+      continue;
+    }
+
+    // it's a directory, recurse
+    if (is_dir) {
+      DIR *sub = builder_opendir_at(source, entry->d_name, path);
+      if (sub == NULL) {
+        printf("%s Failed to open source directory: %s\n", LOG_ERROR, path);
+        continue;
+      }
+      int ok = collect_dir(files, sub, path, scan);
+      closedir(sub);
+      if (!ok) return 0;
+    } else {
+      char *ext = strrchr(path, '.');
+      if(ext == NULL || (strcmp(ext, ".R") != 0 && strcmp(ext, ".r") != 0)) continue;
+      char *dest = make_dest_path(path, scan->dst_dir);
+      push_rfile(files, path, dest, NULL, NULL);
+      free(dest);
+    }
+  }
+
+  return 1;
+}
+
+// An entry of the input directory: a source, or a subdirectory whose
+// sources one of the scan threads collects
+typedef struct {
+  char *path;
+  DIR *dir;
+  RFile *files;
+  int ok;
+} ScanEntry;
+
+typedef struct {
+  Scan *scan;
+  ScanEntry *entries;
+  RFile **files;
+  int *failed;
+  int n;
+  int start;
+  int step;
+} ScanWork;
+
+static void *scan_worker(void *data)
+{
+  ScanWork *work = data;
+  for(int i = work->start; i < work->n; i += work->step) {
+    ScanEntry *entry = &work->entries[i];
+    if(entry->dir != NULL) {
+      entry->ok = collect_dir(&entry->files, entry->dir, entry->path, work->scan);
+      closedir(entry->dir);
+    }
+  }
+  return NULL;
+}
+
+static void *load_worker(void *data)
+{
+  ScanWork *work = data;
+  for(int i = work->start; i < work->n; i += work->step) {
+    work->failed[i] = !load_content(work->files[i]);
+  }
+  return NULL;
+}
+
+static void run_scan(ScanWork *work, int n, void *(*worker)(void *), ScanWork with)
+{
+  int nthreads = builder_cpu_count();
+  if(nthreads > n) nthreads = n;
+  if(nthreads > MAX_SCAN_THREADS) nthreads = MAX_SCAN_THREADS;
+
+  pthread_t threads[MAX_SCAN_THREADS];
+  int started[MAX_SCAN_THREADS];
+
+  for(int t = 0; t < nthreads; t++) {
+    work[t] = with;
+    work[t].n = n;
+    work[t].start = t;
+    work[t].step = nthreads;
+    started[t] = nthreads > 1 && pthread_create(&threads[t], NULL, worker, &work[t]) == 0;
+    if(!started[t]) {
+      worker(&work[t]);
+    }
+  }
+
+  for(int t = 0; t < nthreads; t++) {
+    if(started[t]) pthread_join(threads[t], NULL);
+  }
+}
+
+// The subdirectories of the input directory are scanned on threads and
+// the sources then read on threads too; the list comes out in the order
+// of a serial walk.
+int collect_files(RFile **files, char *src_dir, char *dst_dir)
+{
+  DIR *source = opendir(src_dir);
   if (source == NULL) {
     printf("%s Failed to open source directory: %s\n", LOG_ERROR, src_dir);
     return 0;
   }
 
+  Scan scan = {dst_dir, load_ignore(IGNORE_FILE), ignore_prefix(src_dir)};
+  ScanWork work[MAX_SCAN_THREADS];
+
+  ScanEntry *entries = NULL;
+  int n = 0;
+  int capacity = 0;
+
+  struct dirent *entry;
+  char path[PATH_MAX];
   while((entry = readdir(source)) != NULL) {
     if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
       continue;
@@ -561,147 +823,438 @@ int collect_files(RFile **files, char *src_dir, char *dst_dir)
 
     snprintf(path, PATH_MAX, "%s/%s", src_dir, entry->d_name);
 
-    // it's a directory, recurse
-    if (builder_is_dir(path)) {
-      collect_files(files, path, dst_dir);
+    int is_dir = builder_entry_is_dir(source, entry, path);
+    if (is_ignored(scan.ignore, path + scan.root, is_dir)) {
+      continue;
+    }
+
+    ScanEntry item = {NULL, NULL, NULL, 1};
+    if (is_dir) {
+      item.dir = builder_opendir_at(source, entry->d_name, path);
+      if (item.dir == NULL) {
+        printf("%s Failed to open source directory: %s\n", LOG_ERROR, path);
+        continue;
+      }
+      item.path = strdup(path);
     } else {
       char *ext = strrchr(path, '.');
-      if(strcmp(ext, ".R") != 0 && strcmp(ext, ".r") != 0) continue;
-      char buffer[20000];
-      FILE *file = fopen(path, "r");
-      size_t bytesRead = fread(buffer, 1, sizeof(buffer), file);
-      buffer[bytesRead] = '\0';
+      if(ext == NULL || (strcmp(ext, ".R") != 0 && strcmp(ext, ".r") != 0)) continue;
       char *dest = make_dest_path(path, dst_dir);
-      push_rfile(files, path, dest, buffer, NULL);
+      push_rfile(&item.files, path, dest, NULL, NULL);
       free(dest);
-      fclose(file);
     }
+
+    if(n == capacity) {
+      capacity = capacity > 0 ? capacity * 2 : 64;
+      entries = realloc(entries, capacity * sizeof(ScanEntry));
+    }
+    entries[n++] = item;
   }
-  
   closedir(source);
 
-  return 1;
+  if(n > 0) {
+    run_scan(work, n, scan_worker, (ScanWork){&scan, entries, NULL, NULL});
+  }
+  free_ignore(scan.ignore);
+
+  // lists are pushed in turn, as a serial walk would push their files
+  int ok = 1;
+  int count = 0;
+  for(int i = 0; i < n; i++) {
+    ok = ok && entries[i].ok;
+    if(entries[i].files == NULL) {
+      free(entries[i].path);
+      continue;
+    }
+
+    RFile *tail = entries[i].files;
+    count++;
+    while(tail->next != NULL) {
+      tail = tail->next;
+      count++;
+    }
+    tail->next = *files;
+    *files = entries[i].files;
+    free(entries[i].path);
+  }
+  free(entries);
+
+  if(!ok || stream_build || count == 0) {
+    return ok;
+  }
+
+  RFile **loaded = malloc(count * sizeof(RFile*));
+  int *failed = calloc(count, sizeof(int));
+  RFile *current = *files;
+  for(int i = 0; i < count; i++, current = current->next) {
+    loaded[i] = current;
+  }
+
+  run_scan(work, count, load_worker, (ScanWork){NULL, NULL, loaded, failed});
+
+  for(int i = 0; i < count; i++) {
+    ok = ok && !failed[i];
+  }
+
+  free(failed);
+  free(loaded);
+  return ok;
 }
 
 // first pass:
 // - capture defines
 // - Run preflight
-static int first_pass(RFile *files, Define **defs, Plugins *plugins)
+// - Read includes ahead of the second pass
+// hands every file to the preprocess hook at once, for plugins with a
+// batched preprocess_all(); the results stay in memory for the second pass
+static int preprocess_all(RFile *files, Plugins *plugins)
+{
+  int n = 0;
+  for(RFile *current = files; current != NULL; current = current->next) {
+    n++;
+  }
+
+  char **contents = malloc(n * sizeof(char*));
+  char **paths = malloc(n * sizeof(char*));
+
+  int i = 0;
+  for(RFile *current = files; current != NULL; current = current->next, i++) {
+    if(!load_content(current)) {
+      free(contents);
+      free(paths);
+      return 0;
+    }
+    contents[i] = current->content;
+    paths[i] = current->src;
+    current->content = NULL;
+  }
+
+  plugins_call_all(plugins, "preprocess", contents, paths, n);
+
+  i = 0;
+  for(RFile *current = files; current != NULL; current = current->next, i++) {
+    current->content = contents[i];
+    current->pinned = 1;
+  }
+
+  free(contents);
+  free(paths);
+  return 1;
+}
+
+static int first_pass(RFile *files, Define **defs, Plugins *plugins, Registry **registry)
 {
+  int batched = plugins_batched(plugins, "preprocess");
+
   RFile *current = files;
   while(current != NULL) {
     overwrite(defs, "..FILE..", current->src);
 
-    // state
-    char *buffer = NULL;
-    int line_number = -1;
-    char *line_number_str = NULL;
-    int in_preflight = 0;
-    int in_macro = 0;
+    // imported headers are replayed from their precompiled form when the
+    // source has not changed since it was last scanned, and only read
+    // when a plugin needs their text
+    HeaderRecord *records = NULL;
+    int precompiled = current->dst == NULL && load_precompiled(current->src, current->content, &records);
+    if((!precompiled || plugins != NULL) && !load_content(current)) {
+      free_header(records);
+      return 1;
+    }
 
-    // line
-    char *pos = current->content;
+    if(!precompiled) {
+      records = scan_header(current->content);
+      if(current->dst == NULL) {
+        save_precompiled(current->src, current->content, records);
+      }
+    }
 
-    while (*pos) {
-      line_number++;
-      char *new_line = strchr(pos, '\n');
-      if(!new_line) {
-        break;
+    int failed = apply_header(records, defs, current->ns);
+    free_header(records);
+    if(failed) {
+      return 1;
+    }
+
+    if(!batched) {
+      char *output = plugins_call(plugins, "preprocess", current->content, current->src);
+      if(output != NULL) {
+        free(current->content);
+        current->content = strdup(output);
+        current->pinned = 1;
+        free(output);
       }
+    }
 
-      size_t len = new_line - pos;
-      char *line = malloc(len + 1);
-      strncpy(line, pos, len);
-      line[len] = '\0';
-      pos = new_line + 1;
+    // a plugin's include hook may replace the reader, so only read
+    // ahead when no plugin can intercept
+    if(plugins == NULL && current->dst != NULL) {
+      prefetch_includes(current->content, registry);
+    }
 
-      free(line_number_str);
-      asprintf(&line_number_str, "%d", line_number);
-      overwrite(defs, "..LINE..", line_number_str);
+    release_content(current);
 
-      if(enter_macro(line)) {
-        in_macro = 1;
-        buffer = append_buffer(buffer, line);
-        free(line);
-        continue;
-      }
+    current = current->next;
+  }
 
-      if(strncmp(line, "#> endmacro", 11) == 0) {
-        in_macro = 0;
-        push_macro(defs, buffer, current->ns);
-        buffer = NULL;
-        free(line);
-        continue;
-      }
+  if(batched && !preprocess_all(files, plugins)) {
+    return 1;
+  }
 
-      if(in_macro) {
-        buffer = append_buffer(buffer, line);
-        free(line);
-        continue;
-      }
-      
-      capture_define(defs, line, current->ns);
+  read_includes();
 
-      if(strncmp(line, "#> import ", 10) == 0) {
-        free(line);
-        continue;
-      }
+  return 0;
+}
 
-      if(strncmp(line, "#> preflight", 12) == 0) {
-        in_preflight = 1;
-        buffer = append_buffer(buffer, line);
-        free(line);
-        continue;
-      }
+// outputs are handed to the dead code analysis as they are written
+static int collect_deadcode = 0;
+
+// Output of the second pass for one file. Without plugins, lines go
+// straight to a temporary file that replaces the destination once the
+// file is done; otherwise they are kept for the postprocess hook.
+typedef struct {
+  char *dst;
+  char *tmp;
+  FILE *file;
+  Buffer buf;
+  int empty;
+  char last;
+} Output;
+
+static int copy_into(FILE *dst, char *path)
+{
+  FILE *src = fopen(path, "r");
+  if(src == NULL) {
+    printf("%s Failed to open %s\n", LOG_ERROR, path);
+    return 0;
+  }
 
-      if(strncmp(line, "#> endpreflight", 15) == 0) {
-        in_preflight = 0;
-        free(line);
-        continue;
-      }
+  char chunk[4096];
+  size_t n;
+  while((n = fread(chunk, 1, sizeof(chunk), src)) > 0) {
+    fwrite(chunk, 1, n, dst);
+  }
 
-      if(strncmp(line, "#> endflight", 12) == 0) {
-        in_preflight = 0;
-        printf("%s Running preflight checks\n", LOG_INFO);
-        SEXP result = evaluate(buffer);
-        if(result == NULL) {
-          printf("%s Preflight checks failed\n", LOG_ERROR);
-          free(buffer);
-          free(line);
-          return 1;
-        }
-        free(buffer);
-        buffer = NULL;
-        free(line);
-        continue;
-      }
+  fclose(src);
+  return 1;
+}
 
-      if(in_preflight) {
-        buffer = append_buffer(buffer, line);
-        free(line);
-        continue;
-      }
+static int open_output(Output *out, char *dst, char *prepend, int direct)
+{
+  out->dst = dst;
+  out->tmp = NULL;
+  out->file = NULL;
+  out->empty = 1;
+  out->last = '\0';
+  buffer_init(&out->buf, direct ? 0 : 4096);
+
+  if(!direct) {
+    return 1;
+  }
 
-      free(line);
+  asprintf(&out->tmp, "%s.tmp", dst);
+  out->file = fopen(out->tmp, "w");
+  if(out->file == NULL) {
+    printf("%s Failed to open %s\n", LOG_ERROR, out->tmp);
+    free(out->tmp);
+    buffer_free(&out->buf);
+    return 0;
+  }
+
+  if(prepend != NULL && !copy_into(out->file, prepend)) {
+    fclose(out->file);
+    remove(out->tmp);
+    free(out->tmp);
+    buffer_free(&out->buf);
+    return 0;
+  }
+
+  return 1;
+}
+
+// lines are joined by a newline unless the text so far ends with one,
+// which a joined blank line does: runs of blank lines collapse
+static void output_line(Output *out, char *line)
+{
+  size_t len = strlen(line);
+
+  int separate = !out->empty && out->last != '\n';
+
+  if(out->file != NULL) {
+    if(separate) fputc('\n', out->file);
+    fputs(line, out->file);
+  } else {
+    if(separate) buffer_append_char(&out->buf, '\n');
+    buffer_append_len(&out->buf, line, len);
+  }
+
+  if(len > 0) {
+    out->last = line[len - 1];
+  } else if(separate) {
+    out->last = '\n';
+  }
+  out->empty = 0;
+}
+
+static void discard_output(Output *out)
+{
+  if(out->file != NULL) {
+    fclose(out->file);
+    remove(out->tmp);
+    free(out->tmp);
+  }
+  buffer_free(&out->buf);
+}
+
+static int write_output(char *dst, char *text, char *prepend, char *append)
+{
+  FILE *file = fopen(dst, "w");
+  if(file == NULL) {
+    printf("%s Failed to open %s\n", LOG_ERROR, dst);
+    return 0;
+  }
+
+  int ok = prepend == NULL || copy_into(file, prepend);
+  if(ok && text != NULL) {
+    fputs(text, file);
+  }
+  ok = ok && (append == NULL || copy_into(file, append));
+
+  return fclose(file) == 0 && ok;
+}
+
+static int close_output(Output *out, Plugins *plugins, char *src, char *prepend, char *append)
+{
+  if(out->file == NULL) {
+    char *text = out->empty ? NULL : out->buf.data;
+    char *output = plugins_call(plugins, "postprocess", text, src);
+    if(collect_deadcode) {
+      deadcode_add(output != NULL ? output : text, out->dst);
     }
+    int ok = write_output(out->dst, output != NULL ? output : text, prepend, append);
+    free(output);
+    buffer_free(&out->buf);
+    return ok;
+  }
 
-    free(line_number_str);
-    free(buffer);  // Free buffer if preflight wasn't properly closed
+  buffer_free(&out->buf);
+
+  int ok = append == NULL || copy_into(out->file, append);
+  ok = fclose(out->file) == 0 && ok;
+
+  if(!ok) {
+    remove(out->tmp);
+  } else if(rename(out->tmp, out->dst) != 0) {
+    remove(out->dst);
+    ok = rename(out->tmp, out->dst) == 0;
+  }
+
+  free(out->tmp);
+  return ok;
+}
+
+// Outputs held back for a batched postprocess_all(), written once every
+// file has gone through the second pass
+typedef struct {
+  char **dst;
+  char **src;
+  char **text;
+  int count;
+  int capacity;
+} Pending;
+
+static void defer_output(Pending *pending, Output *out, char *src)
+{
+  if(pending->count == pending->capacity) {
+    pending->capacity = pending->capacity ? pending->capacity * 2 : 16;
+    pending->dst = realloc(pending->dst, pending->capacity * sizeof(char*));
+    pending->src = realloc(pending->src, pending->capacity * sizeof(char*));
+    pending->text = realloc(pending->text, pending->capacity * sizeof(char*));
+  }
+
+  pending->dst[pending->count] = out->dst;
+  pending->src[pending->count] = src;
+  pending->text[pending->count] = out->empty ? NULL : buffer_release(&out->buf);
+  pending->count++;
+
+  buffer_free(&out->buf);
+}
+
+static int flush_pending(Pending *pending, Plugins *plugins, char *prepend, char *append)
+{
+  plugins_call_all(plugins, "postprocess", pending->text, pending->src, pending->count);
 
-    char *output = plugins_call(plugins, "preprocess", current->content, current->src);
-    if(output != NULL) {
-      free(current->content);
-      current->content = strdup(output);
-      free(output);
+  for(int i = 0; i < pending->count; i++) {
+    if(collect_deadcode) {
+      deadcode_add(pending->text[i], pending->dst[i]);
     }
+    if(!write_output(pending->dst[i], pending->text[i], prepend, append)) {
+      return 0;
+    }
+  }
 
-    current = current->next;
+  return 1;
+}
+
+// rewrites an output once tree shaking dropped some of its functions
+static int write_shaken(char *dst, char *code, void *data)
+{
+  Arguments *args = data;
+  return write_output(dst, code, args->prepend, args->append);
+}
+
+static void free_pending(Pending *pending)
+{
+  for(int i = 0; i < pending->count; i++) {
+    free(pending->text[i]);
+  }
+  free(pending->dst);
+  free(pending->src);
+  free(pending->text);
+}
+
+// R numbers the lines of a multi-line expansion on from its first line,
+// so each further line gets a directive back to the line it expands.
+// Lines within a string are left alone, a directive would become part of
+// the string; mapped_line is where the line after the expansion maps to.
+static char *map_expansion(char *text, int source_line, char *src, int *mapped_line)
+{
+  Buffer buf = {NULL, 0, 0};
+  char *directive = line_directive(source_line, src);
+  char quote = 0;
+  int comment = 0;
+
+  *mapped_line = source_line + 1;
+  for(char *c = text; *c; c++) {
+    buffer_append_char(&buf, *c);
+
+    if(quote) {
+      if(*c == '\\' && c[1] != '\0') {
+        buffer_append_char(&buf, *++c);
+      } else if(*c == quote) {
+        quote = 0;
+      } else if(*c == '\n' && c[1] != '\0') {
+        (*mapped_line)++;
+      }
+      continue;
+    }
+
+    if(*c == '\n') {
+      comment = 0;
+      if(c[1] != '\0') {
+        buffer_append(&buf, directive);
+        buffer_append_char(&buf, '\n');
+        *mapped_line = source_line + 1;
+      }
+    } else if(!comment && *c == '#') {
+      comment = 1;
+    } else if(!comment && (*c == '"' || *c == '\'' || *c == '`')) {
+      quote = *c;
+    }
   }
 
-  return 0;
+  free(directive);
+  return buffer_release(&buf);
 }
 
-static int second_pass(RFile *files, Define **defs, Plugins *plugins, char *prepend, char *append, int sourcemap, Registry **registry)
+static int second_pass(RFile *files, Define **defs, Plugins *plugins, char *prepend, char *append, int sourcemap, Registry **registry, Pending *pending)
 {
   RFile *current = files;
   while(current != NULL) {
@@ -712,10 +1265,20 @@ static int second_pass(RFile *files, Define **defs, Plugins *plugins, char *prep
     printf("%s Copying %s to %s\n", LOG_INFO, current->src, current->dst);
     overwrite(defs, "..FILE..", current->src);
 
+    if(!load_content(current)) {
+      return 1;
+    }
+
+    Output out;
+    if(!open_output(&out, current->dst, prepend, plugins == NULL && !collect_deadcode)) {
+      return 1;
+    }
+
     // state
-    char *buffer = NULL;
     char *for_buffer = NULL;
+    int for_line = 0;
     int line_number = 0;
+    int mapped_line = 0;
     char *line_number_str = NULL;
     int should_write = 1;
     int branch_taken = 0;
@@ -740,7 +1303,7 @@ static int second_pass(RFile *files, Define **defs, Plugins *plugins, char *prep
 
       char *line = NULL;
 
-      if(!sourcemap) {
+      if(sourcemap != SOURCEMAP_COMMENTS) {
         line = malloc(len + 1);
         strncpy(line, pos, len);
         line[len] = '\0';
@@ -779,6 +1342,7 @@ static int second_pass(RFile *files, Define **defs, Plugins *plugins, char *prep
 
       if(enter_for(trimmed)) {
         in_for = 1;
+        for_line = line_number;
         for_buffer = strdup(line);
         free(line);
         continue;
@@ -790,7 +1354,9 @@ static int second_pass(RFile *files, Define **defs, Plugins *plugins, char *prep
         continue;
       }
 
+      int source_line = line_number;
       if(exit_for(trimmed)) {
+        source_line = for_line + 1;
         char *expanded = replace_for(for_buffer, line);
         free(for_buffer);
         free(line);
@@ -842,54 +1408,39 @@ static int second_pass(RFile *files, Define **defs, Plugins *plugins, char *prep
 
       if(err) {
         free(cnst);
+        discard_output(&out);
         return 1;
       }
 
-      buffer = append_buffer(buffer, cnst);
-      free(cnst);
-    }
+      // the next line maps to mapped_line unless a directive says otherwise;
+      // a blank line only ends the text so far (see output_line()), so it
+      // takes no line of the output and mapped_line stays where it is
+      if(sourcemap == SOURCEMAP_LINES && cnst[0] != '\0') {
+        if(source_line != mapped_line) {
+          char *directive = line_directive(source_line, current->src);
+          output_line(&out, directive);
+          free(directive);
+        }
 
-    FILE *dst_file = fopen(current->dst, "w");
-    if(dst_file == NULL) {
-      printf("%s Failed to open %s\n", LOG_ERROR, current->dst);
-      return 1;
-    }
-    char *output = plugins_call(plugins, "postprocess", buffer, current->src);
-    if(prepend != NULL) {
-      FILE *prepend_file = fopen(prepend, "r");
-      if(prepend_file == NULL) {
-        printf("%s Failed to open %s\n", LOG_ERROR, prepend);
-        return 1;
-      }
-      char prepend_buffer[1024];
-      while(fgets(prepend_buffer, sizeof(prepend_buffer), prepend_file) != NULL) {
-        fputs(prepend_buffer, dst_file);
+        mapped_line = source_line + 1;
+        if(strchr(cnst, '\n') != NULL) {
+          char *mapped = map_expansion(cnst, source_line, current->src, &mapped_line);
+          free(cnst);
+          cnst = mapped;
+        }
       }
-      fclose(prepend_file);
-    }
 
-    if(output != NULL) {
-      fputs(output, dst_file);
-      free(output);
-    } else if(buffer != NULL) {
-      fputs(buffer, dst_file);
+      output_line(&out, cnst);
+      free(cnst);
     }
 
-    if(append != NULL) {
-      FILE *append_file = fopen(append, "r");
-      if(append_file == NULL) {
-        printf("%s Failed to open %s\n", LOG_ERROR, append);
-        return 1;
-      }
-      char append_buffer[1024];
-      while(fgets(buffer, sizeof(append_buffer), append_file) != NULL) {
-        fputs(buffer, dst_file);
-      }
-      fclose(append_file);
+    if(pending != NULL) {
+      defer_output(pending, &out, current->src);
+    } else if(!close_output(&out, plugins, current->src, prepend, append)) {
+      return 1;
     }
 
-    fclose(dst_file);
-    free(buffer);
+    release_content(current);
 
     write_tests(tc.tests, current->src);
 
@@ -903,19 +1454,33 @@ static int second_pass(RFile *files, Define **defs, Plugins *plugins, char *prep
 
 int two_pass(Arguments *args)
 {
-  int first_pass_result = first_pass(args->files, args->defs, args->plugins);
+  int first_pass_result = first_pass(args->files, args->defs, args->plugins, args->registry);
   if(first_pass_result) {
     return 1;
   }
 
-  int second_pass_result = second_pass(args->files, args->defs, args->plugins, args->prepend, args->append, args->sourcemap, args->registry);
-  if(second_pass_result) {
-    return 1;
+  Pending pending = {NULL, NULL, NULL, 0, 0};
+  int batched = plugins_batched(args->plugins, "postprocess");
+
+  collect_deadcode = args->deadcode || args->treeshake;
+  if(collect_deadcode) {
+    deadcode_begin(args->treeshake ? write_shaken : NULL, args);
   }
 
-  if(args->deadcode) {
-    analyse_deadcode(args->files);
+  int second_pass_result = second_pass(args->files, args->defs, args->plugins, args->prepend, args->append, args->sourcemap, args->registry, batched ? &pending : NULL);
+  if(!second_pass_result && batched && !flush_pending(&pending, args->plugins, args->prepend, args->append)) {
+    second_pass_result = 1;
+  }
+  free_pending(&pending);
+
+  if(collect_deadcode) {
+    collect_deadcode = 0;
+    if(second_pass_result) {
+      deadcode_abort();
+    } else if(deadcode_report()) {
+      second_pass_result = 1;
+    }
   }
 
-  return 0;
+  return second_pass_result;
 }
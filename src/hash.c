@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+// FNV-1a
+unsigned long hash_string(const char *str)
+{
+  unsigned long hash = 2166136261UL;
+  while(*str) {
+    hash ^= (unsigned char)*str++;
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+// 64-bit FNV-1a, chainable through `seed` (start with HASH_SEED)
+unsigned long long hash_bytes(const void *data, size_t len, unsigned long long seed)
+{
+  const unsigned char *p = data;
+  unsigned long long hash = seed;
+  for(size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+HashMap *hashmap_create(int capacity)
+{
+  HashMap *map = malloc(sizeof(HashMap));
+  if(map == NULL) {
+    return NULL;
+  }
+
+  if(capacity < 8) capacity = 8;
+
+  map->buckets = calloc(capacity, sizeof(HashEntry*));
+  if(map->buckets == NULL) {
+    free(map);
+    return NULL;
+  }
+
+  map->capacity = capacity;
+  map->size = 0;
+
+  return map;
+}
+
+static HashEntry *find_entry(HashMap *map, const char *key)
+{
+  if(map == NULL) {
+    return NULL;
+  }
+
+  HashEntry *entry = map->buckets[hash_string(key) % map->capacity];
+  while(entry != NULL) {
+    if(strcmp(entry->key, key) == 0) return entry;
+    entry = entry->next;
+  }
+
+  return NULL;
+}
+
+void *hashmap_get(HashMap *map, const char *key)
+{
+  HashEntry *entry = find_entry(map, key);
+  if(entry == NULL) {
+    return NULL;
+  }
+  return entry->value;
+}
+
+int hashmap_has(HashMap *map, const char *key)
+{
+  return find_entry(map, key) != NULL;
+}
+
+static void grow(HashMap *map)
+{
+  int capacity = map->capacity * 2;
+  HashEntry **buckets = calloc(capacity, sizeof(HashEntry*));
+  if(buckets == NULL) {
+    return;
+  }
+
+  for(int i = 0; i < map->capacity; i++) {
+    HashEntry *entry = map->buckets[i];
+    while(entry != NULL) {
+      HashEntry *next = entry->next;
+      unsigned long index = hash_string(entry->key) % capacity;
+      entry->next = buckets[index];
+      buckets[index] = entry;
+      entry = next;
+    }
+  }
+
+  free(map->buckets);
+  map->buckets = buckets;
+  map->capacity = capacity;
+}
+
+void hashmap_set(HashMap *map, const char *key, void *value)
+{
+  HashEntry *existing = find_entry(map, key);
+  if(existing != NULL) {
+    existing->value = value;
+    return;
+  }
+
+  if(map->size >= map->capacity) {
+    grow(map);
+  }
+
+  HashEntry *entry = malloc(sizeof(HashEntry));
+  if(entry == NULL) {
+    return;
+  }
+
+  unsigned long index = hash_string(key) % map->capacity;
+  entry->key = strdup(key);
+  entry->value = value;
+  entry->next = map->buckets[index];
+  map->buckets[index] = entry;
+  map->size++;
+}
+
+void hashmap_free(HashMap *map, HashFree free_value)
+{
+  if(map == NULL) {
+    return;
+  }
+
+  for(int i = 0; i < map->capacity; i++) {
+    HashEntry *entry = map->buckets[i];
+    while(entry != NULL) {
+      HashEntry *next = entry->next;
+      if(free_value != NULL) free_value(entry->value);
+      free(entry->key);
+      free(entry);
+      entry = next;
+    }
+  }
+
+  free(map->buckets);
+  free(map);
+}
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include "compat.h"
+#include "ignore.h"
+
+// .builderignore: gitignore-style patterns for paths relative to the
+// build directory. Ignored directories are not descended into at all.
+//
+//   # comment          blank lines and comments are skipped
+//   name               a file or directory called name, at any depth
+//   dir/               directories only
+//   /srcr/vendor       anchored: a leading or inner / matches from the root
+//   *.bak, data-?      * and ? do not cross /, [a-z] character classes
+//   srcr/**/fixtures   ** matches across directories
+//   !keep.R            a later negated pattern re-includes a path
+
+// version control metadata is never source, skipped unless re-included
+static const char *DEFAULTS[] = {".git/", ".svn/", ".hg/", ".builder/", NULL};
+
+static int match_class(const char **pattern, char c)
+{
+  const char *p = *pattern + 1;
+  int negate = *p == '!' || *p == '^';
+  if(negate) p++;
+
+  int matched = 0;
+  int first = 1;
+  while(*p && (*p != ']' || first)) {
+    first = 0;
+    if(p[1] == '-' && p[2] && p[2] != ']') {
+      if(c >= p[0] && c <= p[2]) matched = 1;
+      p += 3;
+      continue;
+    }
+    if(*p == c) matched = 1;
+    p++;
+  }
+
+  // unterminated class: the [ is literal
+  if(*p != ']') {
+    *pattern += 1;
+    return c == '[';
+  }
+
+  *pattern = p + 1;
+  return matched != negate;
+}
+
+static int glob_match(const char *p, const char *s)
+{
+  while(*p) {
+    if(p[0] == '*' && p[1] == '*') {
+      p += 2;
+      if(*p == '\0') return 1;
+
+      // "**/": zero or more whole directories
+      if(*p == '/') {
+        p++;
+        if(glob_match(p, s)) return 1;
+        for(const char *t = s; *t; t++) {
+          if(*t == '/' && glob_match(p, t + 1)) return 1;
+        }
+        return 0;
+      }
+
+      for(const char *t = s; ; t++) {
+        if(glob_match(p, t)) return 1;
+        if(*t == '\0') return 0;
+      }
+    }
+
+    if(*p == '*') {
+      p++;
+      for(const char *t = s; ; t++) {
+        if(glob_match(p, t)) return 1;
+        if(*t == '\0' || *t == '/') return 0;
+      }
+    }
+
+    if(*s == '\0') return 0;
+
+    if(*p == '?') {
+      if(*s == '/') return 0;
+      p++;
+      s++;
+      continue;
+    }
+
+    if(*p == '[') {
+      if(*s == '/' || !match_class(&p, *s)) return 0;
+      s++;
+      continue;
+    }
+
+    if(*p == '\\' && p[1]) p++;
+    if(*p != *s) return 0;
+    p++;
+    s++;
+  }
+
+  return *s == '\0';
+}
+
+static Ignore *parse_rule(const char *line)
+{
+  char *pattern = strdup(line);
+  size_t len = strcspn(pattern, "\r\n");
+  pattern[len] = '\0';
+
+  // trailing spaces are ignored unless escaped
+  while(len > 0 && pattern[len - 1] == ' ' && (len < 2 || pattern[len - 2] != '\\')) {
+    pattern[--len] = '\0';
+  }
+
+  if(len == 0 || pattern[0] == '#') {
+    free(pattern);
+    return NULL;
+  }
+
+  Ignore *rule = malloc(sizeof(Ignore));
+  rule->negate = 0;
+  rule->dir_only = 0;
+  rule->anchored = 0;
+  rule->next = NULL;
+
+  char *start = pattern;
+  if(*start == '!') {
+    rule->negate = 1;
+    start++;
+  } else if(*start == '\\' && (start[1] == '!' || start[1] == '#')) {
+    start++;
+  }
+
+  len = strlen(start);
+  if(len > 0 && start[len - 1] == '/') {
+    rule->dir_only = 1;
+    start[--len] = '\0';
+  }
+
+  if(strchr(start, '/') != NULL) {
+    rule->anchored = 1;
+    if(*start == '/') start++;
+  }
+
+  if(*start == '\0') {
+    free(pattern);
+    free(rule);
+    return NULL;
+  }
+
+  rule->pattern = strdup(start);
+  free(pattern);
+  return rule;
+}
+
+static void append_rule(Ignore **rules, Ignore *rule)
+{
+  if(rule == NULL) return;
+
+  if(*rules == NULL) {
+    *rules = rule;
+    return;
+  }
+
+  Ignore *current = *rules;
+  while(current->next != NULL) current = current->next;
+  current->next = rule;
+}
+
+Ignore *load_ignore(const char *path)
+{
+  Ignore *rules = NULL;
+
+  for(int i = 0; DEFAULTS[i] != NULL; i++) {
+    append_rule(&rules, parse_rule(DEFAULTS[i]));
+  }
+
+  FILE *file = fopen(path, "r");
+  if(file == NULL) {
+    return rules;
+  }
+
+  char line[1024];
+  while(fgets(line, sizeof(line), file) != NULL) {
+    append_rule(&rules, parse_rule(line));
+  }
+
+  fclose(file);
+  return rules;
+}
+
+// Paths are built as <dir>/<name> from the input directory. One given as
+// an absolute path inside the project is matched from the project root,
+// one outside the project (absolute or ../) as if it sat in the root.
+// Returns how many leading characters of those paths to skip.
+size_t ignore_prefix(const char *dir)
+{
+  char cwd[PATH_MAX];
+  size_t len = strlen(dir);
+
+  int absolute = dir[0] == '/' || (isalpha((unsigned char)dir[0]) && dir[1] == ':');
+  int outside = absolute || strncmp(dir, "../", 3) == 0 || strcmp(dir, "..") == 0;
+  if(!outside) {
+    return 0;
+  }
+
+  if(absolute && getcwd(cwd, sizeof(cwd)) != NULL) {
+    size_t root = strlen(cwd);
+    if(root > 1 && strncmp(dir, cwd, root) == 0 && (dir[root] == '/' || dir[root] == '\0')) {
+      return root + 1;
+    }
+  }
+
+  while(len > 1 && dir[len - 1] == '/') len--;
+  while(len > 0 && dir[len - 1] != '/') len--;
+  return len;
+}
+
+int is_ignored(Ignore *rules, const char *path, int is_dir)
+{
+  while(path[0] == '.' && path[1] == '/') path += 2;
+
+  const char *name = strrchr(path, '/');
+  name = name != NULL ? name + 1 : path;
+
+  int ignored = 0;
+  for(Ignore *rule = rules; rule != NULL; rule = rule->next) {
+    if(rule->dir_only && !is_dir) continue;
+    if(ignored == !rule->negate) continue;
+
+    if(glob_match(rule->pattern, rule->anchored ? path : name)) {
+      ignored = !rule->negate;
+    }
+  }
+
+  return ignored;
+}
+
+void free_ignore(Ignore *rules)
+{
+  Ignore *current = rules;
+  while(current != NULL) {
+    Ignore *next = current->next;
+    free(current->pattern);
+    free(current);
+    current = next;
+  }
+}
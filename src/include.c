@@ -1,13 +1,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include <Rinternals.h>
 
+#include "compat.h"
 #include "include.h"
+#include "deparse.h"
+#include "reader.h"
+#include "buffer.h"
 #include "define.h"
 #include "r.h"
+#include "hash.h"
 #include "log.h"
 
+#ifndef BUILDER_NO_FORK
+#include <sys/wait.h>
+#endif
+
+#define CACHE_DIR ".builder/include"
+#define CACHE_VERSION 2
+#define LAZY_DIR "inst/builder"
+#define MAX_INCLUDE_THREADS 32
+
+static int include_cache = 1;
+static long include_compress = 1024 * 1024;
+static HashMap *include_memo = NULL;
+
 Registry *create_registry(char *type, char *call)
 {
   Registry *registry = malloc(sizeof(Registry));
@@ -68,6 +89,9 @@ static void free_include(Include *include)
   if(include->type != NULL) free(include->type);
   if(include->path != NULL) free(include->path);
   if(include->object != NULL) free(include->object);
+  if(include->mode != NULL) free(include->mode);
+  if(include->select != NULL) free(include->select);
+  if(include->where != NULL) free(include->where);
 }
 
 static int has_include(char *line)
@@ -77,7 +101,7 @@ static int has_include(char *line)
 
 static Include parse_include(char *line)
 {
-  Include result = {NULL, NULL, NULL};
+  Include result = {NULL, NULL, NULL, NULL, NULL, NULL};
 
   const char *start = strstr(line, "#> include:");
   if(start == NULL) return result;
@@ -92,7 +116,7 @@ static Include parse_include(char *line)
   int part = 0;
 
   token = strtok_r(work, " ", &saveptr);
-  while(token != NULL && part < 3) {
+  while(token != NULL) {
     switch (part) {
       case 0:
         result.type = strdup(token); break;
@@ -100,6 +124,19 @@ static Include parse_include(char *line)
         result.path = strdup(token); break;
       case 2:
         result.object = strdup(token); break;
+      default:
+        if(strncmp(token, "select=", 7) == 0) {
+          free(result.select);
+          result.select = strdup(token + 7);
+        } else if(strncmp(token, "where=", 6) == 0) {
+          // the filter is an R expression, it takes the rest of the line
+          result.where = strdup(start + (token - work) + 6);
+          result.where[strcspn(result.where, "\r\n")] = '\0';
+          token = NULL;
+          continue;
+        } else if(result.mode == NULL) {
+          result.mode = strdup(token);
+        }
     }
     part++;
     token = strtok_r(NULL, " ", &saveptr);
@@ -109,32 +146,855 @@ static Include parse_include(char *line)
   return result;
 }
 
-static const char *capture_object(char *func, char *file)
+// last resort for objects deparse_object() does not handle
+static int dput_object(Buffer *buf, SEXP object)
+{
+  SEXP sym = install(".builder_include");
+  defineVar(sym, object, R_GlobalEnv);
+  const char *result = eval_string("paste0(capture.output(dput(.builder_include)),collapse='')");
+  if(result != NULL) {
+    buffer_append(buf, result);
+  }
+  defineVar(sym, R_NilValue, R_GlobalEnv);
+  return result != NULL;
+}
+
+static char *capture_object(char *func, char *file)
 {
-  char *call = (char*)malloc(strlen(func) + strlen(file) + 53);
-  snprintf(call, strlen(func) + strlen(file) + 53, "paste0(capture.output(dput((%s)('%s'))),collapse='')", func, file);
-  const char *result = eval_string(call);
+  char *call = NULL;
+  asprintf(&call, "(%s)('%s')", func, file);
+  SEXP result = evaluate(call);
   free(call);
 
   if(result == NULL) {
     return NULL;
   }
 
-  return strdup(result);
+  PROTECT(result);
+
+  Buffer buf;
+  buffer_init(&buf, 4096);
+
+  if(!deparse_object(&buf, result) && !dput_object(&buf, result)) {
+    UNPROTECT(1);
+    buffer_free(&buf);
+    return NULL;
+  }
+
+  UNPROTECT(1);
+  return buffer_release(&buf);
+}
+
+static char *read_all(const char *path, size_t *size)
+{
+  FILE *file = fopen(path, "rb");
+  if(file == NULL) {
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long len = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *content = malloc(len + 1);
+  if(content == NULL) {
+    fclose(file);
+    return NULL;
+  }
+
+  *size = fread(content, 1, len, file);
+  content[*size] = '\0';
+  fclose(file);
+
+  return content;
+}
+
+// .builder/include/<key>, where the key covers the reader call, the path,
+// the file's size and mtime, a hash of its content and the compression
+// threshold, since entries hold the literal as it is spliced in
+static char *cache_path(char *call, char *path)
+{
+  struct stat st;
+  if(stat(path, &st) != 0) {
+    return NULL;
+  }
+
+  size_t size = 0;
+  char *content = read_all(path, &size);
+  if(content == NULL) {
+    return NULL;
+  }
+
+  unsigned long long content_hash = hash_bytes(content, size, HASH_SEED);
+  free(content);
+
+  char *key_src = NULL;
+  asprintf(
+    &key_src, "%d\n%s\n%s\n%lld\n%lld\n%016llx\n%ld", CACHE_VERSION, call, path,
+    (long long)st.st_size, (long long)st.st_mtime, content_hash, include_compress
+  );
+  unsigned long long key = hash_bytes(key_src, strlen(key_src), HASH_SEED);
+  free(key_src);
+
+  char *cached = NULL;
+  asprintf(&cached, "%s/%016llx", CACHE_DIR, key);
+  return cached;
+}
+
+static int write_file(const char *path, const char *content, size_t len)
+{
+  char *tmp = NULL;
+  asprintf(&tmp, "%s.tmp", path);
+
+  FILE *file = fopen(tmp, "wb");
+  if(file == NULL) {
+    free(tmp);
+    return 0;
+  }
+
+  int ok = fwrite(content, 1, len, file) == len;
+  ok = fclose(file) == 0 && ok;
+
+  if(!ok) {
+    remove(tmp);
+  } else if(rename(tmp, path) != 0) {
+    remove(path);
+    ok = rename(tmp, path) == 0;
+  }
+
+  free(tmp);
+  return ok;
+}
+
+static void cache_store(char *cached, char *content)
+{
+  builder_mkdir(".builder", 0755);
+  builder_mkdir(CACHE_DIR, 0755);
+  write_file(cached, content, strlen(content));
+}
+
+void set_include_cache(int enabled)
+{
+  include_cache = enabled;
 }
 
-static const char *capture_path(Registry **registry, char *type, char *path)
+static char *find_reader(Registry **registry, char *type)
 {
   Registry *current = *registry;
   while(current != NULL) {
     if(strcmp(current->type, type) == 0) {
-      return capture_object(current->call, path);
+      return current->call;
     }
     current = current->next;
   }
   return NULL;
 }
 
+// the built-in text and delimited readers, without R; rows can only be
+// filtered by R
+static char *capture_native(char *call, Include *inc)
+{
+  if(inc->where != NULL) {
+    return NULL;
+  }
+
+  size_t size = 0;
+  char *content = read_all(inc->path, &size);
+  if(content == NULL) {
+    return NULL;
+  }
+
+  char *literal = read_native(call, inc->select, content, size);
+  free(content);
+  return literal;
+}
+
+// c("a", "b") from select=a,b
+static void append_columns(Buffer *buf, char *select)
+{
+  char *work = strdup(select);
+  char *saveptr;
+  int n = 0;
+
+  buffer_append(buf, "c(");
+  for(char *col = strtok_r(work, ",", &saveptr); col != NULL; col = strtok_r(NULL, ",", &saveptr)) {
+    if(n++ > 0) buffer_append(buf, ", ");
+    deparse_string(buf, col);
+  }
+  buffer_append_char(buf, ')');
+
+  free(work);
+}
+
+// The reader as called for this include: select= and where= become
+// arguments of subset() on the result, except that a projection alone is
+// pushed into arrow::read_parquet() so the other columns are never read.
+// Being a plain call, it also keys the memo and the disk cache.
+static char *reader_call(char *call, Include *inc)
+{
+  if(inc->select == NULL && inc->where == NULL) {
+    return strdup(call);
+  }
+
+  Buffer buf;
+  buffer_init(&buf, 128);
+
+  if(inc->where == NULL && strcmp(call, "arrow::read_parquet") == 0) {
+    buffer_append(&buf, "function(.path) arrow::read_parquet(.path, col_select = ");
+    append_columns(&buf, inc->select);
+    buffer_append_char(&buf, ')');
+    return buffer_release(&buf);
+  }
+
+  buffer_append(&buf, "function(.path) subset((");
+  buffer_append(&buf, call);
+  buffer_append(&buf, ")(.path)");
+  if(inc->where != NULL) {
+    buffer_append(&buf, ", ");
+    buffer_append(&buf, inc->where);
+  }
+  if(inc->select != NULL) {
+    buffer_append(&buf, ", select = ");
+    append_columns(&buf, inc->select);
+  }
+  buffer_append_char(&buf, ')');
+
+  return buffer_release(&buf);
+}
+
+// The object behind a large literal, serialized and xz-compressed, as an
+// expression that restores it with base R only: the payload is one hex
+// string, which R parses far faster than the equivalent c(...) literal.
+// NULL when that does not come out smaller.
+static char *compress_literal(char *literal)
+{
+  static const char HEX[] = "0123456789abcdef";
+
+  SEXP sym = install(".builder_include");
+  SEXP value = evaluate(literal);
+  if(value == NULL) {
+    return NULL;
+  }
+  defineVar(sym, value, R_GlobalEnv);
+
+  SEXP packed = evaluate("memCompress(serialize(.builder_include, NULL), 'xz')");
+  if(packed == NULL || TYPEOF(packed) != RAWSXP) {
+    defineVar(sym, R_NilValue, R_GlobalEnv);
+    return NULL;
+  }
+  PROTECT(packed);
+  defineVar(sym, R_NilValue, R_GlobalEnv);
+
+  R_xlen_t n = XLENGTH(packed);
+  Buffer buf;
+  buffer_init(&buf, n * 2 + 256);
+
+  buffer_append(&buf, "local({v <- as.integer(charToRaw(\"");
+  for(R_xlen_t i = 0; i < n; i++) {
+    buffer_append_char(&buf, HEX[RAW(packed)[i] >> 4]);
+    buffer_append_char(&buf, HEX[RAW(packed)[i] & 0xf]);
+  }
+  buffer_append(
+    &buf,
+    "\")); v <- v - 48L - 39L * (v > 57L); "
+    "unserialize(memDecompress(as.raw(v[c(TRUE, FALSE)] * 16L + v[c(FALSE, TRUE)]), 'xz'))})"
+  );
+  UNPROTECT(1);
+
+  if(buf.len >= strlen(literal)) {
+    buffer_free(&buf);
+    return NULL;
+  }
+
+  return buffer_release(&buf);
+}
+
+void set_include_compress(long threshold)
+{
+  include_compress = threshold;
+}
+
+static int should_compress(const char *content)
+{
+  return include_compress > 0 && (long)strlen(content) >= include_compress;
+}
+
+static char *compress_result(char *content)
+{
+  if(content == NULL || !should_compress(content)) {
+    return content;
+  }
+
+  char *packed = compress_literal(content);
+  if(packed == NULL) {
+    return content;
+  }
+
+  free(content);
+  return packed;
+}
+
+// One include being read. The disk cache holds what is spliced in, after
+// compression, so a hit needs neither the reader nor R; small native
+// results are cheaper to read again than to look up.
+typedef struct {
+  char *key;
+  char *base;
+  char *call;
+  Include inc;
+  char *native;
+  char *cached;
+  char *content;
+} Capture;
+
+// the part of a capture that needs no R and may run on any thread: the
+// native readers and the cache lookup. content is left NULL when the
+// reader has to be called or the result compressed.
+static void lookup_capture(Capture *capture)
+{
+  capture->native = capture_native(capture->base, &capture->inc);
+  if(capture->native != NULL && !should_compress(capture->native)) {
+    capture->content = capture->native;
+    capture->native = NULL;
+    return;
+  }
+
+  capture->cached = include_cache ? cache_path(capture->call, capture->inc.path) : NULL;
+  if(capture->cached == NULL) {
+    return;
+  }
+
+  size_t size = 0;
+  capture->content = read_all(capture->cached, &size);
+  if(capture->content != NULL) {
+    free(capture->native);
+    capture->native = NULL;
+
+    // a hit is not stored again
+    free(capture->cached);
+    capture->cached = NULL;
+  }
+}
+
+// the part that needs R
+static char *finish_capture(Capture *capture)
+{
+  char *native = capture->native;
+  capture->native = NULL;
+  return compress_result(native != NULL ? native : capture_object(capture->call, capture->inc.path));
+}
+
+static void memo_capture(Capture *capture)
+{
+  if(capture->content == NULL) {
+    return;
+  }
+
+  if(capture->cached != NULL) {
+    cache_store(capture->cached, capture->content);
+  }
+
+  if(include_memo == NULL) {
+    include_memo = hashmap_create(64);
+  }
+  hashmap_set(include_memo, capture->key, capture->content);
+}
+
+// Reader results for the current build, keyed by reader call and path, so
+// a file included from several places (or under several names) is read
+// and deparsed once. Returns a copy the caller owns.
+static char *capture_memo(char *base, Include *inc)
+{
+  Capture capture = {NULL, base, reader_call(base, inc), *inc, NULL, NULL, NULL};
+  asprintf(&capture.key, "%s\n%s", capture.call, inc->path);
+
+  char *content = include_memo != NULL ? hashmap_get(include_memo, capture.key) : NULL;
+  if(content == NULL) {
+    lookup_capture(&capture);
+    if(capture.content == NULL) {
+      capture.content = finish_capture(&capture);
+    }
+    memo_capture(&capture);
+    content = capture.content;
+  }
+
+  free(capture.key);
+  free(capture.call);
+  free(capture.cached);
+  return content != NULL ? strdup(content) : NULL;
+}
+
+static void free_capture(Capture *capture)
+{
+  free(capture->key);
+  free(capture->base);
+  free(capture->call);
+  free(capture->native);
+  free(capture->cached);
+  free(capture->content);
+  free_include(&capture->inc);
+}
+
+// Includes queued by prefetch_includes() until read_includes()
+static Capture *queued = NULL;
+static int queued_count = 0;
+static int queued_capacity = 0;
+
+static void clear_queued()
+{
+  for(int i = 0; i < queued_count; i++) {
+    free_capture(&queued[i]);
+  }
+  free(queued);
+  queued = NULL;
+  queued_count = 0;
+  queued_capacity = 0;
+}
+
+void clear_include_memo()
+{
+  clear_queued();
+
+  if(include_memo == NULL) {
+    return;
+  }
+  hashmap_free(include_memo, free);
+  include_memo = NULL;
+}
+
+static char *capture_path(Registry **registry, Include *inc)
+{
+  char *call = find_reader(registry, inc->type);
+  if(call == NULL) {
+    return NULL;
+  }
+  return capture_memo(call, inc);
+}
+
+static int include_workers = 0;
+
+void set_include_workers(int workers)
+{
+  include_workers = workers;
+}
+
+// Queues every distinct include of a file to be read ahead of the second
+// pass, so the line-by-line processing only hits the memo. Includes whose
+// reader is unknown or that are lazy are left to include_replace().
+void prefetch_includes(char *content, Registry **registry)
+{
+  char *pos = content;
+  while(pos != NULL && *pos) {
+    char *end = strchr(pos, '\n');
+    size_t len = end != NULL ? (size_t)(end - pos) : strlen(pos);
+
+    char *line = malloc(len + 1);
+    memcpy(line, pos, len);
+    line[len] = '\0';
+    pos = end != NULL ? end + 1 : NULL;
+
+    if(!has_include(line)) {
+      free(line);
+      continue;
+    }
+
+    Include inc = parse_include(line);
+    free(line);
+
+    char *base = inc.type != NULL ? find_reader(registry, inc.type) : NULL;
+    if(base == NULL || inc.path == NULL || inc.object == NULL || inc.mode != NULL) {
+      free_include(&inc);
+      continue;
+    }
+
+    Capture capture = {NULL, strdup(base), reader_call(base, &inc), inc, NULL, NULL, NULL};
+    asprintf(&capture.key, "%s\n%s", capture.call, inc.path);
+
+    int seen = include_memo != NULL && hashmap_has(include_memo, capture.key);
+    for(int i = 0; !seen && i < queued_count; i++) {
+      seen = strcmp(queued[i].key, capture.key) == 0;
+    }
+
+    if(seen) {
+      free_capture(&capture);
+      continue;
+    }
+
+    if(queued_count == queued_capacity) {
+      queued_capacity = queued_capacity > 0 ? queued_capacity * 2 : 16;
+      queued = realloc(queued, queued_capacity * sizeof(Capture));
+    }
+    queued[queued_count++] = capture;
+  }
+}
+
+typedef struct {
+  Capture *captures;
+  int n;
+  int start;
+  int step;
+} LookupWork;
+
+static void *lookup_worker(void *data)
+{
+  LookupWork *work = data;
+  for(int i = work->start; i < work->n; i += work->step) {
+    lookup_capture(&work->captures[i]);
+  }
+  return NULL;
+}
+
+#ifndef BUILDER_NO_FORK
+
+// Reader calls run in forked workers that inherit the R session
+// copy-on-write, each over a contiguous slice of the includes left after
+// the lookup, and write the results back through a pipe as 'T' <length>
+// <text> or 'N' per include, followed by 'K'.
+
+typedef struct {
+  pid_t pid;
+  int fd;
+  int start;
+  int end;
+} Worker;
+
+static int write_pipe(int fd, const void *data, size_t len)
+{
+  const char *pos = data;
+  while(len > 0) {
+    ssize_t written = write(fd, pos, len);
+    if(written < 0 && errno == EINTR) continue;
+    if(written <= 0) return 0;
+    pos += written;
+    len -= written;
+  }
+  return 1;
+}
+
+static int read_pipe(int fd, void *data, size_t len)
+{
+  char *pos = data;
+  while(len > 0) {
+    ssize_t got = read(fd, pos, len);
+    if(got < 0 && errno == EINTR) continue;
+    if(got <= 0) return 0;
+    pos += got;
+    len -= got;
+  }
+  return 1;
+}
+
+static void run_worker(Capture **captures, int n, int fd)
+{
+  int ok = 1;
+  for(int i = 0; ok && i < n; i++) {
+    char *text = finish_capture(captures[i]);
+    fflush(stdout);
+    size_t len = text != NULL ? strlen(text) : 0;
+    ok = text != NULL
+      ? write_pipe(fd, "T", 1) && write_pipe(fd, &len, sizeof(len)) && write_pipe(fd, text, len)
+      : write_pipe(fd, "N", 1);
+    free(text);
+  }
+
+  if(ok) {
+    write_pipe(fd, "K", 1);
+  }
+  close(fd);
+
+  // skip R's and the parent's exit handlers
+  _exit(ok ? 0 : 1);
+}
+
+// results of a worker that fails part way are left NULL and read here
+static int collect_worker(Worker *worker, Capture **captures)
+{
+  int ok = 1;
+  for(int i = worker->start; ok && i < worker->end; i++) {
+    char kind = 0;
+    ok = read_pipe(worker->fd, &kind, 1);
+    if(!ok || kind == 'N') {
+      continue;
+    }
+
+    size_t len = 0;
+    ok = kind == 'T' && read_pipe(worker->fd, &len, sizeof(len));
+    if(!ok) continue;
+
+    char *text = malloc(len + 1);
+    ok = read_pipe(worker->fd, text, len);
+    text[len] = '\0';
+    if(!ok) {
+      free(text);
+      continue;
+    }
+
+    captures[i]->content = text;
+    free(captures[i]->native);
+    captures[i]->native = NULL;
+  }
+
+  char done = 0;
+  ok = ok && read_pipe(worker->fd, &done, 1) && done == 'K';
+  close(worker->fd);
+
+  int status = 0;
+  while(waitpid(worker->pid, &status, 0) < 0 && errno == EINTR);
+  return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void run_forked(Capture **captures, int n)
+{
+  int nworkers = include_workers < n ? include_workers : n;
+  Worker *workers = malloc(nworkers * sizeof(Worker));
+
+  // the children share the parent's session rather than each starting R
+  start_R();
+
+  // anything still buffered would otherwise be printed by every child
+  fflush(stdout);
+  fflush(stderr);
+
+  for(int w = 0; w < nworkers; w++) {
+    Worker *worker = &workers[w];
+    worker->start = (int)((long)n * w / nworkers);
+    worker->end = (int)((long)n * (w + 1) / nworkers);
+    worker->pid = -1;
+
+    int fds[2];
+    if(pipe(fds) == 0) {
+      worker->pid = fork();
+      if(worker->pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+      }
+    }
+
+    if(worker->pid == 0) {
+      close(fds[0]);
+      for(int prev = 0; prev < w; prev++) {
+        if(workers[prev].pid > 0) close(workers[prev].fd);
+      }
+      run_worker(captures + worker->start, worker->end - worker->start, fds[1]);
+    }
+
+    if(worker->pid > 0) {
+      close(fds[1]);
+      worker->fd = fds[0];
+    }
+  }
+
+  for(int w = 0; w < nworkers; w++) {
+    Worker *worker = &workers[w];
+    if(worker->pid > 0 && !collect_worker(worker, captures)) {
+      printf("%s Include worker failed, reading its files in-process\n", LOG_WARNING);
+    }
+
+    // a worker that could not be started or failed runs here instead
+    for(int i = worker->start; i < worker->end; i++) {
+      if(captures[i]->content == NULL) {
+        captures[i]->content = finish_capture(captures[i]);
+      }
+    }
+  }
+
+  free(workers);
+}
+
+#endif
+
+// Reads everything prefetch_includes() queued into the memo: the native
+// readers and cache lookups on threads, then the reader calls that need R
+// in -workers forked processes, or in this one.
+void read_includes()
+{
+  int n = queued_count;
+  if(n == 0) {
+    return;
+  }
+
+  int nthreads = builder_cpu_count();
+  if(nthreads > n) nthreads = n;
+  if(nthreads > MAX_INCLUDE_THREADS) nthreads = MAX_INCLUDE_THREADS;
+
+  pthread_t threads[MAX_INCLUDE_THREADS];
+  int started[MAX_INCLUDE_THREADS];
+  LookupWork work[MAX_INCLUDE_THREADS];
+
+  for(int t = 0; t < nthreads; t++) {
+    work[t] = (LookupWork){queued, n, t, nthreads};
+    started[t] = nthreads > 1 && pthread_create(&threads[t], NULL, lookup_worker, &work[t]) == 0;
+    if(!started[t]) {
+      lookup_worker(&work[t]);
+    }
+  }
+
+  for(int t = 0; t < nthreads; t++) {
+    if(started[t]) pthread_join(threads[t], NULL);
+  }
+
+  Capture **missed = malloc(n * sizeof(Capture*));
+  int m = 0;
+  for(int i = 0; i < n; i++) {
+    if(queued[i].content == NULL) {
+      missed[m++] = &queued[i];
+    }
+  }
+
+#ifndef BUILDER_NO_FORK
+  if(include_workers > 1 && m > 1) {
+    run_forked(missed, m);
+  }
+#endif
+
+  for(int i = 0; i < m; i++) {
+    if(missed[i]->content == NULL) {
+      missed[i]->content = finish_capture(missed[i]);
+    }
+  }
+  free(missed);
+
+  for(int i = 0; i < n; i++) {
+    memo_capture(&queued[i]);
+    queued[i].content = NULL;
+  }
+
+  clear_queued();
+}
+
+// Package field of the DESCRIPTION in the build directory
+static char *package_name()
+{
+  FILE *file = fopen("DESCRIPTION", "r");
+  if(file == NULL) {
+    return NULL;
+  }
+
+  char line[1024];
+  char *name = NULL;
+  while(fgets(line, sizeof(line), file) != NULL) {
+    if(strncmp(line, "Package:", 8) != 0) continue;
+
+    char *value = line + 8;
+    while(*value == ' ' || *value == '\t') value++;
+    value[strcspn(value, " \t\r\n")] = '\0';
+    if(*value != '\0') name = strdup(value);
+    break;
+  }
+
+  fclose(file);
+  return name;
+}
+
+static int copy_file(const char *from, const char *to)
+{
+  size_t size = 0;
+  char *content = read_all(from, &size);
+  if(content == NULL) {
+    return 0;
+  }
+
+  int ok = write_file(to, content, size);
+  free(content);
+  return ok;
+}
+
+static int save_object(char *func, char *file, char *dest)
+{
+  char *call = NULL;
+  asprintf(&call, "(%s)('%s')", func, file);
+  SEXP result = evaluate(call);
+  free(call);
+
+  if(result == NULL) {
+    return 0;
+  }
+
+  SEXP sym = install(".builder_include");
+  defineVar(sym, result, R_GlobalEnv);
+
+  char *save = NULL;
+  asprintf(&save, "saveRDS(.builder_include, '%s')", dest);
+  int ok = evaluate(save) != NULL;
+  free(save);
+
+  defineVar(sym, R_NilValue, R_GlobalEnv);
+  return ok;
+}
+
+// Lazy includes serialize the object to inst/builder/<object>-<id>.rds and
+// bind it with delayedAssign(): the package source stays small and the
+// data is only read when the object is first used. The id hashes the
+// source file and the reader call, so objects of the same name included
+// in different files get their own .rds. The .rds is cached next to the
+// literal includes, under the same key with a .rds suffix.
+static char *lazy_include(Registry **registry, Include *inc, char *file)
+{
+  char *base = find_reader(registry, inc->type);
+  if(base == NULL) {
+    printf("%s Could not find reader for include:%s\n", LOG_ERROR, inc->type);
+    return NULL;
+  }
+
+  char *package = package_name();
+  if(package == NULL) {
+    printf("%s Lazy include of %s requires a DESCRIPTION with a Package field\n", LOG_ERROR, inc->path);
+    return NULL;
+  }
+
+  char *call = reader_call(base, inc);
+
+  builder_mkdir("inst", 0755);
+  builder_mkdir(LAZY_DIR, 0755);
+
+  char *id_src = NULL;
+  asprintf(&id_src, "%s\n%s\n%s", file != NULL ? file : "", call, inc->path);
+  unsigned long long id = hash_bytes(id_src, strlen(id_src), HASH_SEED);
+  free(id_src);
+
+  char *rds = NULL;
+  asprintf(&rds, "%s-%016llx.rds", inc->object, id);
+
+  char *dest = NULL;
+  asprintf(&dest, "%s/%s", LAZY_DIR, rds);
+
+  char *cached = NULL;
+  if(include_cache) {
+    char *key = cache_path(call, inc->path);
+    if(key != NULL) {
+      asprintf(&cached, "%s.rds", key);
+      free(key);
+    }
+  }
+
+  int ok = cached != NULL && copy_file(cached, dest);
+  if(!ok) {
+    ok = save_object(call, inc->path, dest);
+    if(ok && cached != NULL) {
+      builder_mkdir(".builder", 0755);
+      builder_mkdir(CACHE_DIR, 0755);
+      copy_file(dest, cached);
+    }
+  }
+
+  char *r = NULL;
+  if(ok) {
+    asprintf(
+      &r, "delayedAssign(\"%s\", readRDS(system.file(\"builder\", \"%s\", package = \"%s\")))",
+      inc->object, rds, package
+    );
+  } else {
+    printf("%s Could not write %s\n", LOG_ERROR, dest);
+  }
+
+  free(cached);
+  free(dest);
+  free(rds);
+  free(package);
+  free(call);
+  return r;
+}
+
 char *include_replace(char *line, Plugins *plugins, char *file, Registry **registry)
 {
   if(!has_include(line)) {
@@ -143,13 +1003,29 @@ char *include_replace(char *line, Plugins *plugins, char *file, Registry **regis
 
   Include inc = parse_include(line);
 
+  if(inc.type == NULL || inc.path == NULL || inc.object == NULL) {
+    printf("%s Invalid include, expected #> include:TYPE path object\n", LOG_ERROR);
+    free_include(&inc);
+    return line;
+  }
+
   char *plugged = plugins_call_include(plugins, inc.type, inc.path, inc.object, file);
   if(plugged != NULL) {
     free_include(&inc);
     return plugged;
   }
 
-  const char *content = capture_path(registry, inc.type, inc.path);
+  if(inc.mode != NULL && strcmp(inc.mode, "lazy") == 0) {
+    char *lazy = lazy_include(registry, &inc, file);
+    free_include(&inc);
+    return lazy != NULL ? lazy : line;
+  }
+
+  if(inc.mode != NULL) {
+    printf("%s Unknown include mode '%s', expected lazy\n", LOG_WARNING, inc.mode);
+  }
+
+  char *content = capture_path(registry, &inc);
 
   if(content == NULL) {
     printf("%s Could not find reader for include:%s\n", LOG_ERROR, inc.type);
@@ -161,7 +1037,7 @@ char *include_replace(char *line, Plugins *plugins, char *file, Registry **regis
   snprintf(r, strlen(content) + strlen(inc.object) + 5, "%s <- %s", inc.object, content);
 
   free_include(&inc);
-  free((void*)content);
+  free(content);
 
   return r;
 }
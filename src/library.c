@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "compat.h"
+#include "library.h"
+#include "hash.h"
+#include "r.h"
+
+// Where installed packages live, found by looking for their DESCRIPTION
+// in .libPaths() rather than loading them. .builder/packages maps each
+// package to its install directory along with the size and mtime of that
+// DESCRIPTION: while those match, the directory is used without asking R;
+// a reinstall or upgrade rewrites DESCRIPTION and invalidates the entry.
+
+#define PACKAGE_CACHE ".builder/packages"
+
+typedef struct {
+  char *dir;
+  long long size;
+  long long mtime;
+} PackageDir;
+
+static HashMap *package_dirs = NULL;
+static int package_cache = 1;
+
+void set_package_cache(int enabled)
+{
+  package_cache = enabled;
+}
+
+static void free_package_dir(void *value)
+{
+  PackageDir *entry = value;
+  free(entry->dir);
+  free(entry);
+}
+
+static void set_package_dir(const char *name, const char *dir, long long size, long long mtime)
+{
+  PackageDir *entry = hashmap_get(package_dirs, name);
+  if(entry != NULL) {
+    free(entry->dir);
+  } else {
+    entry = malloc(sizeof(PackageDir));
+    hashmap_set(package_dirs, name, entry);
+  }
+
+  entry->dir = strdup(dir);
+  entry->size = size;
+  entry->mtime = mtime;
+}
+
+static int stat_description(const char *dir, long long *size, long long *mtime)
+{
+  char *path = NULL;
+  asprintf(&path, "%s/DESCRIPTION", dir);
+
+  struct stat st;
+  int ok = stat(path, &st) == 0;
+  free(path);
+
+  if(!ok) {
+    return 0;
+  }
+
+  *size = (long long)st.st_size;
+  *mtime = (long long)st.st_mtime;
+  return 1;
+}
+
+// one "name<TAB>size<TAB>mtime<TAB>dir" line per package
+static void load_package_cache()
+{
+  package_dirs = hashmap_create(64);
+  if(!package_cache) {
+    return;
+  }
+
+  FILE *file = fopen(PACKAGE_CACHE, "r");
+  if(file == NULL) {
+    return;
+  }
+
+  char line[4096];
+  while(fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+
+    char *name = strtok(line, "\t");
+    char *size = strtok(NULL, "\t");
+    char *mtime = strtok(NULL, "\t");
+    char *dir = strtok(NULL, "");
+    if(name == NULL || size == NULL || mtime == NULL || dir == NULL) continue;
+
+    set_package_dir(name, dir, atoll(size), atoll(mtime));
+  }
+
+  fclose(file);
+}
+
+static void save_package_cache()
+{
+  if(!package_cache) {
+    return;
+  }
+
+  builder_mkdir(".builder", 0755);
+
+  FILE *file = fopen(PACKAGE_CACHE, "w");
+  if(file == NULL) {
+    return;
+  }
+
+  for(int i = 0; i < package_dirs->capacity; i++) {
+    for(HashEntry *e = package_dirs->buckets[i]; e != NULL; e = e->next) {
+      PackageDir *entry = e->value;
+      fprintf(file, "%s\t%lld\t%lld\t%s\n", e->key, entry->size, entry->mtime, entry->dir);
+    }
+  }
+
+  fclose(file);
+}
+
+// .libPaths() worked out once per session. R builds it from R_LIBS,
+// R_LIBS_USER and R_LIBS_SITE, then its own library, keeping the
+// directories that exist; R exports the user library to the processes it
+// starts, so builder run from R reads it all from the environment. R is
+// only started when R_HOME or R_LIBS_USER is not set, since the default
+// user library depends on R's platform and version.
+static char **libraries = NULL;
+static int library_count = -1;
+
+#ifdef _WIN32
+#define PATH_SEP ";"
+#else
+#define PATH_SEP ":"
+#endif
+
+static void push_library(const char *dir, int *capacity)
+{
+  char *path = NULL;
+  const char *home = getenv("HOME");
+  if(dir[0] == '~' && (dir[1] == '/' || dir[1] == '\0') && home != NULL) {
+    asprintf(&path, "%s%s", home, dir + 1);
+  } else {
+    path = strdup(dir);
+  }
+
+  size_t len = strlen(path);
+  while(len > 1 && path[len - 1] == '/') path[--len] = '\0';
+
+  int seen = !builder_is_dir(path);
+  for(int i = 0; !seen && i < library_count; i++) {
+    seen = strcmp(libraries[i], path) == 0;
+  }
+
+  if(seen) {
+    free(path);
+    return;
+  }
+
+  if(library_count == *capacity) {
+    *capacity = *capacity > 0 ? *capacity * 2 : 8;
+    libraries = realloc(libraries, *capacity * sizeof(char*));
+  }
+  libraries[library_count++] = path;
+}
+
+static void push_libraries(const char *var, int *capacity)
+{
+  const char *value = getenv(var);
+  if(value == NULL) {
+    return;
+  }
+
+  char *work = strdup(value);
+  char *saveptr;
+  for(char *dir = strtok_r(work, PATH_SEP, &saveptr); dir != NULL; dir = strtok_r(NULL, PATH_SEP, &saveptr)) {
+    push_library(dir, capacity);
+  }
+  free(work);
+}
+
+static int environment_paths()
+{
+  const char *home = getenv("R_HOME");
+  if(home == NULL || getenv("R_LIBS_USER") == NULL) {
+    return 0;
+  }
+
+  int capacity = 0;
+  library_count = 0;
+
+  push_libraries("R_LIBS", &capacity);
+  push_libraries("R_LIBS_USER", &capacity);
+
+  char *dir = NULL;
+  if(getenv("R_LIBS_SITE") != NULL) {
+    push_libraries("R_LIBS_SITE", &capacity);
+  } else {
+    asprintf(&dir, "%s/site-library", home);
+    push_library(dir, &capacity);
+    free(dir);
+  }
+
+  asprintf(&dir, "%s/library", home);
+  push_library(dir, &capacity);
+  free(dir);
+
+  return 1;
+}
+
+static void r_paths()
+{
+  start_R();
+  library_count = 0;
+
+  SEXP call = PROTECT(lang1(install(".libPaths")));
+  int error = 0;
+  SEXP result = R_tryEvalSilent(call, R_GlobalEnv, &error);
+  UNPROTECT(1);
+
+  if(!error && result != NULL && TYPEOF(result) == STRSXP) {
+    PROTECT(result);
+    library_count = (int)XLENGTH(result);
+    libraries = malloc(library_count * sizeof(char*));
+    for(int i = 0; i < library_count; i++) {
+      libraries[i] = strdup(CHAR(STRING_ELT(result, i)));
+    }
+    UNPROTECT(1);
+  }
+}
+
+int library_paths(char ***paths)
+{
+  if(library_count < 0 && !environment_paths()) {
+    r_paths();
+  }
+
+  *paths = libraries;
+  return library_count;
+}
+
+// the first library holding the package wins, as with library()
+static char *find_package(const char *name)
+{
+  char **paths = NULL;
+  int count = library_paths(&paths);
+
+  for(int i = 0; i < count; i++) {
+    char *dir = NULL;
+    asprintf(&dir, "%s/%s", paths[i], name);
+
+    long long size, mtime;
+    if(stat_description(dir, &size, &mtime)) {
+      return dir;
+    }
+    free(dir);
+  }
+
+  return NULL;
+}
+
+char *package_dir(const char *name)
+{
+  if(package_dirs == NULL) {
+    load_package_cache();
+  }
+
+  long long size = 0, mtime = 0;
+
+  PackageDir *cached = hashmap_get(package_dirs, name);
+  if(cached != NULL && stat_description(cached->dir, &size, &mtime) && size == cached->size && mtime == cached->mtime) {
+    return strdup(cached->dir);
+  }
+
+  char *dir = find_package(name);
+  if(dir == NULL) {
+    return NULL;
+  }
+
+  if(stat_description(dir, &size, &mtime)) {
+    set_package_dir(name, dir, size, mtime);
+    save_package_cache();
+  }
+
+  return dir;
+}
+
+void clear_package_cache()
+{
+  hashmap_free(package_dirs, free_package_dir);
+  package_dirs = NULL;
+
+  for(int i = 0; i < library_count; i++) {
+    free(libraries[i]);
+  }
+  free(libraries);
+  libraries = NULL;
+  library_count = -1;
+}
+
+// the Version: field of an installed package's DESCRIPTION, NULL when the
+// package is not installed; reads files only, so it is safe off the main
+// thread once library_paths() has been called
+char *package_version(const char *name)
+{
+  for(int i = 0; i < library_count; i++) {
+    char *path = NULL;
+    asprintf(&path, "%s/%s/DESCRIPTION", libraries[i], name);
+    FILE *file = fopen(path, "r");
+    free(path);
+
+    if(file == NULL) {
+      continue;
+    }
+
+    char *version = NULL;
+    char line[1024];
+    while(version == NULL && fgets(line, sizeof(line), file) != NULL) {
+      if(strncmp(line, "Version:", 8) != 0) continue;
+
+      char *start = line + 8;
+      while(*start == ' ' || *start == '\t') start++;
+      start[strcspn(start, " \t\r\n")] = '\0';
+      version = strdup(start);
+    }
+
+    fclose(file);
+    return version != NULL ? version : strdup("");
+  }
+
+  return NULL;
+}
+
+// package_version() ordering: components separated by . or -, compared
+// as numbers when both are and as text otherwise; a missing component
+// sorts first
+int compare_versions(const char *a, const char *b)
+{
+  while(*a || *b) {
+    if(*a == '\0') return -1;
+    if(*b == '\0') return 1;
+
+    size_t la = strcspn(a, ".-");
+    size_t lb = strcspn(b, ".-");
+
+    int cmp;
+    if(la > 0 && lb > 0 && strspn(a, "0123456789") == la && strspn(b, "0123456789") == lb) {
+      long x = strtol(a, NULL, 10);
+      long y = strtol(b, NULL, 10);
+      cmp = (x > y) - (x < y);
+    } else {
+      cmp = strncmp(a, b, la < lb ? la : lb);
+      if(cmp == 0) cmp = (la > lb) - (la < lb);
+    }
+
+    if(cmp != 0) return cmp < 0 ? -1 : 1;
+
+    a += la;
+    b += lb;
+    if(*a) a++;
+    if(*b) b++;
+  }
+
+  return 0;
+}
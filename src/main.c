@@ -4,13 +4,17 @@
 
 #include "include.h"
 #include "depends.h"
+#include "deadcode.h"
+#include "sourcemap.h"
 #include "define.h"
 #include "parser.h"
 #include "plugins.h"
 #include "config.h"
 #include "create.h"
+#include "precompile.h"
 #include "watch.h"
 #include "file.h"
+#include "library.h"
 #include "log.h"
 #include "r.h"
 
@@ -20,6 +24,8 @@ static int build(BuildContext *ctx)
 {
   Define *defines = create_define();
   get_definitions(defines, ctx->argc, ctx->argv);
+  clear_if_cache();
+  clear_include_memo();
 
   if (ctx->must_clean) {
     printf("%s Cleaning: %s and testthat/\n", LOG_INFO, ctx->output);
@@ -58,6 +64,7 @@ static int build(BuildContext *ctx)
     .append = ctx->append,
     .sourcemap = ctx->sourcemap,
     .deadcode = ctx->deadcode,
+    .treeshake = ctx->treeshake,
     .registry = &ctx->registry
   };
 
@@ -96,6 +103,16 @@ int main(int argc, char *argv[])
     return 0;
   }
 
+  Value *headers = get_arg_values(argc, argv, "-precompile");
+  if (headers != NULL) {
+    int failed = 0;
+    for (Value *current = headers; current != NULL; current = current->next) {
+      failed |= precompile_header(current->name);
+    }
+    free_value(headers);
+    return failed;
+  }
+
 
   if (has_arg(argc, argv, "-help") || has_arg(argc, argv, "--help")) {
     printf("builder - R package preprocessor with macro support\n\n");
@@ -110,7 +127,14 @@ int main(int argc, char *argv[])
     printf("Build Options:\n");
     printf("  -watch                  Watch input directory and rebuild on changes\n");
     printf("  -deadcode               Enable dead variable/function detection\n");
-    printf("  -sourcemap              Enable source map generation\n");
+    printf("  -symbols <file>         Write the dead code symbol index as JSON\n");
+    printf("  -treeshake              Drop functions unreachable from the package's exports\n");
+    printf("  -keep <name> ...        Keep these functions when tree shaking\n");
+    printf("  -sourcemap [lines]      Enable source map comments, or #line directives with lines\n");
+    printf("  -nocache                Ignore the .builder/ cache for #> include, pure plugins, packages and -deadcode\n");
+    printf("  -compress <bytes>       Compress #> include literals above this size, 0 to disable\n");
+    printf("  -stream                 Read and write one source file at a time to bound memory use\n");
+    printf("  -workers <n>            Run pure R plugins and #> include readers in n forked workers\n");
     printf("\n");
 
     printf("Preprocessing:\n");
@@ -132,6 +156,7 @@ int main(int argc, char *argv[])
     printf("Project Setup:\n");
     printf("  -init                   Create a builder.ini config file\n");
     printf("  -create <name>          Create a new package skeleton\n");
+    printf("  -precompile <file> ...  Write .rhc precompiled headers, e.g., -precompile inst/macros.rh\n");
     printf("\n");
 
     printf("Info:\n");
@@ -147,11 +172,6 @@ int main(int argc, char *argv[])
     return 0;
   }
 
-  set_R_home();
-
-  char *r_argv[] = {"R", "--silent", "--no-save"};
-  Rf_initEmbeddedR(3, r_argv);
-
   Registry *registry = initialize_registry();
 
   BuildContext *cfg = NULL;
@@ -275,11 +295,73 @@ int main(int argc, char *argv[])
     deadcode = cfg->deadcode;
   }
 
-  int sourcemap = has_arg(argc, argv, "-sourcemap");
-  if (!sourcemap && cfg != NULL) {
+  int treeshake = has_arg(argc, argv, "-treeshake");
+  if (!treeshake && cfg != NULL) {
+    treeshake = cfg->treeshake;
+  }
+
+  Value *keep = get_arg_values(argc, argv, "-keep");
+  if (keep == NULL && cfg != NULL && cfg->keep != NULL) {
+    Value *current = cfg->keep;
+    while (current != NULL) {
+      keep = push_value(keep, strdup(current->name));
+      current = current->next;
+    }
+  }
+  set_deadcode_keep(keep);
+  free_value(keep);
+
+  int sourcemap = 0;
+  if (has_arg(argc, argv, "-sourcemap")) {
+    char *mode = get_arg_value(argc, argv, "-sourcemap");
+    sourcemap = mode != NULL && strcmp(mode, "lines") == 0 ? SOURCEMAP_LINES : SOURCEMAP_COMMENTS;
+    free(mode);
+  } else if (cfg != NULL) {
     sourcemap = cfg->sourcemap;
   }
 
+  int cache = 1;
+  if (has_arg(argc, argv, "-nocache")) {
+    cache = 0;
+  } else if (cfg != NULL) {
+    cache = cfg->cache;
+  }
+  set_include_cache(cache);
+  set_plugin_cache(cache);
+  set_deadcode_cache(cache);
+  set_package_cache(cache);
+
+  char *symbols = get_arg_value(argc, argv, "-symbols");
+  if (symbols == NULL && cfg != NULL && cfg->symbols != NULL) {
+    symbols = strdup(cfg->symbols);
+  }
+  set_deadcode_symbols(symbols);
+  free(symbols);
+
+  char *compress = get_arg_value(argc, argv, "-compress");
+  if (compress != NULL) {
+    set_include_compress(atol(compress));
+    free(compress);
+  } else if (cfg != NULL && cfg->compress >= 0) {
+    set_include_compress(cfg->compress);
+  }
+
+  char *workers = get_arg_value(argc, argv, "-workers");
+  if (workers != NULL) {
+    set_plugin_workers(atoi(workers));
+    set_include_workers(atoi(workers));
+    free(workers);
+  } else if (cfg != NULL) {
+    set_plugin_workers(cfg->workers);
+    set_include_workers(cfg->workers);
+  }
+
+  int stream = has_arg(argc, argv, "-stream");
+  if (!stream && cfg != NULL) {
+    stream = cfg->stream;
+  }
+  set_stream_build(stream);
+
   int must_clean = 1;
   if (has_arg(argc, argv, "-noclean")) {
     must_clean = 0;
@@ -311,8 +393,11 @@ int main(int argc, char *argv[])
     .plugins_str = NULL,
     .prepend = prepend,
     .append = append,
+    .cache = cache,
     .deadcode = deadcode,
+    .treeshake = treeshake,
     .sourcemap = sourcemap,
+    .stream = stream,
     .must_clean = must_clean,
     .watch = watch_mode,
     .plugins = plugins,
@@ -354,8 +439,11 @@ int main(int argc, char *argv[])
   free_value(depends);
   free(input);
   free(output);
+  clear_if_cache();
+  clear_include_memo();
+  clear_import_cache();
 
-  Rf_endEmbeddedR(0);
+  end_R();
 
   return result;
 }
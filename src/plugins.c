@@ -1,12 +1,237 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
 
+#include "compat.h"
 #include "plugins.h"
+#include "library.h"
+#include "hash.h"
 #include "log.h"
 #include "r.h"
 
-static Plugins *create_plugins(char *name, int setup, SEXP obj)
+#ifndef BUILDER_NO_FORK
+#include <sys/wait.h>
+#endif
+
+#define NATIVE_PREFIX "native:"
+#define PLUGIN_CACHE_DIR ".builder/plugins"
+#define PLUGIN_CACHE_VERSION 1
+#define MAX_NATIVE_THREADS 32
+
+static const char *HOOKS[PLUGIN_HOOKS] = {
+  "preprocess", "postprocess", "include", "end",
+  "preprocess_all", "postprocess_all"
+};
+
+// a method the plugin does not define is left NULL and never called
+static void resolve_hooks(Plugins *plugin)
+{
+  for(int i = 0; i < PLUGIN_HOOKS; i++) {
+    plugin->hooks[i] = NULL;
+    if(!plugin->setup || plugin->native != NULL) {
+      continue;
+    }
+
+    int error = 0;
+    SEXP call = PROTECT(lang3(install("$"), plugin->obj, install(HOOKS[i])));
+    SEXP func = R_tryEvalSilent(call, R_GlobalEnv, &error);
+    UNPROTECT(1);
+
+    if(error || func == NULL || !isFunction(func)) {
+      continue;
+    }
+
+    R_PreserveObject(func);
+    plugin->hooks[i] = func;
+  }
+}
+
+static SEXP find_hook(Plugins *plugin, const char *fn)
+{
+  for(int i = 0; i < PLUGIN_HOOKS; i++) {
+    if(strcmp(HOOKS[i], fn) == 0) {
+      return plugin->hooks[i];
+    }
+  }
+  return NULL;
+}
+
+static builder_transform_fn native_transform(NativePlugin *native, const char *fn)
+{
+  if(strcmp(fn, "preprocess") == 0) return native->preprocess;
+  if(strcmp(fn, "postprocess") == 0) return native->postprocess;
+  return NULL;
+}
+
+// Results of pure plugins are kept in .builder/plugins, keyed by the
+// plugin, its version, the hook, the file and a hash of the input text.
+// Each entry is 'T' followed by the resulting text, or 'N' for no text.
+
+static int plugin_cache = 1;
+
+void set_plugin_cache(int enabled)
+{
+  plugin_cache = enabled;
+}
+
+static int plugin_workers = 0;
+
+void set_plugin_workers(int workers)
+{
+  plugin_workers = workers;
+}
+
+static char *result_path(Plugins *plugin, const char *fn, const char *text, const char *file)
+{
+  if(!plugin_cache || !plugin->pure) {
+    return NULL;
+  }
+
+  if(strcmp(fn, "preprocess") != 0 && strcmp(fn, "postprocess") != 0) {
+    return NULL;
+  }
+
+  // nothing to remember for a hook the plugin does not have
+  if(plugin->native != NULL) {
+    if(native_transform(plugin->native, fn) == NULL) {
+      return NULL;
+    }
+  } else {
+    char batched[32];
+    snprintf(batched, sizeof(batched), "%s_all", fn);
+    if(find_hook(plugin, fn) == NULL && find_hook(plugin, batched) == NULL) {
+      return NULL;
+    }
+  }
+
+  unsigned long long input = text != NULL ? hash_bytes(text, strlen(text), HASH_SEED) : 0;
+
+  char *key_src = NULL;
+  asprintf(
+    &key_src, "%d\n%s\n%s\n%s\n%s\n%d%016llx", PLUGIN_CACHE_VERSION,
+    plugin->name, plugin->version, fn, file != NULL ? file : "", text != NULL, input
+  );
+  unsigned long long key = hash_bytes(key_src, strlen(key_src), HASH_SEED);
+  free(key_src);
+
+  char *path = NULL;
+  asprintf(&path, "%s/%016llx", PLUGIN_CACHE_DIR, key);
+  return path;
+}
+
+static int load_result(const char *path, char **text)
+{
+  FILE *file = fopen(path, "rb");
+  if(file == NULL) {
+    return 0;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *data = malloc(size + 1);
+  int ok = size > 0 && fread(data, 1, size, file) == (size_t)size && (data[0] == 'T' || data[0] == 'N');
+  fclose(file);
+
+  if(!ok) {
+    free(data);
+    return 0;
+  }
+
+  data[size] = '\0';
+  free(*text);
+
+  if(data[0] == 'N') {
+    *text = NULL;
+    free(data);
+    return 1;
+  }
+
+  memmove(data, data + 1, size);
+  *text = data;
+  return 1;
+}
+
+static void store_result(const char *path, const char *text)
+{
+  builder_mkdir(".builder", 0755);
+  builder_mkdir(PLUGIN_CACHE_DIR, 0755);
+
+  char *tmp = NULL;
+  asprintf(&tmp, "%s.tmp", path);
+
+  FILE *file = fopen(tmp, "wb");
+  if(file == NULL) {
+    free(tmp);
+    return;
+  }
+
+  fputc(text != NULL ? 'T' : 'N', file);
+  if(text != NULL) {
+    fputs(text, file);
+  }
+
+  if(fclose(file) != 0 || rename(tmp, path) != 0) {
+    remove(tmp);
+  }
+  free(tmp);
+}
+
+// a plugin is pure when its preprocess and postprocess results depend on
+// nothing but their arguments: R plugins say so with `pure = TRUE`, native
+// ones by exporting builder_pure(). The version is the installed package's
+// for R plugins and the shared object's size and mtime for native ones.
+static void resolve_purity(Plugins *plugin)
+{
+  plugin->pure = 0;
+  plugin->version = NULL;
+
+  if(!plugin->setup) {
+    return;
+  }
+
+  if(plugin->native != NULL) {
+    builder_pure_fn pure = (builder_pure_fn)builder_dlsym(plugin->native->handle, "builder_pure");
+    struct stat st;
+    if(pure == NULL || !pure() || stat(plugin->name + strlen(NATIVE_PREFIX), &st) != 0) {
+      return;
+    }
+    asprintf(&plugin->version, "%lld-%lld", (long long)st.st_size, (long long)st.st_mtime);
+    plugin->pure = 1;
+    return;
+  }
+
+  int error = 0;
+  SEXP call = PROTECT(lang3(install("$"), plugin->obj, install("pure")));
+  SEXP pure = R_tryEvalSilent(call, R_GlobalEnv, &error);
+  UNPROTECT(1);
+
+  if(error || pure == NULL || TYPEOF(pure) != LGLSXP || XLENGTH(pure) != 1 || LOGICAL(pure)[0] != TRUE) {
+    return;
+  }
+
+  char *sep = strstr(plugin->name, "::");
+  if(sep == NULL) {
+    return;
+  }
+
+  char *pkg = malloc(sep - plugin->name + 1);
+  memcpy(pkg, plugin->name, sep - plugin->name);
+  pkg[sep - plugin->name] = '\0';
+
+  char **paths = NULL;
+  library_paths(&paths);
+  plugin->version = package_version(pkg);
+  free(pkg);
+
+  plugin->pure = plugin->version != NULL;
+}
+
+static Plugins *create_plugins(char *name, int setup, SEXP obj, NativePlugin *native)
 {
   Plugins *plugins = malloc(sizeof(Plugins));
   if(plugins == NULL) {
@@ -17,18 +242,21 @@ static Plugins *create_plugins(char *name, int setup, SEXP obj)
   plugins->name = strdup(name);
   plugins->setup = setup;
   plugins->obj = obj;
+  plugins->native = native;
   plugins->next = NULL;
+  resolve_hooks(plugins);
+  resolve_purity(plugins);
 
   return plugins;
 }
 
-static Plugins *push_plugins(Plugins *head, char *name, int setup, SEXP obj)
+static Plugins *push_plugins(Plugins *head, char *name, int setup, SEXP obj, NativePlugin *native)
 {
   if(head == NULL) {
-    return create_plugins(name, setup, obj);
+    return create_plugins(name, setup, obj, native);
   }
 
-  Plugins *new = create_plugins(name, setup, obj);
+  Plugins *new = create_plugins(name, setup, obj, native);
   if(new == NULL) {
     return NULL;
   }
@@ -42,12 +270,58 @@ static Plugins *push_plugins(Plugins *head, char *name, int setup, SEXP obj)
   return head;
 }
 
+// native:path plugins are shared objects implementing builder_plugin.h,
+// they never enter R
+static Plugins *load_native(Plugins *head, char *name, char *input, char *output)
+{
+  char *path = name + strlen(NATIVE_PREFIX);
+
+  void *handle = builder_dlopen(path);
+  if(handle == NULL) {
+    printf("%s Failed to load plugin %s: %s\n", LOG_ERROR, path, builder_dlerror());
+    return push_plugins(head, name, 0, NULL, NULL);
+  }
+
+  builder_abi_fn abi = (builder_abi_fn)builder_dlsym(handle, "builder_plugin_abi");
+  if(abi == NULL || abi() != BUILDER_PLUGIN_ABI) {
+    printf("%s Plugin %s does not implement builder plugin ABI %d\n", LOG_ERROR, path, BUILDER_PLUGIN_ABI);
+    builder_dlclose(handle);
+    return push_plugins(head, name, 0, NULL, NULL);
+  }
+
+  NativePlugin *native = malloc(sizeof(NativePlugin));
+  native->handle = handle;
+  native->setup = (builder_setup_fn)builder_dlsym(handle, "builder_setup");
+  native->preprocess = (builder_transform_fn)builder_dlsym(handle, "builder_preprocess");
+  native->postprocess = (builder_transform_fn)builder_dlsym(handle, "builder_postprocess");
+  native->include = (builder_include_fn)builder_dlsym(handle, "builder_include");
+  native->end = (builder_end_fn)builder_dlsym(handle, "builder_end");
+
+  if(native->setup != NULL && native->setup(input, output) != 0) {
+    printf("%s Failed to initialize plugin: %s\n", LOG_ERROR, name);
+    builder_dlclose(handle);
+    free(native);
+    return push_plugins(head, name, 0, NULL, NULL);
+  }
+
+  printf("%s Initialized plugin: %s\n", LOG_INFO, name);
+  return push_plugins(head, name, 1, NULL, native);
+}
+
 Plugins *plugins_init(Value *plugins, char *input, char *output)
 {
   Plugins *head = NULL;
 
   Value *current = plugins;
   while(current != NULL) {
+    if(strncmp(current->name, NATIVE_PREFIX, strlen(NATIVE_PREFIX)) == 0) {
+      head = load_native(head, current->name, input, output);
+      current = current->next;
+      continue;
+    }
+
+    start_R();
+
     char *copy = strdup(current->name);
 
     char *pkg = strtok(copy, ":");
@@ -66,7 +340,7 @@ Plugins *plugins_init(Value *plugins, char *input, char *output)
 
     if(result == NULL) {
       printf("%s Failed to initialize plugin: %s\n", LOG_ERROR, current->name);
-      head = push_plugins(head, current->name, 0, R_NilValue);
+      head = push_plugins(head, current->name, 0, R_NilValue, NULL);
       current = current->next;
       continue;
     }
@@ -85,12 +359,12 @@ Plugins *plugins_init(Value *plugins, char *input, char *output)
 
     if(result == NULL) {
       printf("%s Failed to initialize plugin: %s\n", LOG_ERROR, current->name);
-      head = push_plugins(head, current->name, 0, R_NilValue);
+      head = push_plugins(head, current->name, 0, R_NilValue, NULL);
       current = current->next;
       continue;
     }
 
-    head = push_plugins(head, current->name, 1, obj);
+    head = push_plugins(head, current->name, 1, obj, NULL);
 
     printf("%s Initialized plugin: %s\n", LOG_INFO, current->name);
 
@@ -112,14 +386,370 @@ int plugins_failed(Plugins *head)
   return 0;
 }
 
+static int run_transform(builder_transform_fn transform, char **text, char *file)
+{
+  char *out = NULL;
+  size_t out_len = 0;
+
+  int status = transform(*text, *text != NULL ? strlen(*text) : 0, file, &out, &out_len);
+  if(status < 0) {
+    free(out);
+    return 0;
+  }
+
+  if(status == 1 && out != NULL) {
+    out = realloc(out, out_len + 1);
+    out[out_len] = '\0';
+    free(*text);
+    *text = out;
+  }
+
+  return 1;
+}
+
+// Text travelling along the plugin chain. R plugins hand each other the
+// STRSXP the previous one returned, so a file is only copied out of R
+// when a native plugin or the result cache needs a C string, and once at
+// the end. Hooks declaring an `ast` argument get the parsed text, made on
+// first request and kept until a plugin changes the text.
+typedef struct {
+  char *text;
+  SEXP value;
+  SEXP ast;
+} Content;
+
+static void drop_ast(Content *content)
+{
+  if(content->ast != NULL) {
+    R_ReleaseObject(content->ast);
+    content->ast = NULL;
+  }
+}
+
+static void drop_value(Content *content)
+{
+  drop_ast(content);
+  if(content->value != NULL) {
+    R_ReleaseObject(content->value);
+    content->value = NULL;
+  }
+}
+
+static const char *content_chars(Content *content)
+{
+  if(content->value != NULL) {
+    return CHAR(STRING_ELT(content->value, 0));
+  }
+  return content->text;
+}
+
+static void set_text(Content *content, char *text)
+{
+  drop_value(content);
+  free(content->text);
+  content->text = text;
+}
+
+// value must be protected by the caller
+static void set_value(Content *content, SEXP value)
+{
+  if(content->value == value) {
+    return;
+  }
+
+  // a plugin returning the string it was given leaves the parse valid
+  int same = content->value != NULL && STRING_ELT(content->value, 0) == STRING_ELT(value, 0);
+  SEXP ast = same ? content->ast : NULL;
+  content->ast = NULL;
+
+  drop_value(content);
+  R_PreserveObject(value);
+  content->value = value;
+  content->ast = ast;
+
+  free(content->text);
+  content->text = NULL;
+}
+
+// the text as a character vector of length one, NULL when there is none
+static SEXP content_value(Content *content)
+{
+  if(content->value == NULL && content->text != NULL) {
+    SEXP value = PROTECT(mkString(content->text));
+    set_value(content, value);
+    UNPROTECT(1);
+  }
+  return content->value;
+}
+
+// the parsed text, NULL when it does not parse
+static SEXP content_ast(Content *content)
+{
+  if(content->ast != NULL) {
+    return content->ast;
+  }
+
+  SEXP value = content_value(content);
+  if(value == NULL) {
+    return R_NilValue;
+  }
+
+  ParseStatus status;
+  SEXP parsed = PROTECT(R_ParseVector(value, -1, &status, R_NilValue));
+  content->ast = status == PARSE_OK ? parsed : R_NilValue;
+  R_PreserveObject(content->ast);
+  UNPROTECT(1);
+
+  return content->ast;
+}
+
+// hands the text over as a C string, leaving the content empty
+static char *content_take(Content *content)
+{
+  char *text = content->text;
+  if(content->value != NULL) {
+    text = strdup(CHAR(STRING_ELT(content->value, 0)));
+  }
+
+  content->text = NULL;
+  drop_value(content);
+  return text;
+}
+
+static int load_content(const char *path, Content *content)
+{
+  char *text = NULL;
+  if(!load_result(path, &text)) {
+    return 0;
+  }
+
+  set_text(content, text);
+  return 1;
+}
+
+static int call_native(Plugins *plugin, char *fn, Content *content, char *file)
+{
+  if(strcmp(fn, "end") == 0) {
+    if(plugin->native->end != NULL) plugin->native->end();
+    return 1;
+  }
+
+  builder_transform_fn transform = native_transform(plugin->native, fn);
+  if(transform == NULL) {
+    return 1;
+  }
+
+  char *text = content_take(content);
+  int ok = run_transform(transform, &text, file);
+  set_text(content, text);
+
+  if(!ok) {
+    printf("%s Failed to call plugin: %s => %s()\n", LOG_ERROR, plugin->name, fn);
+    return 0;
+  }
+
+  return 1;
+}
+
+typedef struct {
+  builder_transform_fn transform;
+  char **contents;
+  char **files;
+  int *failed;
+  int n;
+  int start;
+  int step;
+} NativeWork;
+
+static void *native_worker(void *data)
+{
+  NativeWork *work = data;
+  for(int i = work->start; i < work->n; i += work->step) {
+    work->failed[i] = !run_transform(work->transform, &work->contents[i], work->files[i]);
+  }
+  return NULL;
+}
+
+// a native hook over every file, spread across worker threads
+static int call_native_all(Plugins *plugin, char *fn, builder_transform_fn transform, Content *contents, char **files, int n)
+{
+  if(n == 0) {
+    return 1;
+  }
+
+  int nthreads = builder_cpu_count();
+  if(nthreads > n) nthreads = n;
+  if(nthreads > MAX_NATIVE_THREADS) nthreads = MAX_NATIVE_THREADS;
+
+  // worker threads must not touch R, so every text is a C string first
+  char **texts = malloc(n * sizeof(char*));
+  for(int i = 0; i < n; i++) {
+    texts[i] = content_take(&contents[i]);
+  }
+
+  int *failed = calloc(n, sizeof(int));
+  pthread_t threads[MAX_NATIVE_THREADS];
+  int started[MAX_NATIVE_THREADS];
+  NativeWork work[MAX_NATIVE_THREADS];
+
+  for(int t = 0; t < nthreads; t++) {
+    work[t] = (NativeWork){transform, texts, files, failed, n, t, nthreads};
+    started[t] = nthreads > 1 && pthread_create(&threads[t], NULL, native_worker, &work[t]) == 0;
+    if(!started[t]) {
+      native_worker(&work[t]);
+    }
+  }
+
+  for(int t = 0; t < nthreads; t++) {
+    if(started[t]) pthread_join(threads[t], NULL);
+  }
+
+  int ok = 1;
+  for(int i = 0; i < n; i++) {
+    set_text(&contents[i], texts[i]);
+    if(failed[i]) {
+      printf("%s Failed to call plugin: %s => %s() on %s\n", LOG_ERROR, plugin->name, fn, files[i]);
+      ok = 0;
+    }
+  }
+
+  free(texts);
+  free(failed);
+  return ok;
+}
+
+static int wants_ast(SEXP func)
+{
+  if(TYPEOF(func) != CLOSXP) {
+    return 0;
+  }
+
+  SEXP sym = install("ast");
+  for(SEXP formal = FORMALS(func); formal != R_NilValue; formal = CDR(formal)) {
+    if(TAG(formal) == sym) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// appends `ast = value` to a protected call
+static void append_ast(SEXP call, SEXP value)
+{
+  SEXP last = call;
+  while(CDR(last) != R_NilValue) {
+    last = CDR(last);
+  }
+
+  SETCDR(last, CONS(value, R_NilValue));
+  SET_TAG(CDR(last), install("ast"));
+}
+
+// one call of a per-file hook, the text is replaced by a string result
+static int call_hook(Plugins *plugin, SEXP func, char *fn, Content *content, SEXP file)
+{
+  SEXP value = content_value(content);
+
+  SEXP call = R_NilValue;
+  if(value != NULL && file != R_NilValue) {
+    call = lang3(func, value, file);
+  } else if(value != NULL) {
+    call = lang2(func, value);
+  } else {
+    call = lang1(func);
+  }
+  PROTECT(call);
+
+  if(value != NULL && wants_ast(func)) {
+    append_ast(call, content_ast(content));
+  }
+
+  int errorOccurred = 0;
+  SEXP result = R_tryEvalSilent(call, R_GlobalEnv, &errorOccurred);
+  UNPROTECT(1);
+
+  if(result == NULL || errorOccurred) {
+    printf("%s Failed to call plugin: %s => %s()\n", LOG_ERROR, plugin->name, fn);
+    return 0;
+  }
+
+  if(TYPEOF(result) == STRSXP && XLENGTH(result) > 0) {
+    PROTECT(result);
+    if(XLENGTH(result) > 1) {
+      result = ScalarString(STRING_ELT(result, 0));
+    }
+    PROTECT(result);
+    set_value(content, result);
+    UNPROTECT(2);
+  }
+
+  return 1;
+}
+
+// one call of a batched hook: a character vector of contents (NA for
+// none) and one of files in, one string per file (NA to keep it) out
+static int call_hook_all(Plugins *plugin, SEXP func, char *fn, Content *contents, char **files, int n)
+{
+  SEXP strs = PROTECT(allocVector(STRSXP, n));
+  SEXP paths = PROTECT(allocVector(STRSXP, n));
+  for(int i = 0; i < n; i++) {
+    SEXP value = content_value(&contents[i]);
+    SET_STRING_ELT(strs, i, value != NULL ? STRING_ELT(value, 0) : NA_STRING);
+    SET_STRING_ELT(paths, i, mkChar(files[i]));
+  }
+
+  SEXP call = PROTECT(lang3(func, strs, paths));
+  if(wants_ast(func)) {
+    SEXP asts = PROTECT(allocVector(VECSXP, n));
+    for(int i = 0; i < n; i++) {
+      SET_VECTOR_ELT(asts, i, content_ast(&contents[i]));
+    }
+    append_ast(call, asts);
+    UNPROTECT(1);
+  }
+
+  int errorOccurred = 0;
+  SEXP result = R_tryEvalSilent(call, R_GlobalEnv, &errorOccurred);
+  UNPROTECT(3);
+
+  if(result == NULL || errorOccurred) {
+    printf("%s Failed to call plugin: %s => %s()\n", LOG_ERROR, plugin->name, fn);
+    return 0;
+  }
+
+  if(result == R_NilValue) {
+    return 1;
+  }
+
+  if(TYPEOF(result) != STRSXP || XLENGTH(result) != n) {
+    printf("%s Plugin %s => %s() must return one string per file\n", LOG_ERROR, plugin->name, fn);
+    return 0;
+  }
+
+  PROTECT(result);
+  for(int i = 0; i < n; i++) {
+    SEXP elt = STRING_ELT(result, i);
+    if(elt == NA_STRING) continue;
+    SEXP value = PROTECT(ScalarString(elt));
+    set_value(&contents[i], value);
+    UNPROTECT(1);
+  }
+  UNPROTECT(1);
+
+  return 1;
+}
+
 char *plugins_call(Plugins *head, char *fn, char *str, char *file)
 {
-  char *copy = NULL;
+  Content content = {NULL, NULL, NULL};
 
   if(str != NULL) {
-    copy = strdup(str);
+    content.text = strdup(str);
   }
 
+  // made when the first R plugin is called, native ones do not need R
+  SEXP path = NULL;
+
   int max_iter = 64;
   Plugins *current = head;
   while(current != NULL) {
@@ -127,7 +757,7 @@ char *plugins_call(Plugins *head, char *fn, char *str, char *file)
 
     if(max_iter == 0) {
       printf("%s Plugin %s call to %s() exceeded max iterations (64)\n", LOG_ERROR, current->name, fn);
-      head = push_plugins(head, current->name, 0, R_NilValue);
+      head = push_plugins(head, current->name, 0, R_NilValue, NULL);
       current = current->next;
       continue;
     }
@@ -137,90 +767,377 @@ char *plugins_call(Plugins *head, char *fn, char *str, char *file)
       continue;
     }
 
-    SEXP func = PROTECT(
-      eval(
-        lang3(install("$"), current->obj, install(fn)), R_GlobalEnv
-      )
-    );
+    // each plugin works on the previous one's result
+    char *cached = result_path(current, fn, content_chars(&content), file);
+    int ok = 1;
 
-    SEXP call = NULL;
-    SEXP result = NULL;
-    int errorOccurred = 0;
-    if(str != NULL && file != NULL) {
-      call = PROTECT(lang3(func, mkString(str), mkString(file)));
-      result = R_tryEvalSilent(call, R_GlobalEnv, &errorOccurred);
-    } else if(str != NULL && file == NULL) {
-      call = PROTECT(lang2(func, mkString(str)));
-      result = R_tryEvalSilent(call, R_GlobalEnv, &errorOccurred);
-    } else {
-      call = PROTECT(lang1(func));
-      result = R_tryEvalSilent(call, R_GlobalEnv, &errorOccurred);
+    if(cached == NULL || !load_content(cached, &content)) {
+      if(current->native != NULL) {
+        ok = call_native(current, fn, &content, file);
+      } else {
+        SEXP func = find_hook(current, fn);
+        if(func != NULL && path == NULL) {
+          path = PROTECT(file != NULL ? mkString(file) : R_NilValue);
+        }
+        ok = func == NULL || call_hook(current, func, fn, &content, path);
+      }
+
+      if(ok && cached != NULL) {
+        store_result(cached, content_chars(&content));
+      }
     }
 
-    if(result == NULL || errorOccurred) {
-      printf("%s Failed to call plugin: %s => %s()\n", LOG_ERROR, current->name, fn);
-      UNPROTECT(2);
-      head = push_plugins(head, current->name, 0, R_NilValue);
-      current = current->next;
+    free(cached);
+    if(!ok) {
+      head = push_plugins(head, current->name, 0, R_NilValue, NULL);
+    }
+
+    current = current->next;
+  }
+
+  if(path != NULL) {
+    UNPROTECT(1);
+  }
+  return content_take(&content);
+}
+
+int plugins_batched(Plugins *head, char *fn)
+{
+  char *batched = NULL;
+  asprintf(&batched, "%s_all", fn);
+
+  int found = 0;
+  for(Plugins *current = head; current != NULL && !found; current = current->next) {
+    if(!current->setup) continue;
+    // native hooks are batched to run across threads, pure R ones to
+    // run across workers
+    found = current->native != NULL
+      ? native_transform(current->native, fn) != NULL
+      : find_hook(current, batched) != NULL
+        || (current->pure && plugin_workers > 1 && find_hook(current, fn) != NULL);
+  }
+
+  free(batched);
+  return found;
+}
+
+// an R hook over n files, in this process
+static int run_hook(Plugins *plugin, char *fn, char *batched, Content *contents, char **files, int n)
+{
+  SEXP all = find_hook(plugin, batched);
+  if(all != NULL) {
+    return call_hook_all(plugin, all, batched, contents, files, n);
+  }
+
+  SEXP func = find_hook(plugin, fn);
+  if(func == NULL) {
+    return 1;
+  }
+
+  for(int i = 0; i < n; i++) {
+    SEXP path = PROTECT(mkString(files[i]));
+    int ok = call_hook(plugin, func, fn, &contents[i], path);
+    UNPROTECT(1);
+    if(!ok) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+#ifndef BUILDER_NO_FORK
+
+// Pure R plugins can run in forked workers: each child inherits the
+// initialised R session copy-on-write, runs the hook over a contiguous
+// slice of the files and writes the results back through a pipe as 'T'
+// <length> <text> or 'N' per file, followed by 'K' on success. Slices
+// are read back in order, so the output does not depend on scheduling.
+
+typedef struct {
+  pid_t pid;
+  int fd;
+  int start;
+  int end;
+} Worker;
+
+static int write_all(int fd, const void *data, size_t len)
+{
+  const char *pos = data;
+  while(len > 0) {
+    ssize_t written = write(fd, pos, len);
+    if(written < 0 && errno == EINTR) continue;
+    if(written <= 0) return 0;
+    pos += written;
+    len -= written;
+  }
+  return 1;
+}
+
+static int read_all(int fd, void *data, size_t len)
+{
+  char *pos = data;
+  while(len > 0) {
+    ssize_t got = read(fd, pos, len);
+    if(got < 0 && errno == EINTR) continue;
+    if(got <= 0) return 0;
+    pos += got;
+    len -= got;
+  }
+  return 1;
+}
+
+static void run_worker(Plugins *plugin, char *fn, char *batched, Content *contents, char **files, int n, int fd)
+{
+  int ok = run_hook(plugin, fn, batched, contents, files, n);
+  fflush(stdout);
+
+  for(int i = 0; ok && i < n; i++) {
+    const char *text = content_chars(&contents[i]);
+    size_t len = text != NULL ? strlen(text) : 0;
+    ok = text != NULL
+      ? write_all(fd, "T", 1) && write_all(fd, &len, sizeof(len)) && write_all(fd, text, len)
+      : write_all(fd, "N", 1);
+  }
+
+  if(ok) {
+    write_all(fd, "K", 1);
+  }
+  close(fd);
+
+  // skip R's and the parent's exit handlers
+  _exit(ok ? 0 : 1);
+}
+
+static int collect_worker(Worker *worker, Content *contents)
+{
+  int ok = 1;
+  for(int i = worker->start; ok && i < worker->end; i++) {
+    char kind = 0;
+    ok = read_all(worker->fd, &kind, 1);
+    if(!ok || kind == 'N') {
+      if(ok) set_text(&contents[i], NULL);
       continue;
     }
 
-    UNPROTECT(2);
+    size_t len = 0;
+    ok = kind == 'T' && read_all(worker->fd, &len, sizeof(len));
+    if(!ok) continue;
 
-    if(result == R_NilValue) {
-      current = current->next;
+    char *text = malloc(len + 1);
+    ok = read_all(worker->fd, text, len);
+    text[len] = '\0';
+    if(!ok) {
+      free(text);
       continue;
     }
+    set_text(&contents[i], text);
+  }
 
-    if(TYPEOF(result) == STRSXP) {
-      copy = realloc(copy, strlen(CHAR(STRING_ELT(result, 0))) + 1);
-      strcpy(copy, CHAR(STRING_ELT(result, 0)));
+  char done = 0;
+  ok = ok && read_all(worker->fd, &done, 1) && done == 'K';
+  close(worker->fd);
+
+  int status = 0;
+  while(waitpid(worker->pid, &status, 0) < 0 && errno == EINTR);
+  return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int run_forked(Plugins *plugin, char *fn, char *batched, Content *contents, char **files, int n)
+{
+  int nworkers = plugin_workers < n ? plugin_workers : n;
+  Worker *workers = malloc(nworkers * sizeof(Worker));
+
+  // anything still buffered would otherwise be printed by every child
+  fflush(stdout);
+  fflush(stderr);
+
+  int ok = 1;
+  for(int w = 0; w < nworkers; w++) {
+    Worker *worker = &workers[w];
+    worker->start = (int)((long)n * w / nworkers);
+    worker->end = (int)((long)n * (w + 1) / nworkers);
+    worker->pid = -1;
+
+    int fds[2];
+    if(pipe(fds) == 0) {
+      worker->pid = fork();
+      if(worker->pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+      }
     }
 
-    current = current->next;
+    if(worker->pid == 0) {
+      close(fds[0]);
+      for(int prev = 0; prev < w; prev++) {
+        if(workers[prev].pid > 0) close(workers[prev].fd);
+      }
+      int count = worker->end - worker->start;
+      run_worker(plugin, fn, batched, contents + worker->start, files + worker->start, count, fds[1]);
+    }
+
+    if(worker->pid > 0) {
+      close(fds[1]);
+      worker->fd = fds[0];
+    }
+  }
+
+  for(int w = 0; w < nworkers; w++) {
+    Worker *worker = &workers[w];
+    int count = worker->end - worker->start;
+
+    // a worker that could not be started runs here instead
+    int done = worker->pid > 0
+      ? collect_worker(worker, contents)
+      : run_hook(plugin, fn, batched, contents + worker->start, files + worker->start, count);
+
+    if(!done) {
+      printf("%s Plugin worker failed: %s => %s()\n", LOG_ERROR, plugin->name, fn);
+      ok = 0;
+    }
   }
 
-  return copy;
+  free(workers);
+  return ok;
 }
 
-char *plugins_call_include(Plugins *head, char *type, char *path, char *object, char *file)
+#endif
+
+// one plugin's hook over n files
+static int run_all(Plugins *plugin, char *fn, char *batched, Content *contents, char **files, int n)
+{
+  if(n == 0) {
+    return 1;
+  }
+
+  if(plugin->native != NULL) {
+    builder_transform_fn transform = native_transform(plugin->native, fn);
+    return transform == NULL || call_native_all(plugin, fn, transform, contents, files, n);
+  }
+
+#ifndef BUILDER_NO_FORK
+  if(plugin->pure && plugin_workers > 1 && n > 1) {
+    return run_forked(plugin, fn, batched, contents, files, n);
+  }
+#endif
+
+  return run_hook(plugin, fn, batched, contents, files, n);
+}
+
+// a pure plugin only sees the files it has no stored result for
+static int run_all_cached(Plugins *plugin, char *fn, char *batched, Content *contents, char **files, int n)
 {
-  char *result_str = NULL;
+  char **cached = malloc(n * sizeof(char*));
+  Content *miss_contents = malloc(n * sizeof(Content));
+  char **miss_files = malloc(n * sizeof(char*));
+  int *miss = malloc(n * sizeof(int));
+  int m = 0;
+
+  for(int i = 0; i < n; i++) {
+    cached[i] = result_path(plugin, fn, content_chars(&contents[i]), files[i]);
+    if(cached[i] != NULL && load_content(cached[i], &contents[i])) {
+      continue;
+    }
+    miss_contents[m] = contents[i];
+    miss_files[m] = files[i];
+    miss[m++] = i;
+  }
+
+  int ok = run_all(plugin, fn, batched, miss_contents, miss_files, m);
+
+  for(int k = 0; k < m; k++) {
+    int i = miss[k];
+    contents[i] = miss_contents[k];
+    if(ok && cached[i] != NULL) {
+      store_result(cached[i], content_chars(&contents[i]));
+    }
+  }
+
+  for(int i = 0; i < n; i++) {
+    free(cached[i]);
+  }
+  free(cached);
+  free(miss_contents);
+  free(miss_files);
+  free(miss);
+  return ok;
+}
 
+// Runs a hook over every file at once: plugins defining <fn>_all get a
+// single call, the others one call per file. contents[i] is updated in
+// place and may be NULL.
+void plugins_call_all(Plugins *head, char *fn, char **contents, char **files, int n)
+{
+  char *batched = NULL;
+  asprintf(&batched, "%s_all", fn);
+
+  Content *items = malloc(n * sizeof(Content));
+  for(int i = 0; i < n; i++) {
+    items[i] = (Content){contents[i], NULL, NULL};
+  }
+
+  for(Plugins *current = head; current != NULL; current = current->next) {
+    if(current->setup == 0) {
+      continue;
+    }
+
+    int ok = current->pure && plugin_cache
+      ? run_all_cached(current, fn, batched, items, files, n)
+      : run_all(current, fn, batched, items, files, n);
+
+    if(!ok) {
+      head = push_plugins(head, current->name, 0, R_NilValue, NULL);
+    }
+  }
+
+  for(int i = 0; i < n; i++) {
+    contents[i] = content_take(&items[i]);
+  }
+
+  free(items);
+  free(batched);
+}
+
+char *plugins_call_include(Plugins *head, char *type, char *path, char *object, char *file)
+{
   Plugins *current = head;
   while(current != NULL) {
-    if(current->setup == 0) {
+    if(current->setup && current->native != NULL && current->native->include != NULL) {
+      char *out = NULL;
+      size_t len = 0;
+      int status = current->native->include(type, path, object, file, &out, &len);
+      if(status < 0) {
+        printf("%s Failed to call plugin: %s => include()\n", LOG_ERROR, current->name);
+      } else if(status == 1 && out != NULL) {
+        out = realloc(out, len + 1);
+        out[len] = '\0';
+        return out;
+      }
+      free(out);
       current = current->next;
       continue;
     }
 
-    SEXP func = PROTECT(
-      eval(
-        lang3(install("$"), current->obj, install("include")), R_GlobalEnv
-      )
-    );
+    SEXP func = current->setup ? find_hook(current, "include") : NULL;
+    if(func == NULL) {
+      current = current->next;
+      continue;
+    }
 
     int errorOccurred = 0;
     SEXP call = PROTECT(lang5(func, mkString(type), mkString(path), mkString(object), mkString(file)));
     SEXP result = R_tryEvalSilent(call, R_GlobalEnv, &errorOccurred);
+    UNPROTECT(1);
 
     if(result == NULL || errorOccurred) {
       printf("%s Failed to call plugin: %s => include()\n", LOG_ERROR, current->name);
-      UNPROTECT(2);
-      current = current->next;
-      continue;
-    }
-
-    UNPROTECT(2);
-
-    if(result == R_NilValue) {
       current = current->next;
       continue;
     }
 
     if(TYPEOF(result) == STRSXP) {
-      result_str = strdup(CHAR(STRING_ELT(result, 0)));
-      return result_str;
+      return strdup(CHAR(STRING_ELT(result, 0)));
     }
 
     current = current->next;
@@ -233,7 +1150,15 @@ void free_plugins(Plugins *head) {
   Plugins *current = head;
   while (current != NULL) {
     Plugins *next = current->next;
+    for(int i = 0; i < PLUGIN_HOOKS; i++) {
+      if(current->hooks[i] != NULL) R_ReleaseObject(current->hooks[i]);
+    }
+    if(current->native != NULL) {
+      builder_dlclose(current->native->handle);
+      free(current->native);
+    }
     free(current->name);
+    free(current->version);
     free(current);
     current = next;
   }
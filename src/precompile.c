@@ -0,0 +1,492 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "compat.h"
+#include "precompile.h"
+#include "buffer.h"
+#include "define.h"
+#include "hash.h"
+#include "log.h"
+#include "r.h"
+
+// The first pass only needs four things from a file: its defines, its
+// macros, its preflight blocks and its imports, in order. scan_header()
+// reduces a source to that list, already parsed, and apply_header()
+// replays it, which is all a precompiled header (.rhc) stores:
+//
+//   #> rhc 2 <hash of the .rh source> <its size> <its mtime>
+//   D <line> 0 <name length> <value length>\n<name>\n<value>\n
+//   M <line> <local> <name length> <definition length>\n<name>\n<definition>\n
+//   P <line> 0 0 <code length>\n\n<code>\n
+//   I <line> 0 0 <spec length>\n\n<spec>\n
+//
+// Namespaces are applied when a header is replayed, so a package's .rhc
+// works whatever it is imported as. A .rhc is current when the header's
+// size and mtime are the ones it records, or failing that when the hash
+// of the header matches. builder keeps its own copy per header in
+// .builder/rhc; a .rhc shipped next to the header (written with
+// -precompile, in a package's inst/) is used when there is none.
+
+#define RHC_DIR ".builder/rhc"
+#define RHC_VERSION 2
+
+typedef struct {
+  unsigned long long hash;
+  long long size;
+  long long mtime;
+} HeaderStamp;
+
+static void add_record(HeaderRecord ***tail, HeaderKind kind, int line, int local, char *name, char *text)
+{
+  HeaderRecord *record = malloc(sizeof(HeaderRecord));
+  record->kind = kind;
+  record->line = line;
+  record->local = local;
+  record->name = name;
+  record->text = text;
+  record->next = NULL;
+
+  **tail = record;
+  *tail = &record->next;
+}
+
+// blocks are joined with newlines, the first line starts the block
+static void append_line(Buffer *block, char *line)
+{
+  if(block->data != NULL) {
+    buffer_append_char(block, '\n');
+  }
+  buffer_append(block, line);
+}
+
+static void add_macro(HeaderRecord ***tail, int line, char *block)
+{
+  char *name = NULL;
+  char *body = NULL;
+  int local = 0;
+
+  if(parse_macro(block, &name, &body, &local)) {
+    add_record(tail, HEADER_MACRO, line, local, name, body);
+  }
+  free(block);
+}
+
+// "#> import pkg::file.rh", without trailing spaces
+static char *import_spec(char *line)
+{
+  char *spec = strdup(line + 10);
+  size_t len = strlen(spec);
+  while(len > 0 && (spec[len - 1] == '\r' || spec[len - 1] == ' ')) {
+    spec[--len] = '\0';
+  }
+  return spec;
+}
+
+HeaderRecord *scan_header(const char *content)
+{
+  HeaderRecord *records = NULL;
+  HeaderRecord **tail = &records;
+
+  Buffer block = {NULL, 0, 0};
+  Buffer line = {NULL, 0, 0};
+  int line_number = -1;
+  int in_preflight = 0;
+  int in_macro = 0;
+
+  const char *pos = content;
+  while(*pos) {
+    const char *new_line = strchr(pos, '\n');
+    if(!new_line) {
+      break;
+    }
+
+    line_number++;
+    line.len = 0;
+    buffer_append_len(&line, pos, new_line - pos);
+    pos = new_line + 1;
+
+    // imports are followed wherever they appear
+    if(strncmp(line.data, "#> import ", 10) == 0) {
+      add_record(&tail, HEADER_IMPORT, line_number, 0, strdup(""), import_spec(line.data));
+    }
+
+    if(enter_macro(line.data)) {
+      in_macro = 1;
+      append_line(&block, line.data);
+      continue;
+    }
+
+    if(strncmp(line.data, "#> endmacro", 11) == 0) {
+      in_macro = 0;
+      if(block.data != NULL) {
+        add_macro(&tail, line_number, buffer_release(&block));
+      }
+      continue;
+    }
+
+    if(in_macro) {
+      append_line(&block, line.data);
+      continue;
+    }
+
+    char *name = NULL;
+    char *value = NULL;
+    if(parse_define(line.data, &name, &value)) {
+      add_record(&tail, HEADER_DEFINE, line_number, 0, name, value);
+    }
+
+    if(strncmp(line.data, "#> import ", 10) == 0) {
+      continue;
+    }
+
+    if(strncmp(line.data, "#> preflight", 12) == 0) {
+      in_preflight = 1;
+      append_line(&block, line.data);
+      continue;
+    }
+
+    if(strncmp(line.data, "#> endpreflight", 15) == 0) {
+      in_preflight = 0;
+      continue;
+    }
+
+    if(strncmp(line.data, "#> endflight", 12) == 0) {
+      in_preflight = 0;
+      if(block.data != NULL) {
+        add_record(&tail, HEADER_PREFLIGHT, line_number, 0, strdup(""), buffer_release(&block));
+      }
+      continue;
+    }
+
+    if(in_preflight) {
+      append_line(&block, line.data);
+    }
+  }
+
+  // an unterminated macro or preflight is dropped
+  buffer_free(&block);
+  buffer_free(&line);
+  return records;
+}
+
+int apply_header(HeaderRecord *records, Define **defs, char *ns)
+{
+  char number[32];
+
+  for(HeaderRecord *record = records; record != NULL; record = record->next) {
+    // the line of the directive, as when the source is read line by line
+    if(strstr(record->text, "..LINE..") != NULL) {
+      snprintf(number, sizeof(number), "%d", record->line);
+      overwrite(defs, "..LINE..", number);
+    }
+
+    switch(record->kind) {
+      case HEADER_DEFINE:
+        define_variable(defs, record->name, record->text, ns);
+        break;
+      case HEADER_MACRO:
+        define_macro(defs, record->name, record->text, record->local, ns);
+        break;
+      case HEADER_PREFLIGHT:
+        printf("%s Running preflight checks\n", LOG_INFO);
+        if(evaluate(record->text) == NULL) {
+          printf("%s Preflight checks failed\n", LOG_ERROR);
+          return 1;
+        }
+        break;
+      case HEADER_IMPORT:
+        break;
+    }
+  }
+
+  return 0;
+}
+
+void free_header(HeaderRecord *records)
+{
+  while(records != NULL) {
+    HeaderRecord *next = records->next;
+    free(records->name);
+    free(records->text);
+    free(records);
+    records = next;
+  }
+}
+
+static unsigned long long header_hash(const char *content)
+{
+  return hash_bytes(content, strlen(content), HASH_SEED);
+}
+
+static char *read_file(const char *path, long *size)
+{
+  FILE *file = fopen(path, "rb");
+  if(file == NULL) {
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  *size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *data = malloc(*size + 1);
+  if(data == NULL || fread(data, 1, *size, file) != (size_t)*size) {
+    free(data);
+    fclose(file);
+    return NULL;
+  }
+  data[*size] = '\0';
+
+  fclose(file);
+  return data;
+}
+
+static int stat_header(const char *src, HeaderStamp *stamp)
+{
+  struct stat st;
+  if(stat(src, &st) != 0) {
+    return 0;
+  }
+
+  stamp->size = (long long)st.st_size;
+  stamp->mtime = (long long)st.st_mtime;
+  return 1;
+}
+
+// <len>\n<text>\n
+static char *read_field(const char **pos, const char *end, unsigned long len)
+{
+  if(len >= (unsigned long)(end - *pos) || (*pos)[len] != '\n') {
+    return NULL;
+  }
+
+  char *text = malloc(len + 1);
+  memcpy(text, *pos, len);
+  text[len] = '\0';
+  *pos += len + 1;
+  return text;
+}
+
+static int parse_precompiled(const char *data, long size, HeaderStamp *stamp, HeaderRecord **out)
+{
+  int version = 0;
+  int header_len = 0;
+  if(sscanf(data, "#> rhc %d %llx %lld %lld\n%n", &version, &stamp->hash, &stamp->size, &stamp->mtime, &header_len) != 4 || header_len == 0 || version != RHC_VERSION) {
+    return 0;
+  }
+
+  HeaderRecord *records = NULL;
+  HeaderRecord **tail = &records;
+
+  const char *pos = data + header_len;
+  const char *end = data + size;
+
+  while(pos < end) {
+    HeaderKind kind;
+    switch(*pos) {
+      case 'D': kind = HEADER_DEFINE; break;
+      case 'M': kind = HEADER_MACRO; break;
+      case 'P': kind = HEADER_PREFLIGHT; break;
+      case 'I': kind = HEADER_IMPORT; break;
+      default:
+        free_header(records);
+        return 0;
+    }
+
+    int line = 0, local = 0, used = 0;
+    unsigned long name_len = 0, text_len = 0;
+    if(sscanf(pos + 1, " %d %d %lu %lu\n%n", &line, &local, &name_len, &text_len, &used) != 4 || used == 0) {
+      free_header(records);
+      return 0;
+    }
+    pos += 1 + used;
+
+    char *name = read_field(&pos, end, name_len);
+    char *text = name != NULL ? read_field(&pos, end, text_len) : NULL;
+    if(text == NULL) {
+      free(name);
+      free_header(records);
+      return 0;
+    }
+
+    add_record(&tail, kind, line, local, name, text);
+  }
+
+  *out = records;
+  return 1;
+}
+
+// 1 when the .rhc at path is current for src, 2 when it is but was
+// stamped with another size or mtime; content is src's when already read.
+// hash is set to the header's hash.
+static int load_rhc(const char *path, const char *src, const char *content, HeaderRecord **records, unsigned long long *hash)
+{
+  long size = 0;
+  char *data = read_file(path, &size);
+  if(data == NULL) {
+    return 0;
+  }
+
+  HeaderStamp stamp, current;
+  HeaderRecord *parsed = NULL;
+  int ok = parse_precompiled(data, size, &stamp, &parsed);
+  free(data);
+
+  if(!ok || !stat_header(src, &current)) {
+    free_header(parsed);
+    return 0;
+  }
+
+  *hash = stamp.hash;
+
+  if(current.size == stamp.size && current.mtime == stamp.mtime) {
+    *records = parsed;
+    return 1;
+  }
+
+  char *source = content == NULL ? read_file(src, &size) : NULL;
+  const char *text = content != NULL ? content : source;
+  ok = text != NULL && header_hash(text) == stamp.hash;
+  free(source);
+
+  if(!ok) {
+    free_header(parsed);
+    return 0;
+  }
+
+  *records = parsed;
+  return 2;
+}
+
+// foo.rh -> foo.rhc
+static char *rhc_path(const char *src)
+{
+  size_t len = strlen(src);
+  if(len < 3 || strcmp(src + len - 3, ".rh") != 0) {
+    return NULL;
+  }
+
+  char *path = NULL;
+  asprintf(&path, "%sc", src);
+  return path;
+}
+
+static char *cache_path(const char *src)
+{
+  char *path = NULL;
+  asprintf(&path, "%s/%016llx%s", RHC_DIR, header_hash(src), HEADER_EXT);
+  return path;
+}
+
+static int write_precompiled(const char *path, HeaderStamp *stamp, HeaderRecord *records)
+{
+  static const char KINDS[] = {'D', 'M', 'P', 'I'};
+
+  char *tmp = NULL;
+  asprintf(&tmp, "%s.tmp", path);
+
+  FILE *file = fopen(tmp, "wb");
+  if(file == NULL) {
+    free(tmp);
+    return 0;
+  }
+
+  fprintf(file, "#> rhc %d %016llx %lld %lld\n", RHC_VERSION, stamp->hash, stamp->size, stamp->mtime);
+  for(HeaderRecord *record = records; record != NULL; record = record->next) {
+    fprintf(
+      file, "%c %d %d %zu %zu\n%s\n%s\n", KINDS[record->kind], record->line, record->local,
+      strlen(record->name), strlen(record->text), record->name, record->text
+    );
+  }
+
+  int ok = fclose(file) == 0 && rename(tmp, path) == 0;
+  if(!ok) {
+    remove(tmp);
+  }
+
+  free(tmp);
+  return ok;
+}
+
+// the header's copy in .builder/rhc, stamped with its current size and
+// mtime
+static void store_precompiled(const char *src, unsigned long long hash, HeaderRecord *records)
+{
+  HeaderStamp stamp = {hash, 0, 0};
+  if(!stat_header(src, &stamp)) {
+    return;
+  }
+
+  builder_mkdir(".builder", 0755);
+  builder_mkdir(RHC_DIR, 0755);
+
+  char *cached = cache_path(src);
+  write_precompiled(cached, &stamp, records);
+  free(cached);
+}
+
+// content may be NULL, the header is then only read if its size or mtime
+// changed since the .rhc was written
+int load_precompiled(const char *src, const char *content, HeaderRecord **records)
+{
+  unsigned long long hash = 0;
+
+  char *cached = cache_path(src);
+  int found = load_rhc(cached, src, content, records, &hash);
+  free(cached);
+
+  if(!found) {
+    char *shipped = rhc_path(src);
+    found = shipped != NULL && load_rhc(shipped, src, content, records, &hash) ? 2 : 0;
+    free(shipped);
+  }
+
+  // restamped, so the next build does not hash the header again
+  if(found == 2) {
+    store_precompiled(src, hash, *records);
+  }
+
+  return found != 0;
+}
+
+void save_precompiled(const char *src, const char *content, HeaderRecord *records)
+{
+  store_precompiled(src, header_hash(content), records);
+}
+
+int precompile_header(const char *path)
+{
+  char *dest = rhc_path(path);
+  if(dest == NULL) {
+    printf("%s Not a header file: %s\n", LOG_ERROR, path);
+    return 1;
+  }
+
+  long size = 0;
+  char *content = read_file(path, &size);
+  HeaderStamp stamp = {0, 0, 0};
+  if(content == NULL || !stat_header(path, &stamp)) {
+    printf("%s Failed to read header: %s\n", LOG_ERROR, path);
+    free(content);
+    free(dest);
+    return 1;
+  }
+
+  stamp.hash = header_hash(content);
+  HeaderRecord *records = scan_header(content);
+  int ok = write_precompiled(dest, &stamp, records);
+  free_header(records);
+  free(content);
+
+  if(!ok) {
+    printf("%s Failed to write %s\n", LOG_ERROR, dest);
+    free(dest);
+    return 1;
+  }
+
+  printf("%s Precompiled %s to %s\n", LOG_INFO, path, dest);
+  free(dest);
+  return 0;
+}
@@ -3,7 +3,9 @@
 #include <string.h>
 #include <Rinternals.h>
 #include <R_ext/Parse.h>
+#include <Rembedded.h>
 #include "compat.h"
+#include "hash.h"
 #include "log.h"
 
 void set_R_home()
@@ -28,6 +30,29 @@ void set_R_home()
   builder_pclose(fp);
 }
 
+static int r_started = 0;
+
+// R is only started the first time something needs it, builds that
+// only use defines and native conditions never load it
+void start_R()
+{
+  if(r_started) return;
+
+  set_R_home();
+
+  char *r_argv[] = {"R", "--silent", "--no-save"};
+  Rf_initEmbeddedR(3, r_argv);
+  r_started = 1;
+}
+
+void end_R()
+{
+  if(!r_started) return;
+
+  Rf_endEmbeddedR(0);
+  r_started = 0;
+}
+
 static char *remove_trailing_newline(char *line)
 {
   size_t len = strlen(line);
@@ -37,39 +62,58 @@ static char *remove_trailing_newline(char *line)
   return line;
 }
 
-SEXP evaluate(char *expr)
+// parse `expr` and return its first expression, unprotected
+static SEXP parse_first(char *expr)
 {
-  SEXP code_sexp, result;
   ParseStatus status;
-  int has_error;
 
-  PROTECT(code_sexp = mkString(expr));
+  start_R();
 
+  SEXP code_sexp = PROTECT(mkString(expr));
   SEXP parsed = PROTECT(R_ParseVector(code_sexp, -1, &status, R_NilValue));
 
-  if (status != PARSE_OK) {
+  if (status != PARSE_OK || XLENGTH(parsed) == 0) {
     UNPROTECT(2);
     printf("%s Parsing expression `%s`\n", LOG_ERROR, remove_trailing_newline(expr));
     return NULL;
   }
 
-  result = PROTECT(R_tryEvalSilent(VECTOR_ELT(parsed, 0), R_GlobalEnv, &has_error));
+  SEXP first = VECTOR_ELT(parsed, 0);
+  UNPROTECT(2);
+
+  return first;
+}
+
+static SEXP evaluate_parsed(SEXP code, char *expr)
+{
+  int has_error;
+
+  SEXP result = R_tryEvalSilent(code, R_GlobalEnv, &has_error);
 
   if (has_error) {
-    UNPROTECT(3);
     printf("%s Evaluating expression `%s`\n", LOG_ERROR, remove_trailing_newline(expr));
     return NULL;
   }
 
-  UNPROTECT(3);
-
   return result;
 }
 
-int evaluate_if(char *expr)
+SEXP evaluate(char *expr)
 {
-  SEXP result = evaluate(expr);
+  SEXP code = parse_first(expr);
+  if (code == NULL) {
+    return NULL;
+  }
 
+  PROTECT(code);
+  SEXP result = evaluate_parsed(code, expr);
+  UNPROTECT(1);
+
+  return result;
+}
+
+static int as_condition(SEXP result, char *expr)
+{
   if(result == NULL) {
     return 0;
   }
@@ -82,6 +126,69 @@ int evaluate_if(char *expr)
   return asLogical(result);
 }
 
+int evaluate_if(char *expr)
+{
+  return as_condition(evaluate(expr), expr);
+}
+
+// #> if conditions seen during the current build, keyed by their
+// (define-expanded) text: each is parsed once and, unless volatile,
+// evaluated once
+typedef struct {
+  SEXP code;
+  int result;
+  int evaluated;
+} Condition;
+
+static HashMap *conditions = NULL;
+
+static void free_condition(void *value)
+{
+  Condition *cond = value;
+  if(cond->code != NULL) R_ReleaseObject(cond->code);
+  free(cond);
+}
+
+int evaluate_if_cached(char *expr, int is_volatile)
+{
+  char *key = strdup(expr);
+  size_t len = strlen(key);
+  while(len > 0 && (key[len - 1] == '\n' || key[len - 1] == '\r' || key[len - 1] == ' ')) {
+    key[--len] = '\0';
+  }
+
+  if(conditions == NULL) {
+    conditions = hashmap_create(64);
+  }
+
+  Condition *cond = hashmap_get(conditions, key);
+  if(cond == NULL) {
+    cond = malloc(sizeof(Condition));
+    cond->code = parse_first(key);
+    cond->result = 0;
+    cond->evaluated = 0;
+    if(cond->code != NULL) R_PreserveObject(cond->code);
+    hashmap_set(conditions, key, cond);
+  }
+
+  if(cond->code == NULL || (cond->evaluated && !is_volatile)) {
+    free(key);
+    return cond->result;
+  }
+
+  cond->result = as_condition(evaluate_parsed(cond->code, key), key);
+  cond->evaluated = 1;
+
+  free(key);
+  return cond->result;
+}
+
+void clear_if_cache()
+{
+  hashmap_free(conditions, free_condition);
+  conditions = NULL;
+}
+
 const char *eval_string(char *expr)
 {
   SEXP result = evaluate(expr);
@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <strings.h>
+
+#include "reader.h"
+#include "deparse.h"
+#include "buffer.h"
+
+// C versions of the built-in readLines, read.csv and read.delim readers.
+// They write the literal dput() gives for the reader's result, for files
+// whose reading is unambiguous; anything else (embedded NULs, invalid
+// UTF-8, ragged rows, names check.names would rewrite, ...) returns NULL
+// so the include goes through R instead.
+
+typedef enum {
+  COLUMN_LOGICAL,
+  COLUMN_INTEGER,
+  COLUMN_REAL,
+  COLUMN_STRING
+} ColumnType;
+
+typedef struct {
+  char *text;
+  int quoted;
+} Field;
+
+typedef struct {
+  Field *fields;
+  size_t count;
+  size_t cap;
+} Fields;
+
+static void push_field(Fields *fields, char *text, int quoted)
+{
+  if(fields->count == fields->cap) {
+    fields->cap = fields->cap ? fields->cap * 2 : 256;
+    fields->fields = realloc(fields->fields, sizeof(Field) * fields->cap);
+  }
+  fields->fields[fields->count].text = text;
+  fields->fields[fields->count].quoted = quoted;
+  fields->count++;
+}
+
+static void free_fields(Fields *fields)
+{
+  for(size_t i = 0; i < fields->count; i++) free(fields->fields[i].text);
+  free(fields->fields);
+}
+
+static int valid_utf8(const unsigned char *p, size_t size)
+{
+  size_t i = 0;
+  while(i < size) {
+    unsigned char c = p[i];
+    int extra = 0;
+
+    if(c == 0) return 0;
+    if(c < 0x80) { i++; continue; }
+    else if(c >= 0xc2 && c <= 0xdf) extra = 1;
+    else if(c >= 0xe0 && c <= 0xef) extra = 2;
+    else if(c >= 0xf0 && c <= 0xf4) extra = 3;
+    else return 0;
+
+    if(i + extra >= size) return 0;
+    for(int k = 1; k <= extra; k++) {
+      if((p[i + k] & 0xc0) != 0x80) return 0;
+    }
+    i += extra + 1;
+  }
+  return 1;
+}
+
+static char *copy_range(const char *start, size_t len)
+{
+  char *out = malloc(len + 1);
+  memcpy(out, start, len);
+  out[len] = '\0';
+  return out;
+}
+
+static void append_vector_open(Buffer *buf, size_t n)
+{
+  if(n > 1) buffer_append(buf, "c(");
+}
+
+static void append_vector_close(Buffer *buf, size_t n)
+{
+  if(n > 1) buffer_append_char(buf, ')');
+}
+
+// readLines(): one string per line, \n or \r\n terminated, the last line
+// possibly unterminated
+static char *read_lines(const char *content, size_t size)
+{
+  size_t n = 0;
+  for(size_t i = 0; i < size; i++) {
+    if(content[i] == '\n') n++;
+    if(content[i] == '\r' && (i + 1 == size || content[i + 1] != '\n')) return NULL;
+  }
+  if(size > 0 && content[size - 1] != '\n') n++;
+
+  Buffer buf;
+  buffer_init(&buf, size + n * 4 + 16);
+
+  if(n == 0) {
+    buffer_append(&buf, "character(0)");
+    return buffer_release(&buf);
+  }
+
+  append_vector_open(&buf, n);
+
+  const char *pos = content;
+  const char *end = content + size;
+  for(size_t i = 0; i < n; i++) {
+    const char *nl = memchr(pos, '\n', end - pos);
+    size_t len = nl != NULL ? (size_t)(nl - pos) : (size_t)(end - pos);
+    if(len > 0 && pos[len - 1] == '\r') len--;
+
+    char *line = copy_range(pos, len);
+    if(i > 0) buffer_append(&buf, ", ");
+    deparse_string(&buf, line);
+    free(line);
+
+    pos = nl != NULL ? nl + 1 : end;
+  }
+
+  append_vector_close(&buf, n);
+  return buffer_release(&buf);
+}
+
+// Splits one record starting at *pos. Returns the number of fields, or -1
+// for input read.table() would treat in ways not handled here.
+static int split_record(const char **pos, const char *end, char sep, Fields *fields)
+{
+  const char *p = *pos;
+  int count = 0;
+
+  for(;;) {
+    if(p < end && *p == '"') {
+      Buffer text;
+      buffer_init(&text, 32);
+      p++;
+      for(;;) {
+        if(p >= end) {
+          buffer_free(&text);
+          return -1;
+        }
+        if(*p == '"') {
+          if(p + 1 < end && p[1] == '"') {
+            buffer_append_char(&text, '"');
+            p += 2;
+            continue;
+          }
+          p++;
+          break;
+        }
+        buffer_append_char(&text, *p++);
+      }
+      push_field(fields, buffer_release(&text), 1);
+    } else {
+      const char *start = p;
+      while(p < end && *p != sep && *p != '\n' && *p != '\r') {
+        if(*p == '"') return -1;
+        p++;
+      }
+      push_field(fields, copy_range(start, p - start), 0);
+    }
+    count++;
+
+    if(p >= end) break;
+    if(*p == sep) {
+      p++;
+      continue;
+    }
+    if(*p == '\r') {
+      if(p + 1 >= end || p[1] != '\n') return -1;
+      p++;
+    }
+    if(*p == '\n') {
+      p++;
+      break;
+    }
+    // text after a closing quote
+    return -1;
+  }
+
+  *pos = p;
+  return count;
+}
+
+static int is_logical_token(const char *s)
+{
+  static const char *TOKENS[] = {"T", "F", "TRUE", "FALSE", "true", "false", "True", "False", NULL};
+  for(int i = 0; TOKENS[i] != NULL; i++) {
+    if(strcmp(s, TOKENS[i]) == 0) return 1;
+  }
+  return 0;
+}
+
+static int is_integer_token(const char *s)
+{
+  const char *p = s;
+  if(*p == '+' || *p == '-') p++;
+  if(!isdigit((unsigned char)*p)) return 0;
+  while(isdigit((unsigned char)*p)) p++;
+  if(*p != '\0') return 0;
+
+  errno = 0;
+  long value = strtol(s, NULL, 10);
+  // INT_MIN is NA_integer_ in R
+  return errno == 0 && value <= INT_MAX && value > INT_MIN;
+}
+
+// R_strtod() as type.convert() uses it: "NA" is only ever missing, the
+// special values are case insensitive and 0x starts a hexadecimal number.
+// -1 for hexadecimal forms C's strtod() might not read the same way.
+static int is_real_token(const char *s)
+{
+  const char *p = s;
+  int digits = 0;
+
+  if(strncmp(p, "NA", 2) == 0) return 0;
+  if(*p == '+' || *p == '-') p++;
+
+  // R reads the "Inf" of "infinity" and leaves the rest, so it is text
+  if(strcasecmp(p, "NaN") == 0 || strcasecmp(p, "Inf") == 0) {
+    return 1;
+  }
+
+  if(p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && p[2] != '\0') {
+    char *end = NULL;
+    strtod(s, &end);
+    return isxdigit((unsigned char)p[2]) && *end == '\0' ? 1 : -1;
+  }
+
+  while(isdigit((unsigned char)*p)) { p++; digits++; }
+  if(*p == '.') {
+    p++;
+    while(isdigit((unsigned char)*p)) { p++; digits++; }
+  }
+  if(digits == 0) return 0;
+
+  if(*p == 'e' || *p == 'E') {
+    p++;
+    if(*p == '+' || *p == '-') p++;
+    if(!isdigit((unsigned char)*p)) return 0;
+    while(isdigit((unsigned char)*p)) p++;
+  }
+
+  return *p == '\0';
+}
+
+static int is_na(Field *field)
+{
+  return !field->quoted && strcmp(field->text, "NA") == 0;
+}
+
+// type.convert() of a column; -1 when it would not be decided as below
+static int column_type(Fields *fields, int ncol, size_t nrow, int col)
+{
+  int logical = 1, integer = 1, real = 1, values = 0;
+
+  for(size_t r = 0; r < nrow; r++) {
+    Field *field = &fields->fields[(r + 1) * ncol + col];
+    const char *s = field->text;
+
+    if(is_na(field) || s[0] == '\0') continue;
+    if(field->quoted && strcmp(s, "NA") == 0) return -1;
+
+    size_t len = strlen(s);
+    if(isspace((unsigned char)s[0]) || isspace((unsigned char)s[len - 1])) return -1;
+
+    values++;
+    logical = logical && is_logical_token(s);
+    integer = integer && is_integer_token(s);
+
+    int number = is_real_token(s);
+    if(number < 0) return -1;
+    real = real && number;
+  }
+
+  if(values == 0 || logical) return COLUMN_LOGICAL;
+  if(integer) return COLUMN_INTEGER;
+  if(real) return COLUMN_REAL;
+  return COLUMN_STRING;
+}
+
+static int is_int_sequence(int *values, int *na, size_t n)
+{
+  if(n < 2) return 0;
+  for(size_t i = 0; i < n; i++) {
+    if(na[i]) return 0;
+    if(i > 0 && values[i] != values[i - 1] + 1) return 0;
+  }
+  return 1;
+}
+
+static void append_column(Buffer *buf, Fields *fields, int ncol, size_t nrow, int col, int type)
+{
+  char tmp[32];
+
+  if(type == COLUMN_INTEGER) {
+    int *values = malloc(sizeof(int) * nrow);
+    int *na = malloc(sizeof(int) * nrow);
+    for(size_t r = 0; r < nrow; r++) {
+      Field *field = &fields->fields[(r + 1) * ncol + col];
+      na[r] = is_na(field) || field->text[0] == '\0';
+      values[r] = na[r] ? 0 : (int)strtol(field->text, NULL, 10);
+    }
+
+    if(is_int_sequence(values, na, nrow)) {
+      snprintf(tmp, sizeof(tmp), "%d:%d", values[0], values[nrow - 1]);
+      buffer_append(buf, tmp);
+    } else {
+      append_vector_open(buf, nrow);
+      for(size_t r = 0; r < nrow; r++) {
+        if(r > 0) buffer_append(buf, ", ");
+        if(na[r]) {
+          buffer_append(buf, "NA");
+          continue;
+        }
+        snprintf(tmp, sizeof(tmp), "%dL", values[r]);
+        buffer_append(buf, tmp);
+      }
+      append_vector_close(buf, nrow);
+    }
+
+    free(values);
+    free(na);
+    return;
+  }
+
+  append_vector_open(buf, nrow);
+  for(size_t r = 0; r < nrow; r++) {
+    Field *field = &fields->fields[(r + 1) * ncol + col];
+    const char *s = field->text;
+    if(r > 0) buffer_append(buf, ", ");
+
+    if(is_na(field) || (s[0] == '\0' && type != COLUMN_STRING)) {
+      buffer_append(buf, "NA");
+      continue;
+    }
+
+    switch(type) {
+      case COLUMN_LOGICAL:
+        buffer_append(buf, s[0] == 'T' || s[0] == 't' ? "TRUE" : "FALSE");
+        break;
+      case COLUMN_REAL: {
+        double value = strtod(s, NULL);
+        if(isnan(value)) {
+          buffer_append(buf, "NaN");
+        } else if(isinf(value)) {
+          buffer_append(buf, value > 0 ? "Inf" : "-Inf");
+        } else {
+          char *num = format_real(value);
+          buffer_append(buf, num);
+          free(num);
+        }
+        break;
+      }
+      default:
+        deparse_string(buf, s);
+    }
+  }
+  append_vector_close(buf, nrow);
+}
+
+// Indices of the header fields named in select (comma separated), in that
+// order, or of every column when select is NULL. Unknown or repeated
+// names give NULL.
+static int *select_columns(Fields *fields, int ncol, const char *select, int *nsel)
+{
+  int *columns = malloc(sizeof(int) * (ncol + 1));
+  *nsel = 0;
+
+  if(select == NULL) {
+    for(int c = 0; c < ncol; c++) columns[(*nsel)++] = c;
+    return columns;
+  }
+
+  char *work = strdup(select);
+  char *saveptr;
+  for(char *name = strtok_r(work, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+    int found = -1;
+    for(int c = 0; c < ncol; c++) {
+      if(strcmp(fields->fields[c].text, name) == 0) found = c;
+    }
+
+    for(int i = 0; i < *nsel && found >= 0; i++) {
+      if(columns[i] == found) found = -1;
+    }
+
+    if(found < 0 || *nsel == ncol) {
+      free(work);
+      free(columns);
+      return NULL;
+    }
+    columns[(*nsel)++] = found;
+  }
+
+  free(work);
+  if(*nsel == 0) {
+    free(columns);
+    return NULL;
+  }
+  return columns;
+}
+
+// read.csv()/read.delim(): header, no row names, rectangular; select
+// projects the columns as subset(select = ) would
+static char *read_delim(const char *content, size_t size, char sep, const char *select)
+{
+  Fields fields = {NULL, 0, 0};
+  const char *pos = content;
+  const char *end = content + size;
+  int ncol = -1;
+  size_t nrecords = 0;
+
+  while(pos < end) {
+    // blank.lines.skip
+    if(*pos == '\n') { pos++; continue; }
+    if(*pos == '\r' && pos + 1 < end && pos[1] == '\n') { pos += 2; continue; }
+
+    int count = split_record(&pos, end, sep, &fields);
+    if(count < 0 || (ncol >= 0 && count != ncol)) {
+      free_fields(&fields);
+      return NULL;
+    }
+    ncol = count;
+    nrecords++;
+  }
+
+  // header only: read.csv() gives zero-length logical columns, rare
+  // enough to leave to R
+  if(nrecords < 2) {
+    free_fields(&fields);
+    return NULL;
+  }
+
+  for(int c = 0; c < ncol; c++) {
+    const char *name = fields.fields[c].text;
+    if(!is_syntactic(name)) {
+      free_fields(&fields);
+      return NULL;
+    }
+    for(int k = 0; k < c; k++) {
+      if(strcmp(name, fields.fields[k].text) == 0) {
+        free_fields(&fields);
+        return NULL;
+      }
+    }
+  }
+
+  int nsel = 0;
+  int *columns = select_columns(&fields, ncol, select, &nsel);
+  if(columns == NULL) {
+    free_fields(&fields);
+    return NULL;
+  }
+
+  size_t nrow = nrecords - 1;
+  int *types = malloc(sizeof(int) * nsel);
+  for(int i = 0; i < nsel; i++) {
+    types[i] = column_type(&fields, ncol, nrow, columns[i]);
+    if(types[i] < 0) {
+      free(types);
+      free(columns);
+      free_fields(&fields);
+      return NULL;
+    }
+  }
+
+  Buffer buf;
+  buffer_init(&buf, size * 2 + 64);
+
+  buffer_append(&buf, "structure(list(");
+  for(int i = 0; i < nsel; i++) {
+    if(i > 0) buffer_append(&buf, ", ");
+    buffer_append(&buf, fields.fields[columns[i]].text);
+    buffer_append(&buf, " = ");
+    append_column(&buf, &fields, ncol, nrow, columns[i], types[i]);
+  }
+
+  // subset() indexes the rows, which leaves the compact row names
+  // positive
+  char rows[32];
+  snprintf(rows, sizeof(rows), "%s%zuL", select != NULL ? "" : "-", nrow);
+  buffer_append(&buf, "), class = \"data.frame\", row.names = c(NA, ");
+  buffer_append(&buf, rows);
+  buffer_append(&buf, "))");
+
+  free(types);
+  free(columns);
+  free_fields(&fields);
+  return buffer_release(&buf);
+}
+
+char *read_native(const char *call, const char *select, const char *content, size_t size)
+{
+  if(!valid_utf8((const unsigned char *)content, size)) {
+    return NULL;
+  }
+
+  // a byte order mark ends up in the first line or column name
+  if(size >= 3 && memcmp(content, "\xef\xbb\xbf", 3) == 0) {
+    return NULL;
+  }
+
+  if(strcmp(call, "readLines") == 0) {
+    return select == NULL ? read_lines(content, size) : NULL;
+  }
+
+  if(strcmp(call, "read.csv") == 0) {
+    return read_delim(content, size, ',', select);
+  }
+
+  if(strcmp(call, "read.delim") == 0) {
+    return read_delim(content, size, '\t', select);
+  }
+
+  return NULL;
+}
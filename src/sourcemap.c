@@ -32,3 +32,21 @@ char *add_sourcemap(char *line, int line_number, char *filename)
   free(line_str);
   return new_line;
 }
+
+// #line N "file": R's parser takes the next line as line N of file
+char *line_directive(int line_number, char *filename)
+{
+  size_t len = strlen(filename);
+  char *escaped = malloc(2 * len + 1);
+  char *q = escaped;
+  for(size_t i = 0; i < len; i++) {
+    if(filename[i] == '"' || filename[i] == '\\') *q++ = '\\';
+    *q++ = filename[i];
+  }
+  *q = '\0';
+
+  char *directive = NULL;
+  asprintf(&directive, "#line %d \"%s\"", line_number, escaped);
+  free(escaped);
+  return directive;
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "watch.h"
+#include "ignore.h"
 #include "log.h"
 
 #ifdef __linux__
@@ -25,7 +26,7 @@ static void signal_handler(int sig)
 		got_signal = 1;
 }
 
-static int add_watch_recursive(int fd, const char *path)
+static int add_watch_recursive(int fd, const char *path, Ignore *ignore, size_t root)
 {
 		int wd = inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
 		if (wd == -1) return -1;
@@ -41,7 +42,8 @@ static int add_watch_recursive(int fd, const char *path)
 				if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
 
 				snprintf(subpath, PATH_MAX, "%s/%s", path, entry->d_name);
-				add_watch_recursive(fd, subpath);
+				if (is_ignored(ignore, subpath + root, 1)) continue;
+				add_watch_recursive(fd, subpath, ignore, root);
 		}
 
 		closedir(dir);
@@ -63,7 +65,11 @@ int watch_init(const char *path)
 				return -1;
 		}
 
-		if (add_watch_recursive(fd, path) == -1) {
+		Ignore *ignore = load_ignore(IGNORE_FILE);
+		int wd = add_watch_recursive(fd, path, ignore, ignore_prefix(path));
+		free_ignore(ignore);
+
+		if (wd == -1) {
 				printf("%s Failed to add watch on %s\n", LOG_ERROR, path);
 				close(fd);
 				return -1;